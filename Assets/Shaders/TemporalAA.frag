@@ -1,13 +1,53 @@
 #version 330
-uniform sampler2D current;
-uniform sampler2D previous;
+uniform sampler2D current;  // this frame, jittered, render target size
+uniform sampler2D velocity; // current - previous, in uv
+uniform sampler2D history;  // accumulated result, window size
+// the render targets are allocated at the max render scale, only the
+// bottom left current_size texels are this frame
+uniform vec2 current_size;
+uniform vec2 jitter_uv; // this frame's jitter offset
+uniform bool history_valid;
 
 in vec2 frag_uv;
 layout(location = 0) out vec4 ALBEDO;
 void main()
 {
-  vec4 previous = texture2D(previous, frag_uv);
-  vec4 current = texture2D(current, frag_uv);
-  vec4 result = mix(previous, current, 0.5f);
-  ALBEDO = result;
-}
\ No newline at end of file
+  // where this output pixel landed in the jittered render, in texels
+  vec2 current_pixel = (frag_uv + jitter_uv) * current_size;
+  current_pixel = clamp(current_pixel, vec2(0.5), current_size - 0.5);
+  vec2 current_uv = current_pixel / vec2(textureSize(current, 0));
+  vec4 current_color = texture(current, current_uv);
+
+  // 3x3 neighbourhood bounds, history outside of these is stale
+  ivec2 last_texel = ivec2(current_size) - 1;
+  ivec2 center = ivec2(current_pixel);
+  vec4 lo = current_color;
+  vec4 hi = current_color;
+  for (int y = -1; y <= 1; ++y)
+  {
+    for (int x = -1; x <= 1; ++x)
+    {
+      ivec2 p = clamp(center + ivec2(x, y), ivec2(0), last_texel);
+      vec4 c = texelFetch(current, p, 0);
+      lo = min(lo, c);
+      hi = max(hi, c);
+    }
+  }
+
+  vec2 history_uv = frag_uv - texture(velocity, current_uv).xy;
+  bool offscreen = any(lessThan(history_uv, vec2(0))) ||
+                   any(greaterThan(history_uv, vec2(1)));
+  if (!history_valid || offscreen)
+  {
+    ALBEDO = current_color;
+    return;
+  }
+  vec4 previous = clamp(texture(history, history_uv), lo, hi);
+
+  // the render target can be smaller than the output, so trust the current
+  // sample more when a render target texel center lands near this pixel
+  vec2 d = fract(current_pixel) - 0.5;
+  float confidence = exp(-4.0 * dot(d, d));
+  float alpha = mix(0.03, 0.15, confidence);
+  ALBEDO = mix(previous, current_color, alpha);
+}
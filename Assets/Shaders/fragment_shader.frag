@@ -1,9 +1,27 @@
 #version 330
-uniform sampler2D albedo;
-uniform sampler2D specular;
-uniform sampler2D normal;
-uniform sampler2D emissive;
-uniform sampler2D roughness;
+// Shader::load inserts the permutation #defines here:
+// ALBEDO_MAP, SPECULAR_MAP, NORMAL_MAP, EMISSIVE_MAP, ROUGHNESS_MAP when the
+// material has that texture, ALPHA_BLEND for the translucent pass and
+// LIGHT_TYPES, a mask of the light types in use
+#define PARALLEL_LIGHT 1
+#define OMNI_LIGHT 2
+#define SPOT_LIGHT 4
+#ifndef LIGHT_TYPES
+#define LIGHT_TYPES (PARALLEL_LIGHT | OMNI_LIGHT | SPOT_LIGHT)
+#endif
+// each texture is a layer of the array bound for it
+// color maps are srgb textures and the target is srgb, so everything in
+// here is linear
+uniform sampler2DArray albedo;
+uniform sampler2DArray specular;
+uniform sampler2DArray normal;
+uniform sampler2DArray emissive;
+uniform sampler2DArray roughness;
+uniform int texture_layers[5]; // albedo, specular, normal, emissive, roughness
+// used by permutations without the map
+uniform vec4 albedo_constant;
+uniform vec3 emissive_constant;
+uniform float roughness_constant;
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
@@ -11,7 +29,6 @@ uniform vec3 additional_ambient;
 uniform float time;
 uniform vec3 camera_position;
 uniform vec2 uv_scale;
-uniform bool discard_over_blend;
 struct Light
 {
   vec3 position;
@@ -30,15 +47,22 @@ uniform int number_of_lights;
 in vec3 frag_world_position;
 in mat3 frag_TBN;
 in vec2 frag_uv;
+in vec4 frag_current_clip;
+in vec4 frag_previous_clip;
 
 layout(location = 0) out vec4 ALBEDO;
+layout(location = 1) out vec2 VELOCITY;
+
+// screen space motion in uv units, current - previous
+vec2 velocity()
+{
+  vec2 current = frag_current_clip.xy / frag_current_clip.w;
+  vec2 previous = frag_previous_clip.xy / frag_previous_clip.w;
+  return 0.5 * (current - previous);
+}
 
 
 const float PI = 3.14159265358979f;
-const float gamma = 2.2;
-vec3 to_linear(in vec3 srgb) { return pow(srgb, vec3(gamma)); }
-float to_linear(in float srgb) { return pow(srgb, gamma); }
-vec3 to_srgb(in vec3 linear) { return pow(linear, vec3(1 / gamma)); }
 float linearize_depth(float z)
 {
   float near = 0.1;
@@ -55,61 +79,82 @@ struct Material
   float shininess;
 };
 
+// l points from the fragment to the light
+float cone_falloff(int i, vec3 l)
+{
+  vec3 dir = normalize(lights[i].position - lights[i].direction);
+  float theta = lights[i].cone_angle;
+  float phi = 1.0 - dot(l, dir);
+  float edge_softness_distance = 2.3f * theta;
+  return clamp((theta - phi) / edge_softness_distance, 0, 1);
+}
+
 void main()
 {
-  vec4 albedo_tex = texture2D(albedo, frag_uv).rgba;
+#ifdef ALBEDO_MAP
+  vec4 albedo_tex = texture(albedo, vec3(frag_uv, texture_layers[0])).rgba;
+#else
+  vec4 albedo_tex = albedo_constant;
+#endif
 
-  if(discard_over_blend)
-  {
-    if(albedo_tex.a < 0.3)
-      discard;
-  }
+#ifndef ALPHA_BLEND
+  if (albedo_tex.a < 0.3)
+    discard;
+#endif
 
   Material m;
-  m.specular = to_linear(texture2D(specular, frag_uv).rgb);
-  m.albedo = to_linear(albedo_tex.rgb) / PI;
-  m.emissive = to_linear(texture2D(emissive, frag_uv).rgb);
-  m.shininess = 1.0 + 84 * (1.0 - to_linear(texture2D(roughness, frag_uv).r));
-  vec3 n = texture2D(normal, frag_uv).rgb;
-  if (n == vec3(0))
-  {
-    n = vec3(0, 0, 1);
-    m.normal = frag_TBN * n;
-  }
-  else
-  {
-    m.normal = frag_TBN * normalize((n * 2) - 1.0f);
-  }
+#ifdef SPECULAR_MAP
+  m.specular = texture(specular, vec3(frag_uv, texture_layers[1])).rgb;
+#else
+  m.specular = vec3(0);
+#endif
+  m.albedo = albedo_tex.rgb / PI;
+#ifdef EMISSIVE_MAP
+  m.emissive = texture(emissive, vec3(frag_uv, texture_layers[3])).rgb;
+#else
+  m.emissive = emissive_constant;
+#endif
+#ifdef ROUGHNESS_MAP
+  float r = texture(roughness, vec3(frag_uv, texture_layers[4])).r;
+#else
+  float r = roughness_constant;
+#endif
+  m.shininess = 1.0 + 84 * (1.0 - r);
+#ifdef NORMAL_MAP
+  // normal maps are stored as two channels, z is always out of the surface
+  vec2 xy = texture(normal, vec3(frag_uv, texture_layers[2])).rg * 2 - 1.0f;
+  vec3 n = vec3(xy, sqrt(clamp(1 - dot(xy, xy), 0, 1)));
+  m.normal = frag_TBN * n;
+#else
+  m.normal = frag_TBN * vec3(0, 0, 1);
+#endif
   vec3 debug = vec3(-1);
   vec3 result = vec3(0);
+#if LIGHT_TYPES != 0
+  vec3 v = normalize(camera_position - frag_world_position);
   for (int i = 0; i < number_of_lights; ++i)
   {
     vec3 l = lights[i].position - frag_world_position;
     float d = length(l);
     l = normalize(l);
-    vec3 v = normalize(camera_position - frag_world_position);
-    vec3 h = normalize(l + v);
     vec3 att = lights[i].attenuation;
     float at = 1.0 / (att.x + (att.y * d) + (att.z * d * d));
     float alpha = 1.0f;
 
+    // the type is only tested when more than one kind is in use
+#if LIGHT_TYPES == SPOT_LIGHT
+    alpha = cone_falloff(i, l);
+#elif (LIGHT_TYPES & SPOT_LIGHT) != 0
+    if (lights[i].type == 2)
+      alpha = cone_falloff(i, l);
+#endif
+#if LIGHT_TYPES == PARALLEL_LIGHT
+    l = -lights[i].direction;
+#elif (LIGHT_TYPES & PARALLEL_LIGHT) != 0
     if (lights[i].type == 0)
-    { // directional
       l = -lights[i].direction;
-      h = normalize(l + v);
-    }
-    else if (lights[i].type == 2)
-    { // cone
-      vec3 dir = normalize(lights[i].position - lights[i].direction);
-      float theta = lights[i].cone_angle;
-      float phi = 1.0 - dot(l, dir);
-      alpha = 0.0f;
-      if (phi < theta)
-      {
-        float edge_softness_distance = 2.3f*theta;
-        alpha = clamp((theta - phi) / edge_softness_distance, 0, 1);
-      }
-    }
+#endif
+    vec3 h = normalize(l + v);
     float ldotn = clamp(dot(l, m.normal), 0, 1);
     float ec = (8.0f * m.shininess) / (8.0f * PI);
     float specular = ec * pow(max(dot(h, m.normal), 0.0), m.shininess);
@@ -118,6 +163,7 @@ void main()
     result += ldotn * specular * m.albedo * lights[i].color * at * alpha;
     result += ambient;
   }
+#endif
   result += m.emissive;
   result += additional_ambient * m.albedo;
 
@@ -126,5 +172,6 @@ void main()
 
  //result = vec3(texture2D(roughness, frag_uv).r);
  //  ALBEDO = vec4(m.normal,1);
- ALBEDO = vec4(to_srgb(result),albedo_tex.a);
+ ALBEDO = vec4(result, albedo_tex.a);
+ VELOCITY = velocity();
 }
@@ -15,6 +15,8 @@ layout(location = 9) in mat4 instanced_model;
 out vec3 frag_world_position;
 out mat3 frag_TBN;
 out vec2 frag_uv;
+out vec4 frag_current_clip;
+out vec4 frag_previous_clip;
 void main()
 {
   vec3 t = normalize(instanced_model * vec4(tangent, 0)).xyz;
@@ -25,6 +27,9 @@ void main()
   frag_uv = uv_scale * vec2(uv.x, uv.y);
 
   float s = sin(time);
-  gl_Position = txaa_jitter*instanced_MVP * vec4(position, 1);
+  // no previous instance matrices yet, instances have no motion vectors
+  frag_current_clip = instanced_MVP * vec4(position, 1);
+  frag_previous_clip = frag_current_clip;
+  gl_Position = txaa_jitter * frag_current_clip;
   // gl_Position = instanced_MVP*vec4(position,1);
 }
@@ -1,11 +1,24 @@
 #version 330
 uniform sampler2D albedo;
+// fraction of albedo that holds the image, render targets are allocated
+// larger than what's drawn into them
+uniform vec2 uv_scale;
 
 in vec2 frag_uv;
 
 layout(location = 0) out vec4 ALBEDO;
 
+// albedo is an srgb target, sampling it decodes and this output isn't
+// encoded by the ROPs
+vec3 to_srgb(vec3 linear)
+{
+  vec3 lo = linear * 12.92;
+  vec3 hi = 1.055 * pow(linear, vec3(1 / 2.4)) - 0.055;
+  return mix(hi, lo, lessThanEqual(linear, vec3(0.0031308)));
+}
+
 void main()
 {
-  ALBEDO = texture2D(albedo, frag_uv);
+  vec4 color = texture(albedo, uv_scale * frag_uv);
+  ALBEDO = vec4(to_srgb(color.rgb), color.a);
 }
\ No newline at end of file
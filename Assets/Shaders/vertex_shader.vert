@@ -4,7 +4,13 @@ uniform vec3 camera_position;
 uniform vec2 uv_scale;
 uniform mat4 txaa_jitter;
 uniform mat4 MVP;
+uniform mat4 previous_MVP;
 uniform mat4 Model;
+// instanced draws read MVP, previous_MVP and Model from instance_transforms,
+// 3 matrices per instance starting at instance_offset
+uniform bool instanced;
+uniform int instance_offset;
+uniform samplerBuffer instance_transforms;
 
 layout(location = 0) in vec3 position;
 layout(location = 1) in vec3 normal;
@@ -15,14 +21,37 @@ layout(location = 4) in vec3 bitangent;
 out vec3 frag_world_position;
 out mat3 frag_TBN;
 out vec2 frag_uv;
+out vec4 frag_current_clip;  // unjittered
+out vec4 frag_previous_clip; // unjittered
+
+mat4 fetch_transform(int i)
+{
+  return mat4(texelFetch(instance_transforms, 4 * i),
+              texelFetch(instance_transforms, 4 * i + 1),
+              texelFetch(instance_transforms, 4 * i + 2),
+              texelFetch(instance_transforms, 4 * i + 3));
+}
+
 void main()
 {
-  vec3 t = normalize(Model * vec4(tangent, 0)).xyz;
-  vec3 b = normalize(Model * vec4(bitangent, 0)).xyz;
-  vec3 n = normalize(Model * vec4(normal, 0)).xyz;
+  mat4 mvp = MVP;
+  mat4 previous_mvp = previous_MVP;
+  mat4 model = Model;
+  if (instanced)
+  {
+    int i = 3 * (instance_offset + gl_InstanceID);
+    mvp = fetch_transform(i);
+    previous_mvp = fetch_transform(i + 1);
+    model = fetch_transform(i + 2);
+  }
+  vec3 t = normalize(model * vec4(tangent, 0)).xyz;
+  vec3 b = normalize(model * vec4(bitangent, 0)).xyz;
+  vec3 n = normalize(model * vec4(normal, 0)).xyz;
   frag_TBN = mat3(t, b, n);
-  frag_world_position = (Model * vec4(position, 1)).xyz;
+  frag_world_position = (model * vec4(position, 1)).xyz;
   frag_uv = uv_scale * vec2(uv.x, uv.y);
 
-  gl_Position = txaa_jitter* MVP * vec4(position, 1);
+  frag_current_clip = mvp * vec4(position, 1);
+  frag_previous_clip = previous_mvp * vec4(position, 1);
+  gl_Position = txaa_jitter * frag_current_clip;
 }
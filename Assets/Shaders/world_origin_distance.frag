@@ -1,9 +1,9 @@
 #version 330
-uniform sampler2D albedo;
-uniform sampler2D specular;
-uniform sampler2D normal;
-uniform sampler2D emissive;
-uniform sampler2D roughness;
+uniform sampler2DArray albedo;
+uniform sampler2DArray specular;
+uniform sampler2DArray normal;
+uniform sampler2DArray emissive;
+uniform sampler2DArray roughness;
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
@@ -28,8 +28,19 @@ uniform uint number_of_lights;
 in vec3 frag_world_position;
 in mat3 frag_TBN;
 in vec2 frag_uv;
+in vec4 frag_current_clip;
+in vec4 frag_previous_clip;
+
 layout(location = 0) out vec4 ALBEDO;
-#define gamma 2.2
+layout(location = 1) out vec2 VELOCITY;
+
+// screen space motion in uv units, current - previous
+vec2 velocity()
+{
+  vec2 current = frag_current_clip.xy / frag_current_clip.w;
+  vec2 previous = frag_previous_clip.xy / frag_previous_clip.w;
+  return 0.5 * (current - previous);
+}
 
 float linearize_depth(float depth)
 {
@@ -38,7 +49,6 @@ float linearize_depth(float depth)
   float z = depth * 2.0 - 1.0;
   return (2.0 * near * far) / (far + near - z * (far - near));
 }
-vec3 to_srgb(in vec3 linear) { return pow(linear, vec3(1 / gamma)); }
 
 float epsilon = 0.00001;
 void main()
@@ -56,5 +66,7 @@ void main()
     color += 0.5f*vec3(1.000f+sin(time*10)*dist);
   }
 
-  ALBEDO = vec4(to_srgb(color), 1);
+  // the render target encodes to srgb
+  ALBEDO = vec4(color, 1);
+  VELOCITY = velocity();
 }
\ No newline at end of file
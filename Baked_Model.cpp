@@ -0,0 +1,481 @@
+#include "Baked_Model.h"
+#include "Globals.h"
+#include "Mesh_Loader.h"
+#include "Render.h"
+#include <assimp/Importer.hpp>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <thread>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#define BAKED_MODEL_MAGIC 0x4c444d57 // 'WMDL'
+// bump when the layout or what's baked into it changes
+#define BAKED_MODEL_VERSION 2
+static_assert(sizeof(Baked_Node) == 84, "");
+static_assert(sizeof(Baked_Mesh) == 112, "");
+static_assert(sizeof(Baked_Material) == 24, "");
+static_assert(sizeof(Baked_Model_Header) == 80, "");
+
+Mapped_File::Mapped_File(const std::string &path)
+{
+#ifdef _WIN32
+  std::ifstream file(path, std::ios::binary | std::ios::ate);
+  if (!file.is_open())
+    return;
+  buffer.resize(size_t(file.tellg()));
+  file.seekg(0);
+  file.read((char *)buffer.data(), buffer.size());
+  if (!file || buffer.empty())
+    return;
+  data = buffer.data();
+  size = buffer.size();
+#else
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return;
+  struct stat attr;
+  if (fstat(fd, &attr) == 0 && attr.st_size > 0)
+  {
+    void *mapping =
+        mmap(nullptr, size_t(attr.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping != MAP_FAILED)
+    {
+      data = (const uint8 *)mapping;
+      size = size_t(attr.st_size);
+    }
+  }
+  // the mapping keeps the file
+  close(fd);
+#endif
+}
+
+Mapped_File::~Mapped_File()
+{
+#ifndef _WIN32
+  if (data)
+    munmap((void *)data, size);
+#endif
+}
+
+static std::string full_model_path(const std::string &path)
+{
+  return BASE_MODEL_PATH + path;
+}
+
+std::string baked_model_path(const std::string &path, int assimp_flags)
+{
+  const uint64 key =
+      hash_bytes(&assimp_flags, sizeof(assimp_flags),
+                 hash_bytes(path.c_str(), path.size()));
+  return BASE_CACHE_PATH + "Models/" + s(key) + ".wmdl";
+}
+
+uint64 baked_model_stamp(const std::string &path, int assimp_flags)
+{
+  struct stat attr;
+  if (stat(full_model_path(path).c_str(), &attr) != 0)
+    return 0;
+  // the lods are baked too, so their limit is part of the format
+  const uint64 values[] = {BAKED_MODEL_VERSION, uint64(attr.st_mtime),
+                           uint64(attr.st_size), uint64(assimp_flags),
+                           MAX_MESH_LODS};
+  return hash_bytes(values, sizeof(values));
+}
+
+static uint64 align_16(uint64 offset) { return (offset + 15) & ~uint64(15); }
+
+// appends size bytes at the next 16 byte boundary, returns where they went
+static uint64 append_aligned(std::vector<uint8> *out, const void *data,
+                             size_t size)
+{
+  const uint64 offset = align_16(out->size());
+  out->resize(offset + size);
+  if (size)
+    memcpy(&(*out)[offset], data, size);
+  return offset;
+}
+
+// narrowed in place when index_size is 2
+static void append_indices(std::vector<uint8> *out,
+                           const std::vector<uint32> &indices,
+                           uint32 index_size)
+{
+  const size_t offset = out->size();
+  out->resize(offset + indices.size() * index_size);
+  if (index_size == 4)
+  {
+    memcpy(&(*out)[offset], indices.data(), indices.size() * sizeof(uint32));
+    return;
+  }
+  uint16 *narrow = (uint16 *)&(*out)[offset];
+  for (size_t i = 0; i < indices.size(); ++i)
+    narrow[i] = uint16(indices[i]);
+}
+
+struct Baked_Strings
+{
+  std::string table;
+  std::unordered_map<std::string, uint32> offsets;
+  uint32 add(const std::string &str)
+  {
+    auto it = offsets.find(str);
+    if (it != offsets.end())
+      return it->second;
+    const uint32 offset = table.size();
+    table.append(str.c_str(), str.size() + 1);
+    offsets[str] = offset;
+    return offset;
+  }
+};
+
+// depth first, so children always come after their parent
+static uint32 bake_node(const aiNode *node, Baked_Strings *strings,
+                        std::vector<Baked_Node> *nodes,
+                        std::vector<uint32> *references)
+{
+  const uint32 index = nodes->size();
+  Baked_Node baked;
+  memset(&baked, 0, sizeof(baked));
+  baked.name = strings->add(copy(&node->mName));
+  const mat4 basis = copy(node->mTransformation);
+  memcpy(baked.basis, &basis[0][0], sizeof(baked.basis));
+  baked.first_mesh = references->size();
+  baked.mesh_count = node->mNumMeshes;
+  references->insert(references->end(), node->mMeshes,
+                     node->mMeshes + node->mNumMeshes);
+  nodes->push_back(baked);
+
+  std::vector<uint32> children;
+  for (uint32 i = 0; i < node->mNumChildren; ++i)
+    children.push_back(
+        bake_node(node->mChildren[i], strings, nodes, references));
+  (*nodes)[index].first_child = references->size();
+  (*nodes)[index].child_count = children.size();
+  references->insert(references->end(), children.begin(), children.end());
+  return index;
+}
+
+bool bake_model(const aiScene *scene, const std::string &path,
+                int assimp_flags)
+{
+  ASSERT(scene);
+  ASSERT(scene->mRootNode);
+  Baked_Model_Header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = BAKED_MODEL_MAGIC;
+  header.version = BAKED_MODEL_VERSION;
+  header.stamp = baked_model_stamp(path, assimp_flags);
+  if (!header.stamp)
+    return false;
+
+  Baked_Strings strings;
+  std::vector<Baked_Node> nodes;
+  std::vector<uint32> references;
+  bake_node(scene->mRootNode, &strings, &nodes, &references);
+
+  const std::string full_path = full_model_path(path);
+  const size_t slice = full_path.find_last_of("/\\");
+  const std::string directory = full_path.substr(0, slice) + '/';
+  std::vector<Baked_Material> materials;
+  for (uint32 i = 0; i < scene->mNumMaterials; ++i)
+  {
+    const Material_Descriptor m =
+        import_material(scene->mMaterials[i], directory);
+    Baked_Material baked;
+    baked.albedo = strings.add(m.albedo);
+    baked.specular = strings.add(m.specular);
+    baked.emissive = strings.add(m.emissive);
+    baked.normal = strings.add(m.normal);
+    baked.ambient_occlusion = strings.add(m.ambient_occlusion);
+    baked.roughness = strings.add(m.roughness);
+    materials.push_back(baked);
+  }
+
+  // blob offsets are relative to the start of the blobs until the
+  // sections in front of them are placed
+  std::vector<uint8> blobs;
+  std::vector<Baked_Mesh> meshes;
+  for (uint32 i = 0; i < scene->mNumMeshes; ++i)
+  {
+    const Mesh_Data data = load_mesh(scene->mMeshes[i], "");
+    Baked_Mesh baked;
+    memset(&baked, 0, sizeof(baked));
+    baked.name = strings.add(data.name);
+    baked.material = scene->mMeshes[i]->mMaterialIndex;
+    baked.vertex_count = data.positions.size();
+    baked.lod_count = 1 + data.lod_indices.size();
+    baked.lod_index_counts[0] = data.indices.size();
+    for (uint32 lod = 1; lod < baked.lod_count; ++lod)
+      baked.lod_index_counts[lod] = data.lod_indices[lod - 1].size();
+    vec3 bounds_min = vec3(0);
+    vec3 bounds_max = vec3(0);
+    if (!data.positions.empty())
+      bounds_min = bounds_max = data.positions[0];
+    for (const vec3 &p : data.positions)
+    {
+      bounds_min = min(bounds_min, p);
+      bounds_max = max(bounds_max, p);
+    }
+    memcpy(baked.bounds_min, &bounds_min[0], sizeof(baked.bounds_min));
+    memcpy(baked.bounds_max, &bounds_max[0], sizeof(baked.bounds_max));
+
+    const size_t vec3_bytes = data.positions.size() * sizeof(vec3);
+    baked.positions =
+        append_aligned(&blobs, data.positions.data(), vec3_bytes);
+    baked.normals = append_aligned(&blobs, data.normals.data(), vec3_bytes);
+    baked.texture_coordinates =
+        append_aligned(&blobs, data.texture_coordinates.data(),
+                       data.texture_coordinates.size() * sizeof(vec2));
+    baked.tangents = append_aligned(&blobs, data.tangents.data(), vec3_bytes);
+    baked.bitangents =
+        append_aligned(&blobs, data.bitangents.data(), vec3_bytes);
+    baked.index_size = index_size_for(baked.vertex_count);
+    baked.indices = append_aligned(&blobs, nullptr, 0);
+    append_indices(&blobs, data.indices, baked.index_size);
+    for (const std::vector<uint32> &lod : data.lod_indices)
+      append_indices(&blobs, lod, baked.index_size);
+    meshes.push_back(baked);
+  }
+
+  header.node_count = nodes.size();
+  header.mesh_count = meshes.size();
+  header.material_count = materials.size();
+  header.reference_count = references.size();
+  header.string_bytes = strings.table.size();
+  header.nodes = align_16(sizeof(header));
+  header.meshes = align_16(header.nodes + nodes.size() * sizeof(Baked_Node));
+  header.materials =
+      align_16(header.meshes + meshes.size() * sizeof(Baked_Mesh));
+  header.references =
+      align_16(header.materials + materials.size() * sizeof(Baked_Material));
+  header.strings =
+      align_16(header.references + references.size() * sizeof(uint32));
+  const uint64 blob_base = align_16(header.strings + strings.table.size());
+  for (Baked_Mesh &mesh : meshes)
+  {
+    mesh.positions += blob_base;
+    mesh.normals += blob_base;
+    mesh.texture_coordinates += blob_base;
+    mesh.tangents += blob_base;
+    mesh.bitangents += blob_base;
+    mesh.indices += blob_base;
+  }
+
+  std::vector<uint8> file;
+  file.reserve(blob_base + blobs.size());
+  append_aligned(&file, &header, sizeof(header));
+  append_aligned(&file, nodes.data(), nodes.size() * sizeof(Baked_Node));
+  append_aligned(&file, meshes.data(), meshes.size() * sizeof(Baked_Mesh));
+  append_aligned(&file, materials.data(),
+                 materials.size() * sizeof(Baked_Material));
+  append_aligned(&file, references.data(), references.size() * sizeof(uint32));
+  append_aligned(&file, strings.table.data(), strings.table.size());
+  append_aligned(&file, blobs.data(), blobs.size());
+
+  // written aside and renamed over, a reader never sees half a file
+  // bakes can run on several threads, each writes its own
+  create_directories(BASE_CACHE_PATH + "Models/");
+  const std::string baked_path = baked_model_path(path, assimp_flags);
+  const size_t thread_id =
+      std::hash<std::thread::id>()(std::this_thread::get_id());
+  const std::string temporary_path = s(baked_path, ".", thread_id, ".tmp");
+  {
+    std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open())
+      return false;
+    out.write((const char *)file.data(), file.size());
+    if (!out.good())
+      return false;
+  }
+  std::remove(baked_path.c_str());
+  return std::rename(temporary_path.c_str(), baked_path.c_str()) == 0;
+}
+
+// the contents are our own and trusted, only the layout is checked
+static bool validate(const Baked_Model &model)
+{
+  const Baked_Model_Header &header = *model.header;
+  const uint64 size = model.file->size;
+  auto in_file = [&](uint64 offset, uint64 count, uint64 element) {
+    return offset % 4 == 0 && offset <= size &&
+           count <= (size - offset) / element;
+  };
+  if (header.node_count == 0 ||
+      !in_file(header.nodes, header.node_count, sizeof(Baked_Node)) ||
+      !in_file(header.meshes, header.mesh_count, sizeof(Baked_Mesh)) ||
+      !in_file(header.materials, header.material_count,
+               sizeof(Baked_Material)) ||
+      !in_file(header.references, header.reference_count, sizeof(uint32)) ||
+      !in_file(header.strings, header.string_bytes, 1) ||
+      header.string_bytes == 0 ||
+      model.file->data[header.strings + header.string_bytes - 1] != 0)
+    return false;
+  auto in_strings = [&](uint32 offset) {
+    return offset < header.string_bytes;
+  };
+
+  for (uint32 i = 0; i < header.node_count; ++i)
+  {
+    const Baked_Node &node = model.nodes[i];
+    if (!in_strings(node.name) ||
+        uint64(node.first_mesh) + node.mesh_count > header.reference_count ||
+        uint64(node.first_child) + node.child_count > header.reference_count)
+      return false;
+    for (uint32 j = 0; j < node.mesh_count; ++j)
+      if (model.references[node.first_mesh + j] >= header.mesh_count)
+        return false;
+    // children come after their parent, so there are no cycles
+    for (uint32 j = 0; j < node.child_count; ++j)
+    {
+      const uint32 child = model.references[node.first_child + j];
+      if (child <= i || child >= header.node_count)
+        return false;
+    }
+  }
+  for (uint32 i = 0; i < header.material_count; ++i)
+  {
+    const Baked_Material &material = model.materials[i];
+    for (uint32 offset :
+         {material.albedo, material.specular, material.emissive,
+          material.normal, material.ambient_occlusion, material.roughness})
+      if (!in_strings(offset))
+        return false;
+  }
+  for (uint32 i = 0; i < header.mesh_count; ++i)
+  {
+    const Baked_Mesh &mesh = model.meshes[i];
+    if (!in_strings(mesh.name) || mesh.material >= header.material_count ||
+        mesh.lod_count == 0 || mesh.lod_count > MAX_MESH_LODS ||
+        (mesh.index_size != 2 && mesh.index_size != 4))
+      return false;
+    uint64 index_count = 0;
+    for (uint32 lod = 0; lod < mesh.lod_count; ++lod)
+      index_count += mesh.lod_index_counts[lod];
+    const uint64 n = mesh.vertex_count;
+    if (!in_file(mesh.positions, n, sizeof(vec3)) ||
+        !in_file(mesh.normals, n, sizeof(vec3)) ||
+        !in_file(mesh.texture_coordinates, n, sizeof(vec2)) ||
+        !in_file(mesh.tangents, n, sizeof(vec3)) ||
+        !in_file(mesh.bitangents, n, sizeof(vec3)) ||
+        !in_file(mesh.indices, index_count, mesh.index_size))
+      return false;
+  }
+  return true;
+}
+
+bool open_baked_model(const std::string &path, int assimp_flags,
+                      Baked_Model *result)
+{
+  const uint64 stamp = baked_model_stamp(path, assimp_flags);
+  if (!stamp)
+    return false;
+  std::shared_ptr<Mapped_File> file =
+      std::make_shared<Mapped_File>(baked_model_path(path, assimp_flags));
+  if (!file->data || file->size < sizeof(Baked_Model_Header))
+    return false;
+  Baked_Model model;
+  model.file = file;
+  model.header = (const Baked_Model_Header *)file->data;
+  if (model.header->magic != BAKED_MODEL_MAGIC ||
+      model.header->version != BAKED_MODEL_VERSION ||
+      model.header->stamp != stamp)
+    return false;
+  model.nodes = model.blob<Baked_Node>(model.header->nodes);
+  model.meshes = model.blob<Baked_Mesh>(model.header->meshes);
+  model.materials = model.blob<Baked_Material>(model.header->materials);
+  model.references = model.blob<uint32>(model.header->references);
+  if (!validate(model))
+    return false;
+  *result = model;
+  return true;
+}
+
+// every file under directory, relative to root
+static void find_files(const std::string &root, const std::string &directory,
+                       std::vector<std::string> *result)
+{
+#ifdef _WIN32
+  _finddata_t entry;
+  const intptr_t handle =
+      _findfirst((root + directory + "*").c_str(), &entry);
+  if (handle == -1)
+    return;
+  do
+  {
+    const std::string name = entry.name;
+    if (name == "." || name == "..")
+      continue;
+    if (entry.attrib & _A_SUBDIR)
+      find_files(root, directory + name + "/", result);
+    else
+      result->push_back(directory + name);
+  } while (_findnext(handle, &entry) == 0);
+  _findclose(handle);
+#else
+  DIR *dir = opendir((root + directory).c_str());
+  if (!dir)
+    return;
+  while (dirent *entry = readdir(dir))
+  {
+    const std::string name = entry->d_name;
+    if (name == "." || name == "..")
+      continue;
+    struct stat attr;
+    if (stat((root + directory + name).c_str(), &attr) != 0)
+      continue;
+    if (S_ISDIR(attr.st_mode))
+      find_files(root, directory + name + "/", result);
+    else
+      result->push_back(directory + name);
+  }
+  closedir(dir);
+#endif
+}
+
+int cook_models()
+{
+  std::vector<std::string> files;
+  find_files(BASE_MODEL_PATH, "", &files);
+  Assimp::Importer importer;
+  uint32 cooked = 0;
+  uint32 current = 0;
+  uint32 failed = 0;
+  for (const std::string &path : files)
+  {
+    const size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos ||
+        !importer.IsExtensionSupported(path.substr(dot).c_str()))
+      continue;
+    Baked_Model existing;
+    if (open_baked_model(path, default_assimp_flags, &existing))
+    {
+      current += 1;
+      continue;
+    }
+    const aiScene *scene =
+        importer.ReadFile(full_model_path(path).c_str(), default_assimp_flags);
+    if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE ||
+        !scene->mRootNode || !bake_model(scene, path, default_assimp_flags))
+    {
+      set_message("Cook failed: ", path + " " + importer.GetErrorString());
+      failed += 1;
+      continue;
+    }
+    set_message("Cooked: ", path);
+    cooked += 1;
+  }
+  set_message(s("Cooked ", cooked, " models, ", current, " up to date, ",
+                failed, " failed"));
+  push_log_to_disk();
+  return failed ? 1 : 0;
+}
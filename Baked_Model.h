@@ -0,0 +1,126 @@
+#pragma once
+#include "Globals.h"
+#include <assimp/scene.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// cooked aiScenes: the node tree, every mesh's vertex and index blobs laid
+// out the way they're uploaded and the map paths of their materials
+// the files are mapped and read in place, no assimp and no parsing
+// cpu only, cooking can run without a gl context
+
+// a whole file mapped read only, data is null if it couldn't be opened
+struct Mapped_File
+{
+  Mapped_File(const std::string &path);
+  ~Mapped_File();
+  Mapped_File(const Mapped_File &) = delete;
+  Mapped_File &operator=(const Mapped_File &) = delete;
+  const uint8 *data = nullptr;
+  size_t size = 0;
+
+private:
+#ifdef _WIN32
+  std::vector<uint8> buffer; // read rather than mapped
+#endif
+};
+
+// names and paths are offsets into the string table, nul terminated
+// blobs are file offsets, 16 byte aligned
+struct Baked_Node
+{
+  uint32 name;
+  float32 basis[16]; // column major, assimp's mtransformation
+  // into the references
+  uint32 first_mesh;
+  uint32 mesh_count;
+  uint32 first_child;
+  uint32 child_count;
+};
+struct Baked_Mesh
+{
+  uint32 name;
+  uint32 material; // index into the materials
+  uint32 vertex_count;
+  // [0] is the full mesh, every level's indices follow it in one blob
+  uint32 lod_count;
+  uint32 lod_index_counts[MAX_MESH_LODS];
+  uint32 index_size; // 2 or 4 bytes, see index_size_for()
+  uint32 unused;
+  float32 bounds_min[3];
+  float32 bounds_max[3];
+  // vec3 per vertex, except vec2 texture_coordinates
+  uint64 positions;
+  uint64 normals;
+  uint64 texture_coordinates;
+  uint64 tangents;
+  uint64 bitangents;
+  uint64 indices;
+};
+// what import_material() found, paths prefixed with the model's directory
+struct Baked_Material
+{
+  uint32 albedo;
+  uint32 specular;
+  uint32 emissive;
+  uint32 normal;
+  uint32 ambient_occlusion;
+  uint32 roughness;
+};
+struct Baked_Model_Header
+{
+  uint32 magic;
+  uint32 version;
+  uint64 stamp;
+  uint32 node_count; // [0] is the root
+  uint32 mesh_count;
+  uint32 material_count;
+  uint32 reference_count;
+  uint32 string_bytes;
+  uint32 unused;
+  uint64 nodes;
+  uint64 meshes;
+  uint64 materials;
+  uint64 references; // uint32 mesh and child node indices
+  uint64 strings;
+};
+
+// a baked file that passed validation, every offset in it is in bounds
+struct Baked_Model
+{
+  std::shared_ptr<Mapped_File> file;
+  const Baked_Model_Header *header = nullptr;
+  const Baked_Node *nodes = nullptr;
+  const Baked_Mesh *meshes = nullptr;
+  const Baked_Material *materials = nullptr;
+  const uint32 *references = nullptr;
+
+  const char *string(uint32 offset) const
+  {
+    return (const char *)file->data + header->strings + offset;
+  }
+  template <typename T> const T *blob(uint64 offset) const
+  {
+    return (const T *)(file->data + offset);
+  }
+};
+
+// where the baked version of path under BASE_MODEL_PATH goes
+std::string baked_model_path(const std::string &path, int assimp_flags);
+
+// identifies the source file and how it was imported, 0 if it's missing
+// only the model file itself is checked, not the materials it references
+uint64 baked_model_stamp(const std::string &path, int assimp_flags);
+
+// path is relative to BASE_MODEL_PATH, scene was imported from it
+bool bake_model(const aiScene *scene, const std::string &path,
+                int assimp_flags);
+
+// false if the file is missing, stale or malformed
+bool open_baked_model(const std::string &path, int assimp_flags,
+                      Baked_Model *result);
+
+// bakes every model under BASE_MODEL_PATH with default_assimp_flags
+// returns nonzero if any failed
+int cook_models();
@@ -0,0 +1,142 @@
+#include "File_Watcher.h"
+#include "Globals.h"
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+File_Watcher::File_Watcher()
+{
+#ifdef __linux__
+  inotify = inotify_init1(IN_CLOEXEC);
+  if (inotify == -1 || pipe(wake_pipe) != 0)
+  {
+    set_message("File watcher: inotify unavailable, no hot reloading");
+    return;
+  }
+#endif
+  thread = std::thread([this] { run(); });
+}
+
+File_Watcher::~File_Watcher()
+{
+  shutdown = true;
+#ifdef __linux__
+  if (wake_pipe[1] != -1)
+  {
+    const char byte = 0;
+    ssize_t unused = write(wake_pipe[1], &byte, 1);
+    (void)unused;
+  }
+#endif
+  if (thread.joinable())
+    thread.join();
+#ifdef __linux__
+  for (int fd : {inotify, wake_pipe[0], wake_pipe[1]})
+    if (fd != -1)
+      close(fd);
+#endif
+}
+
+void File_Watcher::watch(const std::string &path)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!files.insert(path).second)
+    return;
+#ifdef __linux__
+  // editors often save by renaming over the file, so the directory is
+  // watched rather than the file
+  const size_t slash = path.find_last_of("/\\");
+  const std::string directory =
+      slash == std::string::npos ? "" : path.substr(0, slash + 1);
+  if (inotify == -1 || !watched_directories.insert(directory).second)
+    return;
+  const int wd =
+      inotify_add_watch(inotify, directory.empty() ? "." : directory.c_str(),
+                        IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd == -1)
+  {
+    set_message("File watcher: can't watch ", directory);
+    return;
+  }
+  directories[wd] = directory;
+#else
+  struct stat attr;
+  modification_times[path] = stat(path.c_str(), &attr) == 0 ? attr.st_mtime : 0;
+#endif
+}
+
+void File_Watcher::take_changes(std::vector<std::string> *changed)
+{
+  if (!has_changes.load(std::memory_order_acquire))
+    return;
+  std::lock_guard<std::mutex> lock(mutex);
+  changed->insert(changed->end(), changes.begin(), changes.end());
+  changes.clear();
+  has_changes = false;
+}
+
+// caller holds the mutex
+void File_Watcher::push_change(const std::string &path)
+{
+  if (!files.count(path))
+    return;
+  // one save is often several events
+  if (std::find(changes.begin(), changes.end(), path) == changes.end())
+    changes.push_back(path);
+  has_changes.store(true, std::memory_order_release);
+}
+
+#ifdef __linux__
+void File_Watcher::run()
+{
+  alignas(inotify_event) char buffer[4096];
+  while (!shutdown)
+  {
+    pollfd fds[2] = {{inotify, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+    if (poll(fds, 2, -1) <= 0 || shutdown)
+      continue;
+    const ssize_t length = read(inotify, buffer, sizeof(buffer));
+    if (length <= 0)
+      continue;
+    std::lock_guard<std::mutex> lock(mutex);
+    for (ssize_t i = 0; i < length;)
+    {
+      const inotify_event *event = (const inotify_event *)(buffer + i);
+      i += sizeof(inotify_event) + event->len;
+      auto directory = directories.find(event->wd);
+      if (event->len == 0 || directory == directories.end())
+        continue;
+      push_change(directory->second + event->name);
+    }
+  }
+}
+#else
+void File_Watcher::run()
+{
+  while (!shutdown)
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &file : modification_times)
+    {
+      struct stat attr;
+      if (stat(file.first.c_str(), &attr) != 0 ||
+          attr.st_mtime == file.second)
+        continue;
+      file.second = attr.st_mtime;
+      push_change(file.first);
+    }
+  }
+}
+#endif
+
+File_Watcher &get_file_watcher()
+{
+  static File_Watcher watcher;
+  return watcher;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "Globals.h"
+#include <atomic>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// reports files that were written, from a background thread
+// inotify on linux, elsewhere the thread polls modification times
+struct File_Watcher
+{
+  File_Watcher();
+  ~File_Watcher();
+
+  // reports path when it is created or written, exactly as it was given
+  void watch(const std::string &path);
+
+  // appends the paths that changed since the last call to changed
+  // when nothing did, this is a single atomic load
+  void take_changes(std::vector<std::string> *changed);
+
+private:
+  void run();
+  void push_change(const std::string &path);
+  std::thread thread;
+  std::mutex mutex;
+  std::atomic<bool> has_changes{false};
+  std::atomic<bool> shutdown{false};
+  std::vector<std::string> changes;
+  std::unordered_set<std::string> files;
+#ifdef __linux__
+  int inotify = -1;
+  int wake_pipe[2] = {-1, -1};
+  // watch descriptor -> directory as given, with the trailing slash
+  std::unordered_map<int, std::string> directories;
+  std::unordered_set<std::string> watched_directories;
+#else
+  std::unordered_map<std::string, time_t> modification_times;
+#endif
+};
+
+// created on first use
+File_Watcher &get_file_watcher();
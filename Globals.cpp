@@ -4,6 +4,15 @@
 #include <assimp/postprocess.h>
 #include <assimp/scene.h>
 #include <assimp/types.h>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#ifdef _WIN32
+#include <direct.h>
+#else
+#include <sys/stat.h>
+#endif
 using namespace glm;
 std::mt19937 generator;
 const float32 dt = 1.0f / 150.0f;
@@ -23,6 +32,7 @@ const std::string BASE_TEXTURE_PATH =
 const std::string BASE_SHADER_PATH = BASE_ASSET_PATH + std::string("Shaders/");
 const std::string BASE_MODEL_PATH = BASE_ASSET_PATH + std::string("Models/");
 const std::string ERROR_TEXTURE_PATH = BASE_TEXTURE_PATH + "err.png";
+const std::string BASE_CACHE_PATH = ROOT_PATH + "Cache/";
 Timer PERF_TIMER = Timer(1000);
 float32 wrap_to_range(const float32 input, const float32 min, const float32 max)
 {
@@ -153,6 +163,117 @@ std::string read_file(const char *path)
   return result;
 }
 
+bool has_gl_extension(const char *name)
+{
+  GLint count = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+  for (GLint i = 0; i < count; ++i)
+  {
+    const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+    if (extension && strcmp(extension, name) == 0)
+      return true;
+  }
+  return false;
+}
+
+uint64 hash_bytes(const void *data, size_t size, uint64 hash)
+{
+  const uint8 *bytes = (const uint8 *)data;
+  for (size_t i = 0; i < size; ++i)
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void create_directories(std::string path)
+{
+  for (size_t i = 1; i <= path.size(); ++i)
+  {
+    if (i < path.size() && path[i] != '/' && path[i] != '\\')
+      continue;
+    const std::string directory = path.substr(0, i);
+#ifdef _WIN32
+    _mkdir(directory.c_str());
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+  }
+}
+
+struct Symbol_Table
+{
+  // by ID, a deque so the references str() hands out stay valid
+  std::deque<std::string> strings = {""};
+  std::unordered_map<std::string, uint32> IDs = {{"", 0}};
+  // symbols are made on the job system too
+  std::mutex mutex;
+};
+// a function static so symbols can be made during static initialization
+static Symbol_Table &get_symbol_table()
+{
+  static Symbol_Table table;
+  return table;
+}
+
+Symbol::Symbol(const std::string &str)
+{
+  if (str.empty())
+    return;
+  Symbol_Table &table = get_symbol_table();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  auto it = table.IDs.find(str);
+  if (it != table.IDs.end())
+  {
+    ID = it->second;
+    return;
+  }
+  ID = table.strings.size();
+  table.strings.push_back(str);
+  table.IDs.emplace(str, ID);
+}
+Symbol::Symbol(const char *str) : Symbol(std::string(str)) {}
+const std::string &Symbol::str() const
+{
+  Symbol_Table &table = get_symbol_table();
+  std::lock_guard<std::mutex> lock(table.mutex);
+  return table.strings[ID];
+}
+
+bool parse_number(const std::string &value, uint32 *result)
+{
+  try
+  {
+    size_t end = 0;
+    const unsigned long number = std::stoul(value, &end);
+    if (end != value.size() || number > UINT32_MAX || value[0] == '-')
+      return false;
+    *result = uint32(number);
+    return true;
+  }
+  catch (const std::logic_error &)
+  { // invalid_argument and out_of_range
+    return false;
+  }
+}
+bool parse_number(const std::string &value, float32 *result)
+{
+  try
+  {
+    size_t end = 0;
+    const float32 number = std::stof(value, &end);
+    if (end != value.size())
+      return false;
+    *result = number;
+    return true;
+  }
+  catch (const std::logic_error &)
+  {
+    return false;
+  }
+}
+
 Uint32 string_to_color(std::string color)
 {
   // color(n,n,n,n)
@@ -296,50 +417,79 @@ float64 get_real_time()
 }
 struct Message
 {
+  // set for messages made with a Symbol, which match repeats by ID
+  Symbol symbol;
   std::string identifier;
   std::string message;
   float64 time_of_expiry;
 };
 static std::vector<Message> messages;
 static std::string message_log = "";
+// set_message may be called from worker threads
+static std::mutex message_mutex;
 
-void __set_message(std::string identifier, std::string message,
-                  float64 msg_duration, const char *file, uint32 line)
+// symbol is empty for string identifiers, those match repeats by string
+static void add_message(Symbol symbol, const std::string &identifier,
+                        const std::string &message, float64 msg_duration,
+                        const char *file, uint32 line)
 {
   const float64 time = get_real_time();
-  bool found = false;
-  if (identifier != "")
+  std::lock_guard<std::mutex> lock(message_mutex);
+  const Message *found = nullptr;
+  if (symbol != Symbol() || identifier != "")
   {
     for (auto &msg : messages)
     {
-      if (msg.identifier == identifier)
+      if (symbol != Symbol() ? msg.symbol == symbol
+                             : msg.identifier == identifier)
       {
         msg.message = message;
         msg.time_of_expiry = time + msg_duration;
-        found = true;
+        found = &msg;
         break;
       }
     }
   }
   if (!found)
   {
-    Message m = {identifier, message, time + msg_duration};
+    Message m = {symbol, symbol != Symbol() ? symbol.str() : identifier,
+                 message, time + msg_duration};
     messages.push_back(std::move(m));
+    found = &messages.back();
   }
 #if INCLUDE_FILE_LINE_IN_LOG
-  message_log.append("Time: " + s(time) + " Event: " + identifier + " " +
-                     message + " File: " + file + ": " + std::to_string(line) +
-                     "\n\n");
+  message_log.append("Time: " + s(time) + " Event: " + found->identifier +
+                     " " + message + " File: " + file + ": " +
+                     std::to_string(line) + "\n\n");
 #else
-  message_log.append("Time: " + s(time) + " Event: " + identifier + " " +
-                     message + "\n");
+  message_log.append("Time: " + s(time) + " Event: " + found->identifier +
+                     " " + message + "\n");
 #endif
 }
 
+void __set_message(std::string identifier, std::string message,
+                   float64 msg_duration, const char *file, uint32 line)
+{
+  add_message(Symbol(), identifier, message, msg_duration, file, line);
+}
+
+void __set_message(const char *identifier, std::string message,
+                   float64 msg_duration, const char *file, uint32 line)
+{
+  add_message(Symbol(), identifier, message, msg_duration, file, line);
+}
+
+void __set_message(Symbol identifier, std::string message,
+                   float64 msg_duration, const char *file, uint32 line)
+{
+  add_message(identifier, "", message, msg_duration, file, line);
+}
+
 std::string get_messages()
 {
   std::string result;
   float64 time = get_real_time();
+  std::lock_guard<std::mutex> lock(message_mutex);
   auto it = messages.begin();
   while (it != messages.end())
   {
@@ -357,6 +507,7 @@ std::string get_messages()
 
 void push_log_to_disk()
 {
+  std::lock_guard<std::mutex> lock(message_mutex);
   static bool first = true;
   if (first)
   {
@@ -413,6 +564,7 @@ template <> std::string s<const char *>(const char *value)
   return std::string(value);
 }
 template <> std::string s<std::string>(std::string value) { return value; }
+template <> std::string s<Symbol>(Symbol value) { return value.str(); }
 
 //#define check_gl_error() _check_gl_error(__FILE__, __LINE__)
 #define check_gl_error() _check_gl_error()
@@ -18,9 +18,14 @@ struct aiString;
 #define MAX_INSTANCE_COUNT 100
 #define UNIFORM_LIGHT_LOCATION 20
 #define MAX_LIGHTS 10
+#define MAX_FRAMES_IN_FLIGHT 3
+#define FRAMES_IN_FLIGHT 2 // default, see Render::set_frames_in_flight
+#define MAX_MESH_LODS 4
 #define SHOW_ERROR_TEXTURE 0
 #define DYNAMIC_TEXTURE_RELOADING 1
-#define DYNAMIC_FRAMERATE_TARGET 0
+#define DYNAMIC_SHADER_RELOADING 1
+#define COMPRESSED_TEXTURE_CACHE 1
+#define DYNAMIC_FRAMERATE_TARGET 1
 #define DEBUG 1
 #define ENABLE_ASSERTS 1
 #define INCLUDE_FILE_LINE_IN_LOG 0
@@ -42,11 +47,14 @@ extern const std::string BASE_TEXTURE_PATH;
 extern const std::string BASE_SHADER_PATH;
 extern const std::string BASE_MODEL_PATH;
 extern const std::string ERROR_TEXTURE_PATH;
+// generated data that can be deleted at any time
+extern const std::string BASE_CACHE_PATH;
 extern Timer PERF_TIMER;
 
-// load an aiScene
-// will cache the result so that future loads
-// of the same path won't have to read from disk
+extern const int default_assimp_flags;
+
+// load an aiScene, valid until the next call
+// Scene_Graph::add_aiscene caches what it converts from it, use that
 extern const aiScene *load_aiscene(std::string path,
                                    const int *assimp_flags = nullptr);
 
@@ -68,8 +76,49 @@ vec3 rand(vec3 max);
 // probably need something better
 std::string fix_filename(std::string str);
 std::string copy(const aiString *str);
+glm::mat4 copy(aiMatrix4x4 m);
 std::string read_file(const char *path);
 
+// needs a current context
+bool has_gl_extension(const char *name);
+
+// fnv-1a, pass the previous result as hash to continue it
+uint64 hash_bytes(const void *data, size_t size,
+                  uint64 hash = 14695981039346656037ull);
+
+// creates every missing directory along path
+void create_directories(std::string path);
+
+// false unless the whole of value is the number, negative values don't fit
+// a uint32
+bool parse_number(const std::string &value, uint32 *result);
+bool parse_number(const std::string &value, float32 *result);
+
+// an interned string, equal strings get the same ID for the life of the
+// program so comparing and hashing one is an integer op
+// interning takes a lock and hashes the string, so keep symbols around
+// rather than making them every frame
+struct Symbol
+{
+  Symbol() {}
+  Symbol(const std::string &str);
+  Symbol(const char *str);
+  // valid for the life of the program
+  const std::string &str() const;
+  bool operator==(Symbol rhs) const { return ID == rhs.ID; }
+  bool operator!=(Symbol rhs) const { return ID != rhs.ID; }
+  // in the order they were interned, not alphabetical
+  bool operator<(Symbol rhs) const { return ID < rhs.ID; }
+  uint32 ID = 0; // 0 is ""
+};
+namespace std
+{
+template <> struct hash<Symbol>
+{
+  size_t operator()(Symbol symbol) const { return symbol.ID; }
+};
+}
+
 #define ASSERT(x) _errr(x, __FILE__, __LINE__)
 
 Uint32 string_to_color(std::string color);
@@ -87,6 +136,12 @@ float64 get_real_time();
 
 void __set_message(std::string identifier, std::string message,
   float64 msg_duration, const char *, uint32);
+void __set_message(const char *identifier, std::string message,
+  float64 msg_duration, const char *, uint32);
+// for messages set every frame, pass a Symbol made once and repeats are
+// matched by ID without hashing the string
+void __set_message(Symbol identifier, std::string message,
+  float64 msg_duration, const char *, uint32);
 #define CREATE_3(x, y, z) __set_message(x, y, z, __FILE__, __LINE__)
 #define CREATE_2(x, y) CREATE_3(x, y, 0.0)
 #define CREATE_1(x) CREATE_2(x, "")
@@ -157,3 +212,4 @@ template <typename T, typename... Args> std::string s(T first, Args... args)
 }
 template <> std::string s<const char *>(const char *value);
 template <> std::string s<std::string>(std::string value);
+template <> std::string s<Symbol>(Symbol value);
@@ -0,0 +1,368 @@
+#include "Headless.h"
+#include "Globals.h"
+#include "Render.h"
+#include "State.h"
+#include <SDL2/SDL.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#ifdef __linux__
+// keep xlib's macros out of here
+#define EGL_NO_X11
+#define MESA_EGL_NO_X11_HEADERS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+using namespace gl33core;
+
+#ifdef __linux__
+static EGLDisplay EGL_DISPLAY_HANDLE = EGL_NO_DISPLAY;
+static EGLContext EGL_CONTEXT_HANDLE = EGL_NO_CONTEXT;
+static EGLSurface EGL_SURFACE_HANDLE = EGL_NO_SURFACE;
+#endif
+
+// the final image of every frame lands here instead of a window
+static GLuint OUTPUT_FRAMEBUFFER = 0;
+static GLuint OUTPUT_COLOR = 0;
+static GLuint OUTPUT_DEPTH = 0;
+
+static bool parse_value(const std::string &arg, const char *name,
+                        std::string *value)
+{
+  const std::string prefix = std::string(name) + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+bool parse_headless_options(int argc, char *argv[], Headless_Options *options)
+{
+  bool headless = false;
+  for (int32 i = 1; i < argc; ++i)
+  {
+    const std::string arg = argv[i];
+    std::string v;
+    bool valid = true;
+    char end;
+    if (arg == "--headless")
+      headless = true;
+    else if (arg == "--txaa")
+      options->use_txaa = true;
+    else if (arg == "--capture")
+      options->capture = true;
+    else if (arg == "--sync-shaders")
+      options->sync_shaders = true;
+    else if (parse_value(arg, "--frames", &v))
+      valid = parse_number(v, &options->frame_count);
+    else if (parse_value(arg, "--warmup", &v))
+      valid = parse_number(v, &options->warmup_frames);
+    else if (parse_value(arg, "--state", &v))
+      valid = parse_number(v, &options->state_index);
+    else if (parse_value(arg, "--scale", &v))
+      valid = parse_number(v, &options->render_scale);
+    else if (parse_value(arg, "--frames-in-flight", &v))
+      valid = parse_number(v, &options->frames_in_flight);
+    else if (parse_value(arg, "--hash-every", &v))
+      valid = parse_number(v, &options->hash_interval);
+    else if (parse_value(arg, "--stats", &v))
+      options->stats_path = v;
+    else if (parse_value(arg, "--size", &v))
+      valid = sscanf(v.c_str(), "%dx%d%c", &options->size.x,
+                     &options->size.y, &end) == 2 &&
+              options->size.x > 0 && options->size.y > 0;
+    else if (parse_value(arg, "--orbit-center", &v))
+      valid = sscanf(v.c_str(), "%f,%f,%f%c", &options->orbit_center.x,
+                     &options->orbit_center.y, &options->orbit_center.z,
+                     &end) == 3;
+    else if (parse_value(arg, "--orbit-radius", &v))
+      valid = parse_number(v, &options->orbit_radius);
+    else if (parse_value(arg, "--orbit-height", &v))
+      valid = parse_number(v, &options->orbit_height);
+    // anything else belongs to the interactive mode
+
+    if (!valid)
+    {
+      set_message("Usage error, bad value in: ", arg);
+      std::cerr << "Usage error, bad value in: " << arg << "\n";
+      options->usage_error = true;
+    }
+  }
+  return headless;
+}
+
+#ifdef __linux__
+bool create_headless_context()
+{
+  // surfaceless platform first, it needs no X or wayland server
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+      (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress(
+          "eglGetPlatformDisplayEXT");
+  if (get_platform_display)
+    EGL_DISPLAY_HANDLE = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+                                              EGL_DEFAULT_DISPLAY, nullptr);
+  if (EGL_DISPLAY_HANDLE == EGL_NO_DISPLAY)
+    EGL_DISPLAY_HANDLE = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (EGL_DISPLAY_HANDLE == EGL_NO_DISPLAY)
+  {
+    set_message("EGL: no display");
+    return false;
+  }
+  EGLint major, minor;
+  if (!eglInitialize(EGL_DISPLAY_HANDLE, &major, &minor))
+  {
+    set_message("EGL: eglInitialize failed");
+    return false;
+  }
+  set_message("EGL version: ", s(major, ".", minor));
+
+  const EGLint config_attributes[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8,
+      EGL_DEPTH_SIZE, 24, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+  EGLConfig config;
+  EGLint config_count = 0;
+  if (!eglChooseConfig(EGL_DISPLAY_HANDLE, config_attributes, &config, 1,
+                       &config_count) ||
+      config_count == 0)
+  {
+    set_message("EGL: no pbuffer capable OpenGL config");
+    return false;
+  }
+  if (!eglBindAPI(EGL_OPENGL_API))
+  {
+    set_message("EGL: desktop OpenGL not supported");
+    return false;
+  }
+  const EGLint context_attributes[] = {EGL_CONTEXT_MAJOR_VERSION, 3,
+      EGL_CONTEXT_MINOR_VERSION, 3, EGL_CONTEXT_OPENGL_PROFILE_MASK,
+      EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE};
+  EGL_CONTEXT_HANDLE = eglCreateContext(EGL_DISPLAY_HANDLE, config,
+                                        EGL_NO_CONTEXT, context_attributes);
+  if (EGL_CONTEXT_HANDLE == EGL_NO_CONTEXT)
+  {
+    set_message("EGL: failed to create a 3.3 core context");
+    return false;
+  }
+
+  // we render into our own framebuffer, so the surface is only needed by
+  // drivers without EGL_KHR_surfaceless_context
+  const char *extensions = eglQueryString(EGL_DISPLAY_HANDLE, EGL_EXTENSIONS);
+  const bool surfaceless =
+      extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+  if (!surfaceless)
+  {
+    const EGLint pbuffer_attributes[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    EGL_SURFACE_HANDLE = eglCreatePbufferSurface(EGL_DISPLAY_HANDLE, config,
+                                                 pbuffer_attributes);
+    if (EGL_SURFACE_HANDLE == EGL_NO_SURFACE)
+    {
+      set_message("EGL: failed to create pbuffer");
+      return false;
+    }
+  }
+  if (!eglMakeCurrent(EGL_DISPLAY_HANDLE, EGL_SURFACE_HANDLE,
+                      EGL_SURFACE_HANDLE, EGL_CONTEXT_HANDLE))
+  {
+    set_message("EGL: eglMakeCurrent failed");
+    return false;
+  }
+  // nothing is ever swapped, but don't let a pbuffer wait on anything
+  eglSwapInterval(EGL_DISPLAY_HANDLE, 0);
+  set_message("EGL context: ", surfaceless ? "surfaceless" : "pbuffer");
+  return true;
+}
+
+void destroy_headless_context()
+{
+  if (EGL_DISPLAY_HANDLE == EGL_NO_DISPLAY)
+    return;
+  eglMakeCurrent(EGL_DISPLAY_HANDLE, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  if (EGL_SURFACE_HANDLE != EGL_NO_SURFACE)
+    eglDestroySurface(EGL_DISPLAY_HANDLE, EGL_SURFACE_HANDLE);
+  if (EGL_CONTEXT_HANDLE != EGL_NO_CONTEXT)
+    eglDestroyContext(EGL_DISPLAY_HANDLE, EGL_CONTEXT_HANDLE);
+  eglTerminate(EGL_DISPLAY_HANDLE);
+  EGL_SURFACE_HANDLE = EGL_NO_SURFACE;
+  EGL_CONTEXT_HANDLE = EGL_NO_CONTEXT;
+  EGL_DISPLAY_HANDLE = EGL_NO_DISPLAY;
+}
+#else
+bool create_headless_context()
+{
+  set_message("Headless mode needs EGL, only supported on linux");
+  return false;
+}
+
+void destroy_headless_context() {}
+#endif
+
+static void init_output_framebuffer(ivec2 size)
+{
+  glGenRenderbuffers(1, &OUTPUT_COLOR);
+  glBindRenderbuffer(GL_RENDERBUFFER, OUTPUT_COLOR);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, size.x, size.y);
+  glGenRenderbuffers(1, &OUTPUT_DEPTH);
+  glBindRenderbuffer(GL_RENDERBUFFER, OUTPUT_DEPTH);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, size.x, size.y);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &OUTPUT_FRAMEBUFFER);
+  glBindFramebuffer(GL_FRAMEBUFFER, OUTPUT_FRAMEBUFFER);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                            GL_RENDERBUFFER, OUTPUT_COLOR);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+                            GL_RENDERBUFFER, OUTPUT_DEPTH);
+  ASSERT(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static void cleanup_output_framebuffer()
+{
+  glDeleteFramebuffers(1, &OUTPUT_FRAMEBUFFER);
+  glDeleteRenderbuffers(1, &OUTPUT_COLOR);
+  glDeleteRenderbuffers(1, &OUTPUT_DEPTH);
+  OUTPUT_FRAMEBUFFER = OUTPUT_COLOR = OUTPUT_DEPTH = 0;
+}
+
+// 64 bit FNV-1a
+static uint64 hash_output_framebuffer(ivec2 size, std::vector<uint8> *pixels)
+{
+  pixels->resize(4 * size.x * size.y);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, OUTPUT_FRAMEBUFFER);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, size.x, size.y, GL_RGBA, GL_UNSIGNED_BYTE, &(*pixels)[0]);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  return hash_bytes(&(*pixels)[0], pixels->size());
+}
+
+// times in seconds, printed in ms
+static std::string stats_line(const char *name, std::vector<float64> times)
+{
+  if (times.empty())
+    return s(name, ": no samples\n");
+  std::sort(times.begin(), times.end());
+  auto percentile = [&](float64 p) {
+    return 1000. * times[size_t(p * (times.size() - 1) + 0.5)];
+  };
+  float64 sum = 0;
+  for (float64 t : times)
+    sum += t;
+  std::stringstream ss;
+  ss << name << " ms: mean " << 1000. * sum / times.size() << " median "
+     << percentile(.5) << " p95 " << percentile(.95) << " p99 "
+     << percentile(.99) << " min " << 1000. * times.front() << " max "
+     << 1000. * times.back() << "\n";
+  return ss.str();
+}
+
+int run_headless_benchmark(std::vector<State *> states,
+                           const Headless_Options &options)
+{
+  ASSERT(options.state_index < states.size());
+  ASSERT(options.frame_dt > 0);
+  State *state = states[options.state_index];
+  const ivec2 size = options.size;
+  init_output_framebuffer(size);
+
+  Render &renderer = state->renderer;
+  renderer.benchmark_mode = true;
+  renderer.output_framebuffer = OUTPUT_FRAMEBUFFER;
+  renderer.use_txaa = options.use_txaa;
+  renderer.capture_frames = options.capture;
+  renderer.set_render_scale(options.render_scale);
+  renderer.set_frames_in_flight(options.frames_in_flight);
+  renderer.use_async_shaders = !options.sync_shaders;
+  state->paused = false;
+
+  std::vector<float64> cpu_times;
+  std::vector<float64> gpu_times;
+  std::vector<std::pair<uint32, uint64>> hashes;
+  std::vector<uint8> pixels;
+  // streaming would make the first frames depend on decode timing
+  state->scene.update_imports(true);
+  finish_texture_streaming();
+  const uint32 total_frames = options.warmup_frames + options.frame_count;
+  const uint64 frequency = SDL_GetPerformanceFrequency();
+  const uint64 run_begin = SDL_GetPerformanceCounter();
+  for (uint32 i = 0; i < total_frames; ++i)
+  {
+    // warmup frames all render the first measured frame, so the measured
+    // frames and their hashes don't depend on the warmup count
+    const bool warmup = i < options.warmup_frames;
+    const uint32 frame = warmup ? 0 : i - options.warmup_frames;
+    // txaa history and jitter phase would otherwise carry the warmup count
+    if (i == options.warmup_frames)
+      renderer.invalidate_history();
+
+    // same fixed step as the interactive loop, but on a fixed clock
+    const float64 frame_end = (frame + 1) * options.frame_dt;
+    while (state->current_time + dt < frame_end)
+    {
+      state->current_time += dt;
+      state->update();
+    }
+
+    // one full orbit over the run, looking at the center
+    const float32 a = two_pi<float32>() * float32(frame) /
+                      float32(max(options.frame_count, 1u));
+    const vec3 pos =
+        options.orbit_center + vec3(options.orbit_radius * cos(a),
+                                    options.orbit_radius * sin(a),
+                                    options.orbit_height);
+    state->set_camera(pos, normalize(options.orbit_center - pos));
+
+    // with vsync gone, the fences in render() are what hold the cpu back to
+    // frames_in_flight, so this converges on the real frame time
+    const uint64 begin = SDL_GetPerformanceCounter();
+    state->render(state->current_time);
+    const uint64 end = SDL_GetPerformanceCounter();
+
+    if (warmup)
+      continue;
+    if (options.hash_interval && frame % options.hash_interval == 0)
+      hashes.push_back({frame, hash_output_framebuffer(size, &pixels)});
+    cpu_times.push_back(float64(end - begin) / frequency);
+    if (renderer.get_last_gpu_frame_time() > 0)
+      gpu_times.push_back(renderer.get_last_gpu_frame_time());
+  }
+  glFinish();
+  const float64 run_time =
+      float64(SDL_GetPerformanceCounter() - run_begin) / frequency;
+
+  std::stringstream out;
+  out << "State: " << state->state_name << "\n";
+  out << "GL renderer: " << (const char *)glGetString(GL_RENDERER) << "\n";
+  out << "GL version: " << (const char *)glGetString(GL_VERSION) << "\n";
+  out << "Size: " << size.x << "x" << size.y
+      << " render scale: " << renderer.get_render_scale()
+      << " txaa: " << options.use_txaa
+      << " async shaders: " << !options.sync_shaders << "\n";
+  out << "Frames: " << options.frame_count
+      << " warmup: " << options.warmup_frames << " total time: " << run_time
+      << "s\n";
+  out << stats_line("CPU frame", cpu_times);
+  out << stats_line("GPU frame", gpu_times);
+  for (auto &hash : hashes)
+    out << "Hash frame " << hash.first << ": " << std::hex << hash.second
+        << std::dec << "\n";
+
+  renderer.output_framebuffer = 0;
+  renderer.capture_frames = false;
+  cleanup_output_framebuffer();
+
+  std::cout << out.str();
+  std::ofstream file(options.stats_path);
+  if (!file)
+  {
+    set_message("Failed to write headless stats to: ", options.stats_path);
+    return 1;
+  }
+  file << out.str();
+  set_message("Headless stats written to: ", options.stats_path);
+  return 0;
+}
@@ -0,0 +1,45 @@
+#pragma once
+#include "Globals.h"
+#include "State.h"
+#include <string>
+#include <vector>
+
+// offscreen benchmark runs: no window, no vsync, a fixed number of frames
+// along a scripted camera orbit, frame time stats and optional image hashes
+// written to stats_path
+struct Headless_Options
+{
+  ivec2 size = ivec2(1280, 720);
+  uint32 state_index = 0;
+  uint32 frame_count = 600;
+  uint32 warmup_frames = 30; // not included in the stats
+  float32 render_scale = 1.0f;
+  bool use_txaa = false;
+  float64 frame_dt = 1.0 / 60.0; // simulation time per rendered frame
+  vec3 orbit_center = vec3(0, 0, 0);
+  float32 orbit_radius = 10.0f;
+  float32 orbit_height = 4.0f;
+  uint32 hash_interval = 0; // hash every nth frame, 0 disables
+  bool capture = false;     // save every frame as frame_<n>.png
+  uint32 frames_in_flight = FRAMES_IN_FLIGHT;
+  // compile material permutations synchronously, with --warmup=0 the cpu
+  // frame max is then the first-use hitch to compare the async path against
+  bool sync_shaders = false;
+  std::string stats_path = "headless_stats.txt";
+  // a value that didn't parse, already reported
+  bool usage_error = false;
+};
+
+// returns true if --headless was passed, fills options from the other
+// --name=value arguments and skips the ones it doesn't know
+bool parse_headless_options(int argc, char *argv[], Headless_Options *options);
+
+// makes a GL 3.3 core context current through EGL, surfaceless where the
+// driver allows it (mesa llvmpipe works with no gpu or display server)
+bool create_headless_context();
+void destroy_headless_context();
+
+// needs a current context with glbinding initialized
+// renders the state into an offscreen framebuffer, returns the exit code
+int run_headless_benchmark(std::vector<State *> states,
+                           const Headless_Options &options);
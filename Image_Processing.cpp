@@ -0,0 +1,318 @@
+#include "Image_Processing.h"
+#include "Globals.h"
+#include "Timer.h"
+#include <cmath>
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64)
+#define IMAGE_SSE 1
+#include <emmintrin.h>
+#else
+#define IMAGE_SSE 0
+#endif
+
+// linear values are stored with this many steps for the way back to srgb
+#define LINEAR_TO_SRGB_STEPS 16384
+
+static const float32 *srgb_to_linear_table()
+{
+  static float32 table[256];
+  static bool init = [] {
+    for (uint32 i = 0; i < 256; ++i)
+    {
+      const float32 c = i / 255.0f;
+      table[i] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+    }
+    return true;
+  }();
+  (void)init;
+  return table;
+}
+
+static const uint8 *linear_to_srgb_table()
+{
+  static uint8 table[LINEAR_TO_SRGB_STEPS];
+  static bool init = [] {
+    for (uint32 i = 0; i < LINEAR_TO_SRGB_STEPS; ++i)
+    {
+      const float32 l = i / float32(LINEAR_TO_SRGB_STEPS - 1);
+      const float32 c =
+          l <= 0.0031308f ? l * 12.92f : 1.055f * pow(l, 1 / 2.4f) - 0.055f;
+      table[i] = uint8(glm::clamp(c, 0.0f, 1.0f) * 255.0f + 0.5f);
+    }
+    return true;
+  }();
+  (void)init;
+  return table;
+}
+
+// exact round(c * a / 255) for 8 bit c and a
+static uint8 multiply_255(uint32 c, uint32 a)
+{
+  const uint32 t = c * a + 128;
+  return uint8((t + (t >> 8)) >> 8);
+}
+
+static void override_alpha_scalar(uint8 *rgba, size_t pixel_count,
+                                  uint8 alpha)
+{
+  for (size_t i = 0; i < pixel_count; ++i)
+    rgba[4 * i + 3] = alpha;
+}
+
+static void premultiply_alpha_scalar(uint8 *rgba, size_t pixel_count)
+{
+  for (size_t i = 0; i < pixel_count; ++i)
+  {
+    uint8 *p = &rgba[4 * i];
+    p[0] = multiply_255(p[0], p[3]);
+    p[1] = multiply_255(p[1], p[3]);
+    p[2] = multiply_255(p[2], p[3]);
+  }
+}
+
+// source is size, result is the next level
+static void downsample_linear_row_scalar(const uint8 *row0, const uint8 *row1,
+                                         int32 width, int32 first,
+                                         int32 next_width, uint8 *out)
+{
+  for (int32 x = first; x < next_width; ++x)
+  {
+    const int32 x0 = glm::min(2 * x, width - 1);
+    const int32 x1 = glm::min(2 * x + 1, width - 1);
+    for (int32 c = 0; c < 4; ++c)
+    {
+      const uint32 sum = row0[4 * x0 + c] + row0[4 * x1 + c] +
+                         row1[4 * x0 + c] + row1[4 * x1 + c];
+      out[4 * x + c] = uint8((sum + 2) / 4);
+    }
+  }
+}
+
+#if IMAGE_SSE
+static void override_alpha_sse(uint8 *rgba, size_t pixel_count, uint8 alpha)
+{
+  const __m128i color_mask = _mm_set1_epi32(0x00ffffff);
+  const __m128i alpha_bits = _mm_set1_epi32(int32(uint32(alpha) << 24));
+  size_t i = 0;
+  for (; i + 4 <= pixel_count; i += 4)
+  {
+    __m128i *p = (__m128i *)&rgba[4 * i];
+    const __m128i v = _mm_loadu_si128(p);
+    _mm_storeu_si128(p, _mm_or_si128(_mm_and_si128(v, color_mask), alpha_bits));
+  }
+  override_alpha_scalar(rgba + 4 * i, pixel_count - i, alpha);
+}
+
+// 8 16 bit lanes, two pixels, times their alphas / 255
+static __m128i multiply_255_sse(__m128i c)
+{
+  __m128i a = _mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3));
+  a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+  const __m128i t =
+      _mm_add_epi16(_mm_mullo_epi16(c, a), _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void premultiply_alpha_sse(uint8 *rgba, size_t pixel_count)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32(int32(0xff000000));
+  size_t i = 0;
+  for (; i + 4 <= pixel_count; i += 4)
+  {
+    __m128i *p = (__m128i *)&rgba[4 * i];
+    const __m128i v = _mm_loadu_si128(p);
+    const __m128i lo = multiply_255_sse(_mm_unpacklo_epi8(v, zero));
+    const __m128i hi = multiply_255_sse(_mm_unpackhi_epi8(v, zero));
+    const __m128i result = _mm_packus_epi16(lo, hi);
+    // alpha * alpha / 255 isn't alpha, keep the original
+    _mm_storeu_si128(p, _mm_or_si128(_mm_andnot_si128(alpha_mask, result),
+                                     _mm_and_si128(alpha_mask, v)));
+  }
+  premultiply_alpha_scalar(rgba + 4 * i, pixel_count - i);
+}
+
+// 4 output pixels at a time from 8 in each row, the rest scalar
+static void downsample_linear_row_sse(const uint8 *row0, const uint8 *row1,
+                                      int32 width, int32 next_width,
+                                      uint8 *out)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i two = _mm_set1_epi16(2);
+  int32 x = 0;
+  for (; 2 * x + 8 <= width && x + 4 <= next_width; x += 4)
+  {
+    const __m128i a = _mm_loadu_si128((const __m128i *)&row0[8 * x]);
+    const __m128i b = _mm_loadu_si128((const __m128i *)&row0[8 * x + 16]);
+    const __m128i c = _mm_loadu_si128((const __m128i *)&row1[8 * x]);
+    const __m128i d = _mm_loadu_si128((const __m128i *)&row1[8 * x + 16]);
+    // vertical sums, two source pixels per register
+    const __m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                     _mm_unpacklo_epi8(c, zero));
+    const __m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                     _mm_unpackhi_epi8(c, zero));
+    const __m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(b, zero),
+                                     _mm_unpacklo_epi8(d, zero));
+    const __m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(b, zero),
+                                     _mm_unpackhi_epi8(d, zero));
+    // horizontal pairs
+    __m128i p01 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1),
+                                _mm_unpackhi_epi64(s0, s1));
+    __m128i p23 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3),
+                                _mm_unpackhi_epi64(s2, s3));
+    p01 = _mm_srli_epi16(_mm_add_epi16(p01, two), 2);
+    p23 = _mm_srli_epi16(_mm_add_epi16(p23, two), 2);
+    _mm_storeu_si128((__m128i *)&out[4 * x], _mm_packus_epi16(p01, p23));
+  }
+  downsample_linear_row_scalar(row0, row1, width, x, next_width, out);
+}
+#endif
+
+void override_alpha(uint8 *rgba, size_t pixel_count, uint8 alpha)
+{
+#if IMAGE_SSE
+  override_alpha_sse(rgba, pixel_count, alpha);
+#else
+  override_alpha_scalar(rgba, pixel_count, alpha);
+#endif
+}
+
+void premultiply_alpha(uint8 *rgba, size_t pixel_count)
+{
+#if IMAGE_SSE
+  premultiply_alpha_sse(rgba, pixel_count);
+#else
+  premultiply_alpha_scalar(rgba, pixel_count);
+#endif
+}
+
+// color through the lookup tables, alpha as in the linear version
+// there's no gather in sse2, so this one is scalar everywhere
+static void downsample_srgb_row(const uint8 *row0, const uint8 *row1,
+                                int32 width, int32 next_width, uint8 *out)
+{
+  const float32 *to_linear = srgb_to_linear_table();
+  const uint8 *to_srgb = linear_to_srgb_table();
+  const float32 scale = 0.25f * (LINEAR_TO_SRGB_STEPS - 1);
+  for (int32 x = 0; x < next_width; ++x)
+  {
+    const int32 x0 = 4 * glm::min(2 * x, width - 1);
+    const int32 x1 = 4 * glm::min(2 * x + 1, width - 1);
+    for (int32 c = 0; c < 3; ++c)
+    {
+      const float32 sum = to_linear[row0[x0 + c]] + to_linear[row0[x1 + c]] +
+                          to_linear[row1[x0 + c]] + to_linear[row1[x1 + c]];
+      out[4 * x + c] = to_srgb[uint32(sum * scale + 0.5f)];
+    }
+    const uint32 alpha = row0[x0 + 3] + row0[x1 + 3] + row1[x0 + 3] +
+                         row1[x1 + 3];
+    out[4 * x + 3] = uint8((alpha + 2) / 4);
+  }
+}
+
+static void build_mip_chain(const uint8 *rgba, ivec2 size, bool srgb,
+                            bool use_sse, Mip_Chain *result)
+{
+  ASSERT(size.x > 0 && size.y > 0);
+  result->size = size;
+  result->level_offsets.assign(1, 0);
+  size_t total = 0;
+  for (ivec2 level = size;; level = max(level / 2, ivec2(1)))
+  {
+    total += 4 * size_t(level.x) * level.y;
+    result->level_offsets.push_back(total);
+    if (level == ivec2(1))
+      break;
+  }
+  result->data.resize(total);
+  memcpy(result->data.data(), rgba, 4 * size_t(size.x) * size.y);
+
+  for (uint32 level = 1; level < result->level_count(); ++level)
+  {
+    const ivec2 from = result->level_size(level - 1);
+    const ivec2 to = result->level_size(level);
+    const uint8 *source = result->level(level - 1);
+    uint8 *destination = &result->data[result->level_offsets[level]];
+    for (int32 y = 0; y < to.y; ++y)
+    {
+      const uint8 *row0 = source + 4 * size_t(from.x) * (2 * y);
+      const uint8 *row1 =
+          source + 4 * size_t(from.x) * glm::min(2 * y + 1, from.y - 1);
+      uint8 *out = destination + 4 * size_t(to.x) * y;
+      if (srgb)
+        downsample_srgb_row(row0, row1, from.x, to.x, out);
+#if IMAGE_SSE
+      else if (use_sse)
+        downsample_linear_row_sse(row0, row1, from.x, to.x, out);
+#endif
+      else
+        downsample_linear_row_scalar(row0, row1, from.x, 0, to.x, out);
+    }
+  }
+}
+
+void build_mip_chain(const uint8 *rgba, ivec2 size, bool srgb,
+                     Mip_Chain *result)
+{
+  build_mip_chain(rgba, size, srgb, IMAGE_SSE, result);
+}
+
+int benchmark_image_processing()
+{
+  const ivec2 size = ivec2(2048, 2048);
+  const size_t pixel_count = size_t(size.x) * size.y;
+  std::vector<uint8> source(4 * pixel_count);
+  for (uint8 &byte : source)
+    byte = uint8(generator());
+  std::vector<uint8> scalar;
+  std::vector<uint8> simd;
+  Mip_Chain scalar_mips;
+  Mip_Chain simd_mips;
+  Timer scalar_timer(10);
+  Timer simd_timer(10);
+  bool differ = false;
+
+  // shortest of ten runs, each on a fresh copy
+  auto run = [&](const char *name, auto scalar_version, auto simd_version) {
+    scalar_timer.clear_all();
+    simd_timer.clear_all();
+    for (uint32 i = 0; i < 10; ++i)
+    {
+      scalar = source;
+      scalar_timer.start();
+      scalar_version();
+      scalar_timer.stop();
+      simd = source;
+      simd_timer.start();
+      simd_version();
+      simd_timer.stop();
+    }
+    set_message(s("Image benchmark: ", name, " 2048x2048 scalar: ",
+                  1000 * scalar_timer.shortest(), "ms sse: ",
+                  1000 * simd_timer.shortest(), "ms"));
+  };
+  run("premultiply",
+      [&] { premultiply_alpha_scalar(scalar.data(), pixel_count); },
+      [&] { premultiply_alpha(simd.data(), pixel_count); });
+  differ |= scalar != simd;
+  run("override alpha",
+      [&] { override_alpha_scalar(scalar.data(), pixel_count, 77); },
+      [&] { override_alpha(simd.data(), pixel_count, 77); });
+  differ |= scalar != simd;
+  run("linear mips",
+      [&] { build_mip_chain(scalar.data(), size, false, false, &scalar_mips); },
+      [&] { build_mip_chain(simd.data(), size, false, true, &simd_mips); });
+  differ |= scalar_mips.data != simd_mips.data;
+  // odd sizes take the edge paths
+  build_mip_chain(source.data(), ivec2(37, 29), false, false, &scalar_mips);
+  build_mip_chain(source.data(), ivec2(37, 29), false, true, &simd_mips);
+  differ |= scalar_mips.data != simd_mips.data;
+  run("srgb mips", [&] {
+    build_mip_chain(scalar.data(), size, true, false, &scalar_mips);
+  }, [&] { build_mip_chain(simd.data(), size, true, true, &simd_mips); });
+
+  if (differ)
+    set_message("Image benchmark: sse results differ from scalar");
+  push_log_to_disk();
+  return differ ? 1 : 0;
+}
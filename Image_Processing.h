@@ -0,0 +1,40 @@
+#pragma once
+#include "Globals.h"
+#include <glm/glm.hpp>
+#include <vector>
+using namespace glm;
+
+// cpu processing of decoded rgba8 images before they're uploaded or
+// compressed, all of it can run on the job system
+// sse2 where available, the scalar versions are the reference
+
+// every level of an rgba8 image down to 1x1, largest first
+struct Mip_Chain
+{
+  ivec2 size = ivec2(0); // of the first level
+  std::vector<uint8> data;
+  // start of each level in data, plus the end
+  std::vector<size_t> level_offsets;
+
+  uint32 level_count() const { return level_offsets.size() - 1; }
+  ivec2 level_size(uint32 level) const
+  {
+    return max(ivec2(size.x >> level, size.y >> level), ivec2(1));
+  }
+  const uint8 *level(uint32 level) const { return &data[level_offsets[level]]; }
+};
+
+// sets every alpha to alpha
+void override_alpha(uint8 *rgba, size_t pixel_count, uint8 alpha);
+
+// rgb * a / 255, rounded to nearest
+void premultiply_alpha(uint8 *rgba, size_t pixel_count);
+
+// 2x2 box filter, odd edges repeat
+// srgb filters the color in linear space, alpha is always linear
+void build_mip_chain(const uint8 *rgba, ivec2 size, bool srgb,
+                     Mip_Chain *result);
+
+// times the scalar and sse versions on a generated image and logs it
+// returns nonzero if their results differ
+int benchmark_image_processing();
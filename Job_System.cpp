@@ -0,0 +1,98 @@
+#include "Job_System.h"
+#include "Globals.h"
+#include <memory>
+
+Job_System::Job_System(uint32 thread_count)
+{
+  for (uint32 i = 0; i < thread_count; ++i)
+    threads.emplace_back([this] { worker_loop(); });
+}
+
+Job_System::~Job_System()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    shutdown = true;
+  }
+  job_ready.notify_all();
+  for (std::thread &thread : threads)
+    thread.join();
+}
+
+void Job_System::worker_loop()
+{
+  while (true)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      job_ready.wait(lock, [this] { return shutdown || !jobs.empty(); });
+      if (shutdown && jobs.empty())
+        return;
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    job();
+  }
+}
+
+void Job_System::submit(std::function<void()> job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs.push_back(std::move(job));
+  }
+  job_ready.notify_one();
+}
+
+void Job_System::parallel_for(uint32 count,
+                              const std::function<void(uint32)> &job)
+{
+  if (count == 0)
+    return;
+  if (count == 1 || threads.empty())
+  {
+    for (uint32 i = 0; i < count; ++i)
+      job(i);
+    return;
+  }
+
+  // helpers that start after every index is taken only touch this, so it
+  // has to outlive the call
+  struct Shared
+  {
+    std::atomic<uint32> next{0};
+    std::atomic<uint32> finished{0};
+    std::mutex mutex;
+    std::condition_variable done;
+  };
+  auto shared = std::make_shared<Shared>();
+  const std::function<void(uint32)> *fn = &job;
+  auto run = [shared, fn, count] {
+    uint32 i;
+    while ((i = shared->next.fetch_add(1)) < count)
+    {
+      (*fn)(i);
+      if (shared->finished.fetch_add(1) + 1 == count)
+      {
+        std::lock_guard<std::mutex> lock(shared->mutex);
+        shared->done.notify_all();
+      }
+    }
+  };
+
+  const uint32 helpers = glm::min(count - 1, (uint32)threads.size());
+  for (uint32 i = 0; i < helpers; ++i)
+    submit(run);
+  run();
+
+  std::unique_lock<std::mutex> lock(shared->mutex);
+  shared->done.wait(lock, [&] { return shared->finished == count; });
+}
+
+Job_System &get_job_system()
+{
+  static Job_System jobs(
+      glm::max(std::thread::hardware_concurrency(), 2u) - 1);
+  return jobs;
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "Globals.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// persistent worker threads so per-frame work doesn't pay for thread creation
+// jobs must not touch GL, that stays on the thread that owns the context
+struct Job_System
+{
+  Job_System(uint32 thread_count);
+  ~Job_System();
+
+  // fire and forget
+  void submit(std::function<void()> job);
+
+  // calls job(i) for every i in [0,count) spread over the workers and the
+  // calling thread, returns once all of them have finished
+  void parallel_for(uint32 count, const std::function<void(uint32)> &job);
+
+  // workers plus the calling thread
+  uint32 get_thread_count() const { return threads.size() + 1; }
+
+private:
+  void worker_loop();
+  std::vector<std::thread> threads;
+  std::deque<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable job_ready;
+  bool shutdown = false;
+};
+
+// created on first use with hardware_concurrency - 1 workers
+Job_System &get_job_system();
@@ -7,6 +7,10 @@
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
+#include <algorithm>
+#include <cstring>
+#include <queue>
+#include <unordered_map>
  
 
 void add_quad(vec3 a, vec3 b, vec3 c, vec3 d,
@@ -192,16 +196,16 @@ std::string identifier_for_primitive(Mesh_Primitive p)
 void copy_mesh_data(std::vector<vec3>& dst, aiVector3D* src, uint32 length)
 {
   ASSERT(dst.size() == 0);
-  dst.reserve(length);
+  dst.resize(length);
   for (uint32 i = 0; i < length; ++i)
-	  dst.push_back(vec3(src[i].x,src[i].y,src[i].z));
+    dst[i] = vec3(src[i].x, src[i].y, src[i].z);
 }
 void copy_mesh_data(std::vector<vec2>& dst, aiVector3D* src, uint32 length)
 {
   ASSERT(dst.size() == 0);
-  dst.reserve(length);
+  dst.resize(length);
   for (uint32 i = 0; i < length; ++i)
-	  dst.push_back(vec2(src[i].x, src[i].y));
+    dst[i] = vec2(src[i].x, src[i].y);
 }
 
 Mesh_Data load_mesh(const aiMesh* aimesh, std::string unique_identifier)
@@ -229,14 +233,495 @@ Mesh_Data load_mesh(const aiMesh* aimesh, std::string unique_identifier)
   const uint32 uv_channel = 0;//only one uv channel supported
   copy_mesh_data(data.texture_coordinates, aimesh->mTextureCoords[uv_channel], num_vertices);
 
+  data.indices.resize(3 * aimesh->mNumFaces);
   for (uint32 i = 0; i < aimesh->mNumFaces; i++)
   {
-    aiFace face = aimesh->mFaces[i];
+    const aiFace &face = aimesh->mFaces[i];
     ASSERT(face.mNumIndices == 3);//triangles only, use aiProcess_Triangulate
-    for (GLuint j = 0; j < 3; j++)
+    memcpy(&data.indices[3 * i], face.mIndices, 3 * sizeof(uint32));
+  }
+  optimize_mesh(data);
+  generate_lods(data);
+  return data;
+}
+
+// symmetric 4x4 plane distance quadric, upper triangle
+struct Quadric
+{
+  float64 a[10] = {};
+  void add_plane(vec3 n, float64 d, float64 weight)
+  {
+    const float64 p[4] = {n.x, n.y, n.z, d};
+    uint32 k = 0;
+    for (uint32 i = 0; i < 4; ++i)
+      for (uint32 j = i; j < 4; ++j)
+        a[k++] += weight * p[i] * p[j];
+  }
+  void add(const Quadric &q)
+  {
+    for (uint32 i = 0; i < 10; ++i)
+      a[i] += q.a[i];
+  }
+  // squared distance to the planes at v
+  float64 error(vec3 v) const
+  {
+    const float64 x = v.x, y = v.y, z = v.z;
+    return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x +
+           a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y + a[7] * z * z +
+           2 * a[8] * z + a[9];
+  }
+};
+
+struct Edge_Collapse
+{
+  float64 cost;
+  uint32 from;
+  uint32 to;
+  // stale if either vertex changed since this was queued
+  uint32 from_version;
+  uint32 to_version;
+  bool operator<(const Edge_Collapse &rhs) const { return cost > rhs.cost; }
+};
+
+std::vector<uint32> simplify_indices(const std::vector<vec3> &positions,
+                                     const std::vector<uint32> &indices,
+                                     uint32 target_triangles)
+{
+  const uint32 vertex_count = positions.size();
+  const uint32 triangle_count = indices.size() / 3;
+  std::vector<uint32> faces(indices.begin(),
+                            indices.begin() + 3 * triangle_count);
+  std::vector<bool> face_alive(triangle_count, true);
+  std::vector<std::vector<uint32>> vertex_faces(vertex_count);
+  std::vector<Quadric> quadrics(vertex_count);
+  uint32 live_triangles = 0;
+  for (uint32 f = 0; f < triangle_count; ++f)
+  {
+    const uint32 *v = &faces[3 * f];
+    if (v[0] == v[1] || v[1] == v[2] || v[0] == v[2])
     {
-      data.indices.push_back(face.mIndices[j]);
+      face_alive[f] = false;
+      continue;
     }
+    live_triangles += 1;
+    for (uint32 k = 0; k < 3; ++k)
+      vertex_faces[v[k]].push_back(f);
+    const vec3 &p0 = positions[v[0]];
+    vec3 n = cross(positions[v[1]] - p0, positions[v[2]] - p0);
+    const float32 double_area = length(n);
+    if (double_area == 0.0f)
+      continue;
+    n /= double_area;
+    // area weighted so big flat faces hold their shape
+    for (uint32 k = 0; k < 3; ++k)
+      quadrics[v[k]].add_plane(n, -dot(n, p0), 0.5 * double_area);
   }
-  return data;
+
+  // edges used by a single face are mesh borders or uv/normal seams, where
+  // vertices are split - moving them would tear the surface
+  auto edge_key = [](uint32 a, uint32 b) {
+    return a < b ? (uint64(a) << 32) | b : (uint64(b) << 32) | a;
+  };
+  std::unordered_map<uint64, uint32> edge_uses;
+  for (uint32 f = 0; f < triangle_count; ++f)
+  {
+    if (!face_alive[f])
+      continue;
+    for (uint32 k = 0; k < 3; ++k)
+      edge_uses[edge_key(faces[3 * f + k], faces[3 * f + (k + 1) % 3])] += 1;
+  }
+  std::vector<bool> locked(vertex_count, false);
+  for (auto &edge : edge_uses)
+  {
+    if (edge.second == 1)
+    {
+      locked[edge.first >> 32] = true;
+      locked[edge.first & 0xffffffff] = true;
+    }
+  }
+
+  std::vector<uint32> version(vertex_count, 0);
+  std::priority_queue<Edge_Collapse> queue;
+  auto push_collapse = [&](uint32 from, uint32 to) {
+    if (locked[from])
+      return;
+    Quadric q = quadrics[from];
+    q.add(quadrics[to]);
+    queue.push({q.error(positions[to]), from, to, version[from], version[to]});
+  };
+  for (auto &edge : edge_uses)
+  {
+    const uint32 a = edge.first >> 32;
+    const uint32 b = edge.first & 0xffffffff;
+    push_collapse(a, b);
+    push_collapse(b, a);
+  }
+
+  auto face_has = [&](uint32 f, uint32 v) {
+    return faces[3 * f] == v || faces[3 * f + 1] == v || faces[3 * f + 2] == v;
+  };
+  auto face_normal = [&](uint32 f, uint32 replace, uint32 with) {
+    vec3 p[3];
+    for (uint32 k = 0; k < 3; ++k)
+    {
+      const uint32 v = faces[3 * f + k];
+      p[k] = positions[v == replace ? with : v];
+    }
+    return cross(p[1] - p[0], p[2] - p[0]);
+  };
+
+  std::vector<uint32> neighbors;
+  while (live_triangles > target_triangles && !queue.empty())
+  {
+    const Edge_Collapse c = queue.top();
+    queue.pop();
+    if (version[c.from] != c.from_version || version[c.to] != c.to_version)
+      continue;
+
+    bool adjacent = false;
+    bool flips = false;
+    for (uint32 f : vertex_faces[c.from])
+    {
+      if (!face_alive[f])
+        continue;
+      if (face_has(f, c.to))
+      {
+        adjacent = true;
+        continue;
+      }
+      // the faces that survive must not fold over or collapse to a line
+      const vec3 before = face_normal(f, c.from, c.from);
+      const vec3 after = face_normal(f, c.from, c.to);
+      const float32 after_length = length(after);
+      if (after_length == 0.0f ||
+          dot(before, after) < 0.25f * length(before) * after_length)
+      {
+        flips = true;
+        break;
+      }
+    }
+    if (!adjacent || flips)
+      continue;
+
+    for (uint32 f : vertex_faces[c.from])
+    {
+      if (!face_alive[f])
+        continue;
+      if (face_has(f, c.to))
+      {
+        face_alive[f] = false;
+        live_triangles -= 1;
+        continue;
+      }
+      for (uint32 k = 0; k < 3; ++k)
+        if (faces[3 * f + k] == c.from)
+          faces[3 * f + k] = c.to;
+      vertex_faces[c.to].push_back(f);
+    }
+    vertex_faces[c.from].clear();
+    quadrics[c.to].add(quadrics[c.from]);
+    version[c.from] += 1;
+    version[c.to] += 1;
+
+    // every collapse touching 'to' is stale now
+    neighbors.clear();
+    for (uint32 f : vertex_faces[c.to])
+    {
+      if (!face_alive[f])
+        continue;
+      for (uint32 k = 0; k < 3; ++k)
+        if (faces[3 * f + k] != c.to)
+          neighbors.push_back(faces[3 * f + k]);
+    }
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()),
+                    neighbors.end());
+    for (uint32 w : neighbors)
+    {
+      push_collapse(w, c.to);
+      push_collapse(c.to, w);
+    }
+  }
+
+  std::vector<uint32> result;
+  result.reserve(3 * live_triangles);
+  for (uint32 f = 0; f < triangle_count; ++f)
+    if (face_alive[f])
+      result.insert(result.end(), &faces[3 * f], &faces[3 * f] + 3);
+  return result;
+}
+
+void generate_lods(Mesh_Data &mesh)
+{
+  // below this a level isn't worth the draw call bookkeeping
+  const uint32 min_triangles = 64;
+  mesh.lod_indices.clear();
+  std::string counts = s(mesh.indices.size() / 3);
+  for (uint32 level = 1; level < MAX_MESH_LODS; ++level)
+  {
+    const std::vector<uint32> &previous =
+        level == 1 ? mesh.indices : mesh.lod_indices.back();
+    const uint32 triangles = previous.size() / 3;
+    if (triangles < 2 * min_triangles)
+      break;
+    std::vector<uint32> simplified =
+        simplify_indices(mesh.positions, previous, triangles / 2);
+    // mostly seams, the simplifier ran out of vertices it may move, or the
+    // mesh wasn't welded
+    if (simplified.size() > 3 * previous.size() / 4)
+      break;
+    counts += s(" ", simplified.size() / 3);
+    mesh.lod_indices.push_back(
+        optimize_vertex_cache(simplified, mesh.positions.size()));
+  }
+  set_message(s("Mesh LOD triangle counts for ", mesh.name, ": "), counts);
+}
+
+float32 average_cache_miss_ratio(const std::vector<uint32> &indices,
+                                 uint32 vertex_count, uint32 cache_size)
+{
+  if (indices.size() < 3)
+    return 0.0f;
+  // time each vertex entered the cache, fifo so hits don't refresh it
+  std::vector<uint32> entered(vertex_count, 0);
+  uint32 misses = 0;
+  for (uint32 index : indices)
+  {
+    if (entered[index] && misses - entered[index] < cache_size)
+      continue;
+    misses += 1;
+    entered[index] = misses;
+  }
+  return float32(misses) / float32(indices.size() / 3);
+}
+
+// forsyth's linear speed vertex cache optimisation, greedy on a score that
+// favours recently used vertices and ones with few triangles left
+#define SCORED_CACHE_SIZE 32
+static float32 vertex_score(int32 cache_position, uint32 live_triangles)
+{
+  if (live_triangles == 0)
+    return -1.0f;
+  float32 score = 0.0f;
+  if (cache_position >= 0)
+  {
+    // the last triangle's vertices, keep it from picking the same one twice
+    if (cache_position < 3)
+      score = 0.75f;
+    else
+      score = pow(1.0f - float32(cache_position - 3) /
+                             float32(SCORED_CACHE_SIZE - 3),
+                  1.5f);
+  }
+  return score + 2.0f * pow(float32(live_triangles), -0.5f);
+}
+
+std::vector<uint32> optimize_vertex_cache(const std::vector<uint32> &indices,
+                                          uint32 vertex_count)
+{
+  const uint32 triangle_count = indices.size() / 3;
+  // triangles using each vertex, live ones first
+  std::vector<uint32> live(vertex_count, 0);
+  for (uint32 i = 0; i < 3 * triangle_count; ++i)
+    live[indices[i]] += 1;
+  std::vector<uint32> first_triangle(vertex_count + 1, 0);
+  for (uint32 v = 0; v < vertex_count; ++v)
+    first_triangle[v + 1] = first_triangle[v] + live[v];
+  std::vector<uint32> vertex_triangles(first_triangle.back());
+  {
+    std::vector<uint32> filled(first_triangle.begin(), first_triangle.end());
+    for (uint32 i = 0; i < 3 * triangle_count; ++i)
+      vertex_triangles[filled[indices[i]]++] = i / 3;
+  }
+
+  std::vector<int32> cache_position(vertex_count, -1);
+  std::vector<float32> score(vertex_count);
+  for (uint32 v = 0; v < vertex_count; ++v)
+    score[v] = vertex_score(-1, live[v]);
+  std::vector<float32> triangle_score(triangle_count);
+  std::vector<bool> emitted(triangle_count, false);
+  for (uint32 t = 0; t < triangle_count; ++t)
+    triangle_score[t] = score[indices[3 * t]] + score[indices[3 * t + 1]] +
+                        score[indices[3 * t + 2]];
+
+  std::vector<uint32> result;
+  result.reserve(3 * triangle_count);
+  std::vector<uint32> cache;
+  std::vector<uint32> next_cache;
+  std::vector<uint32> evicted;
+  uint32 next_unemitted = 0;
+  int64 best = -1;
+  while (result.size() < 3 * triangle_count)
+  {
+    if (best == -1)
+    { // nothing in the cache touches a live triangle, start somewhere new
+      while (emitted[next_unemitted])
+        next_unemitted += 1;
+      best = next_unemitted;
+    }
+    emitted[best] = true;
+    const uint32 *v = &indices[3 * best];
+    result.insert(result.end(), v, v + 3);
+
+    next_cache.assign(v, v + 3);
+    for (uint32 i = 0; i < 3; ++i)
+    {
+      // swap the emitted triangle out of the live part of the list
+      uint32 *begin = &vertex_triangles[first_triangle[v[i]]];
+      uint32 *end = begin + live[v[i]];
+      std::swap(*std::find(begin, end, uint32(best)), *(end - 1));
+      live[v[i]] -= 1;
+    }
+    for (uint32 vertex : cache)
+      if (vertex != v[0] && vertex != v[1] && vertex != v[2])
+        next_cache.push_back(vertex);
+    evicted.clear();
+    if (next_cache.size() > SCORED_CACHE_SIZE)
+    {
+      evicted.assign(next_cache.begin() + SCORED_CACHE_SIZE, next_cache.end());
+      next_cache.resize(SCORED_CACHE_SIZE);
+    }
+    std::swap(cache, next_cache);
+
+    for (uint32 vertex : evicted)
+    {
+      cache_position[vertex] = -1;
+      score[vertex] = vertex_score(-1, live[vertex]);
+    }
+    for (uint32 i = 0; i < cache.size(); ++i)
+    {
+      cache_position[cache[i]] = i;
+      score[cache[i]] = vertex_score(i, live[cache[i]]);
+    }
+    // the evicted vertices' triangles lose their cache bonus too, the ones
+    // that still touch the cache are rescored below anyway
+    for (uint32 vertex : evicted)
+    {
+      const uint32 begin = first_triangle[vertex];
+      for (uint32 j = begin; j < begin + live[vertex]; ++j)
+      {
+        const uint32 t = vertex_triangles[j];
+        const uint32 *tv = &indices[3 * t];
+        triangle_score[t] = score[tv[0]] + score[tv[1]] + score[tv[2]];
+      }
+    }
+    best = -1;
+    float32 best_score = -1.0f;
+    for (uint32 vertex : cache)
+    {
+      const uint32 begin = first_triangle[vertex];
+      for (uint32 j = begin; j < begin + live[vertex]; ++j)
+      {
+        const uint32 t = vertex_triangles[j];
+        const uint32 *tv = &indices[3 * t];
+        triangle_score[t] = score[tv[0]] + score[tv[1]] + score[tv[2]];
+        if (triangle_score[t] > best_score)
+        {
+          best = t;
+          best_score = triangle_score[t];
+        }
+      }
+    }
+  }
+  return result;
+}
+
+// every attribute of a vertex, welded when all of them are bit identical
+struct Packed_Vertex
+{
+  vec3 position;
+  vec3 normal;
+  vec2 texture_coordinate;
+  vec3 tangent;
+  vec3 bitangent;
+  bool operator==(const Packed_Vertex &rhs) const
+  {
+    return memcmp(this, &rhs, sizeof(Packed_Vertex)) == 0;
+  }
+};
+static_assert(sizeof(Packed_Vertex) == 14 * sizeof(float32),
+              "compared and hashed as bytes, so it can't have padding");
+struct Packed_Vertex_Hash
+{
+  size_t operator()(const Packed_Vertex &v) const
+  {
+    return size_t(hash_bytes(&v, sizeof(Packed_Vertex)));
+  }
+};
+
+static size_t mesh_bytes(uint32 vertex_count, size_t index_count)
+{
+  return vertex_count * sizeof(Packed_Vertex) +
+         index_count * index_size_for(vertex_count);
+}
+
+void optimize_mesh(Mesh_Data &mesh)
+{
+  const uint32 vertex_count = mesh.positions.size();
+  const float32 acmr_before =
+      average_cache_miss_ratio(mesh.indices, vertex_count);
+  const size_t bytes_before = vertex_count * sizeof(Packed_Vertex) +
+                              mesh.indices.size() * sizeof(uint32);
+
+  // weld
+  std::vector<uint32> remap(vertex_count);
+  std::vector<Packed_Vertex> vertices;
+  vertices.reserve(vertex_count);
+  std::unordered_map<Packed_Vertex, uint32, Packed_Vertex_Hash> welded;
+  welded.reserve(vertex_count);
+  for (uint32 i = 0; i < vertex_count; ++i)
+  {
+    Packed_Vertex vertex{};
+    vertex.position = mesh.positions[i];
+    vertex.normal = mesh.normals[i];
+    vertex.texture_coordinate = mesh.texture_coordinates[i];
+    vertex.tangent = mesh.tangents[i];
+    vertex.bitangent = mesh.bitangents[i];
+    auto inserted = welded.insert({vertex, uint32(vertices.size())});
+    if (inserted.second)
+      vertices.push_back(vertex);
+    remap[i] = inserted.first->second;
+  }
+  for (uint32 &index : mesh.indices)
+    index = remap[index];
+
+  mesh.indices = optimize_vertex_cache(mesh.indices, vertices.size());
+
+  // vertices in the order the triangles first use them, unused ones dropped
+  const uint32 unassigned = UINT32_MAX;
+  remap.assign(vertices.size(), unassigned);
+  uint32 used = 0;
+  for (uint32 &index : mesh.indices)
+  {
+    if (remap[index] == unassigned)
+      remap[index] = used++;
+    index = remap[index];
+  }
+  mesh.positions.resize(used);
+  mesh.normals.resize(used);
+  mesh.texture_coordinates.resize(used);
+  mesh.tangents.resize(used);
+  mesh.bitangents.resize(used);
+  for (uint32 i = 0; i < vertices.size(); ++i)
+  {
+    const uint32 to = remap[i];
+    if (to == unassigned)
+      continue;
+    mesh.positions[to] = vertices[i].position;
+    mesh.normals[to] = vertices[i].normal;
+    mesh.texture_coordinates[to] = vertices[i].texture_coordinate;
+    mesh.tangents[to] = vertices[i].tangent;
+    mesh.bitangents[to] = vertices[i].bitangent;
+  }
+
+  const float32 acmr_after = average_cache_miss_ratio(mesh.indices, used);
+  set_message(s("Mesh optimization for ", mesh.name, ": "),
+              s("vertices ", vertex_count, " -> ", used, ", acmr ",
+                acmr_before, " -> ", acmr_after, ", bytes ", bytes_before,
+                " -> ", mesh_bytes(used, mesh.indices.size())));
+}
+
+uint32 index_size_for(uint32 vertex_count)
+{
+  return vertex_count <= 65536 ? 2 : 4;
 }
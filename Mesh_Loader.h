@@ -14,6 +14,9 @@ struct Mesh_Data
   std::vector<vec3> tangents;
   std::vector<vec3> bitangents;
   std::vector<uint32> indices;
+  // simplified index lists into the same vertices, each about half the
+  // triangles of the one before, see generate_lods()
+  std::vector<std::vector<uint32>> lod_indices;
   std::string name;
 
   //two mesh data structs with the same unique_ID are assumed
@@ -33,3 +36,32 @@ std::string identifier_for_primitive(Mesh_Primitive p);
 void copy_mesh_data(std::vector<vec3> &dst, aiVector3D *src, uint32 length);
 void copy_mesh_data(std::vector<vec2> &dst, aiVector3D *src, uint32 length);
 Mesh_Data load_mesh(const aiMesh *aimesh, std::string unique_identifier);
+
+// quadric error metric edge collapse down to about target_triangles
+// vertices only ever collapse onto existing vertices, so the result indexes
+// the same vertex buffer - border and seam vertices are never moved
+std::vector<uint32> simplify_indices(const std::vector<vec3> &positions,
+                                     const std::vector<uint32> &indices,
+                                     uint32 target_triangles);
+
+// fills mesh.lod_indices, at most MAX_MESH_LODS - 1 levels
+// needs welded vertices, see optimize_mesh() - where every face corner has
+// its own vertex every edge looks like a border and no level is made
+void generate_lods(Mesh_Data &mesh);
+
+// transformed vertices per triangle through a cache_size entry fifo, 3 is
+// no reuse at all and 0.5 is about the best a regular grid gets
+float32 average_cache_miss_ratio(const std::vector<uint32> &indices,
+                                 uint32 vertex_count, uint32 cache_size = 16);
+
+// the same triangles ordered for post transform cache hits
+std::vector<uint32> optimize_vertex_cache(const std::vector<uint32> &indices,
+                                          uint32 vertex_count);
+
+// welds identical vertices, orders the triangles for the post transform
+// cache and the vertices by first use for fetch locality, then reports
+// acmr and size before and after - run it before generate_lods()
+void optimize_mesh(Mesh_Data &mesh);
+
+// bytes per index the mesh is uploaded with, 2 whenever the vertices fit
+uint32 index_size_for(uint32 vertex_count);
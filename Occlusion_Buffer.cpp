@@ -0,0 +1,226 @@
+#include "Occlusion_Buffer.h"
+#include "Globals.h"
+#include <algorithm>
+#include <cfloat>
+#if defined(__SSE2__) || defined(_M_X64)
+#define OCCLUSION_SSE 1
+#include <emmintrin.h>
+#else
+#define OCCLUSION_SSE 0
+#endif
+
+#define OCCLUSION_TILE_SIZE 8
+// rows are processed 4 pixels at a time
+#define OCCLUSION_ROW_ALIGN 4
+
+void Occlusion_Buffer::clear(ivec2 new_size)
+{
+  ASSERT(new_size.x > 0 && new_size.y > 0);
+  const int32 align = OCCLUSION_ROW_ALIGN;
+  new_size.x = (new_size.x + align - 1) & ~(align - 1);
+  size = new_size;
+  tiles = (size + ivec2(OCCLUSION_TILE_SIZE - 1)) / OCCLUSION_TILE_SIZE;
+  depth.assign(size.x * size.y, 1.0f);
+  tile_max_depth.assign(tiles.x * tiles.y, 1.0f);
+}
+
+void Occlusion_Buffer::rasterize(const mat4 &MVP,
+                                 const std::vector<vec3> &positions,
+                                 const std::vector<uint32> &indices)
+{
+  const vec2 half_size = 0.5f * vec2(size);
+  auto to_screen = [&](vec4 clip) {
+    const vec3 ndc = vec3(clip) / clip.w;
+    return vec3((ndc.x + 1.0f) * half_size.x, (ndc.y + 1.0f) * half_size.y,
+                0.5f * ndc.z + 0.5f);
+  };
+  for (uint32 i = 0; i + 2 < indices.size(); i += 3)
+  {
+    const vec4 v[3] = {MVP * vec4(positions[indices[i]], 1),
+                       MVP * vec4(positions[indices[i + 1]], 1),
+                       MVP * vec4(positions[indices[i + 2]], 1)};
+
+    // clip against the near plane, z + w >= 0
+    vec4 clipped[4];
+    uint32 count = 0;
+    for (uint32 j = 0; j < 3; ++j)
+    {
+      const vec4 &a = v[j];
+      const vec4 &b = v[(j + 1) % 3];
+      const float32 da = a.z + a.w;
+      const float32 db = b.z + b.w;
+      if (da >= 0)
+        clipped[count++] = a;
+      if ((da >= 0) != (db >= 0))
+        clipped[count++] = mix(a, b, da / (da - db));
+    }
+    if (count < 3)
+      continue;
+    const vec3 s0 = to_screen(clipped[0]);
+    for (uint32 j = 1; j + 1 < count; ++j)
+      rasterize_triangle(s0, to_screen(clipped[j]), to_screen(clipped[j + 1]));
+  }
+}
+
+void Occlusion_Buffer::rasterize_triangle(vec3 a, vec3 b, vec3 c)
+{
+  // edge(p, q, r) = A*r.x + B*r.y + C, positive inside for ccw
+  float32 area = (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+  if (area == 0.0f)
+    return;
+  if (area < 0.0f)
+  {
+    std::swap(b, c);
+    area = -area;
+  }
+
+  // clamped first so huge coordinates near the near plane can't overflow
+  const vec2 lower = vec2(-1.0f);
+  const vec2 upper = vec2(size) + 1.0f;
+  const vec2 low = clamp(min(vec2(a), min(vec2(b), vec2(c))), lower, upper);
+  const vec2 high = clamp(max(vec2(a), max(vec2(b), vec2(c))), lower, upper);
+  const int32 x_min = glm::max(int32(floor(low.x)), 0);
+  const int32 x_max = glm::min(int32(ceil(high.x)), size.x - 1);
+  const int32 y_min = glm::max(int32(floor(low.y)), 0);
+  const int32 y_max = glm::min(int32(ceil(high.y)), size.y - 1);
+  if (x_min > x_max || y_min > y_max)
+    return;
+
+  // edge opposite each vertex
+  const vec3 p[3] = {a, b, c};
+  float32 A[3], B[3], C[3];
+  for (uint32 i = 0; i < 3; ++i)
+  {
+    const vec3 &from = p[(i + 1) % 3];
+    const vec3 &to = p[(i + 2) % 3];
+    A[i] = -(to.y - from.y);
+    B[i] = to.x - from.x;
+    C[i] = (to.y - from.y) * from.x - (to.x - from.x) * from.y;
+  }
+  // depth plane from the barycentric weights
+  const float32 inv_area = 1.0f / area;
+  const float32 zA = (A[0] * a.z + A[1] * b.z + A[2] * c.z) * inv_area;
+  const float32 zB = (B[0] * a.z + B[1] * b.z + B[2] * c.z) * inv_area;
+  const float32 zC = (C[0] * a.z + C[1] * b.z + C[2] * c.z) * inv_area;
+
+  const int32 x_start = x_min & ~(OCCLUSION_ROW_ALIGN - 1);
+#if OCCLUSION_SSE
+  const __m128 lane = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+  const __m128 zero = _mm_setzero_ps();
+  for (int32 y = y_min; y <= y_max; ++y)
+  {
+    const float32 py = y + 0.5f;
+    const __m128 e0_row = _mm_set1_ps(B[0] * py + C[0]);
+    const __m128 e1_row = _mm_set1_ps(B[1] * py + C[1]);
+    const __m128 e2_row = _mm_set1_ps(B[2] * py + C[2]);
+    const __m128 z_row = _mm_set1_ps(zB * py + zC);
+    float32 *row = &depth[y * size.x];
+    for (int32 x = x_start; x <= x_max; x += OCCLUSION_ROW_ALIGN)
+    {
+      const __m128 px = _mm_add_ps(_mm_set1_ps(float32(x)), lane);
+      const __m128 e0 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[0]), px), e0_row);
+      const __m128 e1 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[1]), px), e1_row);
+      const __m128 e2 = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(A[2]), px), e2_row);
+      const __m128 inside = _mm_and_ps(
+          _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_cmpge_ps(e1, zero)),
+          _mm_cmpge_ps(e2, zero));
+      if (_mm_movemask_ps(inside) == 0)
+        continue;
+      const __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(zA), px), z_row);
+      const __m128 old = _mm_loadu_ps(row + x);
+      const __m128 nearest = _mm_min_ps(old, z);
+      _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest),
+                                       _mm_andnot_ps(inside, old)));
+    }
+  }
+#else
+  for (int32 y = y_min; y <= y_max; ++y)
+  {
+    const float32 py = y + 0.5f;
+    float32 *row = &depth[y * size.x];
+    for (int32 x = x_start; x <= x_max; ++x)
+    {
+      const float32 px = x + 0.5f;
+      if (A[0] * px + B[0] * py + C[0] < 0 ||
+          A[1] * px + B[1] * py + C[1] < 0 || A[2] * px + B[2] * py + C[2] < 0)
+        continue;
+      row[x] = glm::min(row[x], zA * px + zB * py + zC);
+    }
+  }
+#endif
+}
+
+void Occlusion_Buffer::build_hierarchy()
+{
+  for (int32 ty = 0; ty < tiles.y; ++ty)
+  {
+    for (int32 tx = 0; tx < tiles.x; ++tx)
+    {
+      const int32 x_end = glm::min((tx + 1) * OCCLUSION_TILE_SIZE, size.x);
+      const int32 y_end = glm::min((ty + 1) * OCCLUSION_TILE_SIZE, size.y);
+      float32 farthest = 0.0f;
+      for (int32 y = ty * OCCLUSION_TILE_SIZE; y < y_end; ++y)
+        for (int32 x = tx * OCCLUSION_TILE_SIZE; x < x_end; ++x)
+          farthest = glm::max(farthest, depth[y * size.x + x]);
+      tile_max_depth[ty * tiles.x + tx] = farthest;
+    }
+  }
+}
+
+bool Occlusion_Buffer::is_occluded(const mat4 &MVP, vec3 bounds_min,
+                                   vec3 bounds_max) const
+{
+  if (size.x == 0)
+    return false;
+  vec2 screen_min = vec2(FLT_MAX);
+  vec2 screen_max = vec2(-FLT_MAX);
+  float32 nearest = 1.0f;
+  for (uint32 i = 0; i < 8; ++i)
+  {
+    const vec3 corner = vec3(i & 1 ? bounds_max.x : bounds_min.x,
+                             i & 2 ? bounds_max.y : bounds_min.y,
+                             i & 4 ? bounds_max.z : bounds_min.z);
+    const vec4 clip = MVP * vec4(corner, 1);
+    // crosses the near plane, could cover anything
+    if (clip.z < -clip.w || clip.w <= 0.0f)
+      return false;
+    const vec3 ndc = vec3(clip) / clip.w;
+    const vec2 screen = (vec2(ndc) + 1.0f) * 0.5f * vec2(size);
+    screen_min = min(screen_min, screen);
+    screen_max = max(screen_max, screen);
+    nearest = glm::min(nearest, 0.5f * ndc.z + 0.5f);
+  }
+
+  screen_min = clamp(screen_min, vec2(-2.0f), vec2(size) + 2.0f);
+  screen_max = clamp(screen_max, vec2(-2.0f), vec2(size) + 2.0f);
+  // one extra pixel on every side covers the partially covered pixels at
+  // occluder silhouettes, which were only sampled at their centers
+  const int32 x_min = glm::max(int32(floor(screen_min.x)) - 1, 0);
+  const int32 x_max = glm::min(int32(floor(screen_max.x)) + 1, size.x - 1);
+  const int32 y_min = glm::max(int32(floor(screen_min.y)) - 1, 0);
+  const int32 y_max = glm::min(int32(floor(screen_max.y)) + 1, size.y - 1);
+  // off screen, frustum culling is someone else's job
+  if (x_min > x_max || y_min > y_max)
+    return false;
+
+  for (int32 ty = y_min / OCCLUSION_TILE_SIZE;
+       ty <= y_max / OCCLUSION_TILE_SIZE; ++ty)
+  {
+    for (int32 tx = x_min / OCCLUSION_TILE_SIZE;
+         tx <= x_max / OCCLUSION_TILE_SIZE; ++tx)
+    {
+      if (nearest > tile_max_depth[ty * tiles.x + tx])
+        continue;
+      // the tile as a whole can't prove it, check its pixels
+      const int32 x_begin = glm::max(tx * OCCLUSION_TILE_SIZE, x_min);
+      const int32 x_end = glm::min((tx + 1) * OCCLUSION_TILE_SIZE - 1, x_max);
+      const int32 y_begin = glm::max(ty * OCCLUSION_TILE_SIZE, y_min);
+      const int32 y_end = glm::min((ty + 1) * OCCLUSION_TILE_SIZE - 1, y_max);
+      for (int32 y = y_begin; y <= y_end; ++y)
+        for (int32 x = x_begin; x <= x_end; ++x)
+          if (nearest <= depth[y * size.x + x])
+            return false;
+    }
+  }
+  return true;
+}
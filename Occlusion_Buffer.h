@@ -0,0 +1,36 @@
+#pragma once
+#include "Globals.h"
+#include <glm/glm.hpp>
+#include <vector>
+using namespace glm;
+
+// low resolution cpu depth buffer for occlusion culling
+// large occluders are rasterized into it, then bounding boxes are tested
+// against the per tile max depth and, where that fails, the full buffer
+// depth is ndc z remapped to [0,1], 0 near 1 far
+struct Occlusion_Buffer
+{
+  // resets every pixel to the far plane
+  void clear(ivec2 size);
+
+  // triangle list in model space, both faces are drawn
+  void rasterize(const mat4 &MVP, const std::vector<vec3> &positions,
+                 const std::vector<uint32> &indices);
+
+  // computes the tile max depths, call after the last rasterize()
+  void build_hierarchy();
+
+  // conservative: true only if every pixel the box could touch has an
+  // occluder in front of the box's nearest point
+  bool is_occluded(const mat4 &MVP, vec3 bounds_min, vec3 bounds_max) const;
+
+  ivec2 get_size() const { return size; }
+
+private:
+  // x,y in pixels, z depth
+  void rasterize_triangle(vec3 a, vec3 b, vec3 c);
+  ivec2 size = ivec2(0);
+  ivec2 tiles = ivec2(0);
+  std::vector<float32> depth;
+  std::vector<float32> tile_max_depth;
+};
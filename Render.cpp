@@ -10,20 +10,31 @@
 #include "stb_image.h"
 #undef STB_IMAGE_IMPLEMENTATION
 
+#include "Baked_Model.h"
+#include "File_Watcher.h"
+#include "Job_System.h"
 #include "Mesh_Loader.h"
 #include "Render.h"
 #include "Shader.h"
+#include "Texture_Compression.h"
 #include "Timer.h"
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtx/euler_angles.hpp>
 #include <glm/gtx/transform.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <thread>
 #include <time.h>
 #include <unordered_map>
 #include <vector>
@@ -35,28 +46,231 @@ using namespace std;
 #define DEPTH_TARGET GL_COLOR_ATTACHMENT1
 #define NORMAL_TARGET GL_COLOR_ATTACHMENT2
 #define POSITION_TARGET GL_COLOR_ATTACHMENT3
+#define VELOCITY_TARGET GL_COLOR_ATTACHMENT4
 
-const GLenum RENDER_TARGETS[] = {DIFFUSE_TARGET};
+// order must match the fragment shader output locations
+const GLenum RENDER_TARGETS[] = {DIFFUSE_TARGET, VELOCITY_TARGET};
 #define TARGET_COUNT sizeof(RENDER_TARGETS) / sizeof(GLenum)
 
 static Timer FRAME_TIMER = Timer(60);
 static Timer SWAP_TIMER = Timer(60);
-static GLuint TARGET_FRAMEBUFFER = 0; // fbo that gets rendered to
-static GLuint COLOR_TARGET_TEXTURE =
-    0; // color texture that is bound to target framebuffer
-static GLuint DEPTH_TARGET_TEXTURE =
-    0; // depth texture that is bound to target framebuffer
-static GLuint PREV_COLOR_TARGET = 0; // color texture from previous frame
-static bool PREV_COLOR_TARGET_MISSING = true;
+static Timer FENCE_WAIT_TIMER = Timer(60);
+
+// objects this tall on screen or more use the full mesh, every halving of
+// the size drops one LOD level
+const float32 LOD_PIXELS = 300.0f;
+// fraction past a level boundary before switching, avoids popping back and
+// forth when an object sits right at the boundary
+const float32 LOD_HYSTERESIS = 0.15f;
+
+// render targets are allocated once at this scale, the render scale only
+// changes the viewport
+const float32 MIN_RENDER_SCALE = 0.1f;
+const float32 MAX_RENDER_SCALE = 2.0f;
+
+// asynchronous screenshots: glReadPixels/glGetTexImage write into a pixel
+// pack buffer, a fence tells us when that copy is done and the buffer is
+// mapped a few frames later, png compression runs on the encoder threads
+#define CAPTURE_RING_SIZE (2 * MAX_FRAMES_IN_FLIGHT + 2)
+#define ENCODE_QUEUE_LIMIT 32 // the gl thread blocks past this many
+struct Capture_Slot
+{
+  GLuint pbo = 0;
+  GLsizeiptr pbo_size = 0;
+  GLsync fence = nullptr;
+  ivec2 size = ivec2(0);
+  std::string name;
+};
+struct Encode_Job
+{
+  std::vector<uint8> pixels; // tightly packed RGBA8, bottom row first
+  ivec2 size;
+  std::string name;
+};
+static Capture_Slot CAPTURE_RING[CAPTURE_RING_SIZE];
+static uint32 CAPTURE_OLDEST = 0; // slots complete in the order they're used
+static uint32 CAPTURE_PENDING = 0;
+static std::deque<Encode_Job> ENCODE_QUEUE;
+static std::mutex ENCODE_MUTEX;
+static std::condition_variable ENCODE_READY; // job pushed or shutdown
+static std::condition_variable ENCODE_SPACE; // job popped
+static std::vector<std::thread> ENCODE_THREADS;
+static bool ENCODE_SHUTDOWN = false;
+static Timer CAPTURE_TIMER = Timer(60); // gl thread cost per capture
+static void process_captures(bool wait);
+static void stop_encoder_threads();
+static const GLint *get_draw_uniform_locations(const Shader &shader);
+
+// opaque draws are recorded into command buffers by the job system and
+// replayed on the gl thread, which only binds and uploads what changed
+// uniform locations cached per program, lights[i] members follow the rest
+enum Draw_Uniform
+{
+  mvp_uniform,
+  previous_mvp_uniform,
+  model_uniform,
+  uv_scale_uniform,
+  time_uniform,
+  txaa_jitter_uniform,
+  camera_position_uniform,
+  texture_layers_uniform,
+  albedo_constant_uniform,
+  emissive_constant_uniform,
+  roughness_constant_uniform,
+  number_of_lights_uniform,
+  additional_ambient_uniform,
+  instanced_uniform,
+  instance_offset_uniform,
+  instance_transforms_uniform,
+  light_uniforms
+};
+enum Light_Uniform
+{
+  light_position,
+  light_direction,
+  light_color,
+  light_attenuation,
+  light_ambient,
+  light_cone_angle,
+  light_type,
+  light_uniform_count
+};
+// Light_Array flattened into uniform order, compared with memcmp
+struct Packed_Lights
+{
+  vec3 position[MAX_LIGHTS];
+  vec3 direction[MAX_LIGHTS];
+  vec3 color[MAX_LIGHTS];
+  vec3 attenuation[MAX_LIGHTS];
+  vec3 ambient[MAX_LIGHTS]; // premultiplied by color
+  float32 cone_angle[MAX_LIGHTS];
+  int32 type[MAX_LIGHTS];
+  int32 count;
+  vec3 additional_ambient;
+};
+struct Draw_Command
+{
+  mat4 MVP;
+  mat4 previous_MVP;
+  mat4 Model;
+  Mesh *mesh;
+  Material *material;
+  Shader *shader; // the material's permutation for these lights
+  uint32 lights; // index into the command buffer's lights
+  uint32 first_index;
+  uint32 index_count;
+};
+struct Command_Buffer
+{
+  std::vector<Draw_Command> commands;
+  std::vector<Packed_Lights> lights;
+};
+// sorted by state, then by order
+// entities with equal descriptors share a material ID, so they sort
+// together and bind it once, the lod keeps a mesh's draws of one index
+// range together for instancing
+struct Draw_Command_Key
+{
+  uint64 state; // program | material ID, 32 bits each
+  uint64 order; // vao 32 | lod 2 | front to back depth 14
+  uint32 buffer;
+  uint32 index;
+};
+#define COMMANDS_PER_JOB 256
+static std::vector<Command_Buffer> COMMAND_BUFFERS; // one per job, reused
+static std::vector<Draw_Command_Key> COMMAND_KEYS;
+// neighbouring keys that draw the same mesh range with the same program,
+// material and lights, replayed as one instanced draw when count > 1
+struct Draw_Batch
+{
+  uint32 first_key;
+  uint32 count;
+  uint32 instance_offset; // into INSTANCE_TRANSFORMS, in instances
+};
+static std::vector<Draw_Batch> DRAW_BATCHES;
+// MVP, previous_MVP, Model of every instanced draw, read by the vertex
+// shader from INSTANCE_TRANSFORM_TEXTURE
+static std::vector<mat4> INSTANCE_TRANSFORMS;
+static GLuint INSTANCE_TRANSFORM_BUFFER = 0;
+static GLuint INSTANCE_TRANSFORM_TEXTURE = 0; // GL_RGBA32F buffer texture
+// 3.3 guarantees 65536 texels in a buffer texture, 12 per instance
+#define MAX_BATCHED_INSTANCES (65536 / 12)
+// resolved on the main thread, get_shader may compile
+static std::vector<Shader *> ENTITY_SHADERS;
+static Timer OCCLUSION_TIMER = Timer(60);
+// width of the cpu occlusion buffer, height follows the window aspect
+#define OCCLUSION_BUFFER_WIDTH 320
+static Timer RECORD_TIMER = Timer(60);
+// requesting and checking shader permutations, the longest is the hitch
+static Timer SHADER_TIMER = Timer(60);
+static Timer REPLAY_TIMER = Timer(60);
 static GLuint INSTANCE_MVP_BUFFER = 0;   // buffer object holding MVP matrices
 static GLuint INSTANCE_MODEL_BUFFER = 0; // buffer object holding model matrices
 static Mesh QUAD;
 static Shader TEMPORALAA;
 static Shader PASSTHROUGH;
 static bool INIT = false;
-static std::unordered_map<std::string, std::weak_ptr<Mesh_Handle>> MESH_CACHE;
-static std::unordered_map<std::string, std::weak_ptr<Texture_Handle>>
+static std::unordered_map<Symbol, std::weak_ptr<Mesh_Handle>> MESH_CACHE;
+// the same file loaded with different processing is a different texture
+struct Texture_Key
+{
+  Symbol path;
+  uint32 flags; // texture_load_flags()
+  bool operator==(const Texture_Key &rhs) const
+  {
+    return path == rhs.path && flags == rhs.flags;
+  }
+};
+struct Texture_Key_Hash
+{
+  size_t operator()(const Texture_Key &key) const
+  {
+    return hash_bytes(&key, sizeof(key));
+  }
+};
+static std::unordered_map<Texture_Key, std::weak_ptr<Texture_Handle>,
+                          Texture_Key_Hash>
     TEXTURE_CACHE;
+// by Material_Descriptor::hash() of the resolved descriptor
+static std::unordered_map<uint64, std::weak_ptr<Material_Handle>>
+    MATERIAL_CACHE;
+
+// textures decode on the job system and upload on this thread through
+// TEXTURE_UPLOAD_PBO, a few each frame
+struct Decoded_Texture
+{
+  std::weak_ptr<Texture_Handle> handle;
+  std::string path;
+  Mip_Chain mips; // empty if the file couldn't be read
+  // used instead of mips when set
+  bool compressed = false;
+  Compressed_Image image;
+};
+static std::mutex DECODED_TEXTURES_MUTEX;
+static std::deque<Decoded_Texture> DECODED_TEXTURES;
+static std::atomic<uint32> TEXTURE_DECODES_IN_FLIGHT{0};
+static GLuint TEXTURE_UPLOAD_PBO = 0;
+static const size_t TEXTURE_UPLOAD_BUDGET = 16 * 1024 * 1024; // per frame
+static Timer TEXTURE_UPLOAD_TIMER = Timer(60);
+// 1x1 stand ins while textures stream, by color and srgb << 32
+static std::unordered_map<uint64, Texture_Layer> PLACEHOLDER_TEXTURES;
+// every texture is a layer of one of these, see Texture_Layer
+struct Texture_Array
+{
+  GLuint texture = 0;
+  GLenum format = GL_RGBA;
+  ivec2 size = ivec2(0);
+  uint32 levels = 0;
+  uint32 layer_count = 0;
+  std::vector<uint32> free_layers;
+};
+static std::vector<Texture_Array> TEXTURE_ARRAYS;
+// the first array of a size gets as many layers as fit in this, at least
+// one, each further one as many as all the earlier ones together
+static const size_t TEXTURE_ARRAY_FIRST_BYTES = 1024 * 1024;
+// and no array grows past this
+static const size_t TEXTURE_ARRAY_BYTES = 32 * 1024 * 1024;
+#define MAX_TEXTURE_ARRAY_LAYERS 256
 
 void INIT_RENDERER()
 {
@@ -103,6 +317,15 @@ void INIT_RENDERER()
 
   glBindBuffer(GL_ARRAY_BUFFER, 0);
 
+  glGenBuffers(1, &INSTANCE_TRANSFORM_BUFFER);
+  glBindBuffer(GL_TEXTURE_BUFFER, INSTANCE_TRANSFORM_BUFFER);
+  glBufferData(GL_TEXTURE_BUFFER, sizeof(mat4), nullptr, GL_STREAM_DRAW);
+  glGenTextures(1, &INSTANCE_TRANSFORM_TEXTURE);
+  glBindTexture(GL_TEXTURE_BUFFER, INSTANCE_TRANSFORM_TEXTURE);
+  glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, INSTANCE_TRANSFORM_BUFFER);
+  glBindTexture(GL_TEXTURE_BUFFER, 0);
+  glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
   set_message("Renderer init finished");
 }
 void CLEANUP_RENDERER()
@@ -112,42 +335,204 @@ void CLEANUP_RENDERER()
   TEMPORALAA = Shader();
   PASSTHROUGH = Shader();
 
-  set_message("Deleting FBO, 3 textures, 2 instance buffers:",
-              s(TARGET_FRAMEBUFFER, " ", COLOR_TARGET_TEXTURE, " ",
-                PREV_COLOR_TARGET, " ", DEPTH_TARGET_TEXTURE, " ",
-                INSTANCE_MVP_BUFFER, " ", INSTANCE_MODEL_BUFFER));
+  set_message("Deleting 2 instance buffers:",
+              s(INSTANCE_MVP_BUFFER, " ", INSTANCE_MODEL_BUFFER));
 
-  glDeleteFramebuffers(1, &TARGET_FRAMEBUFFER);
-  glDeleteTextures(1, &COLOR_TARGET_TEXTURE);
-  glDeleteTextures(1, &PREV_COLOR_TARGET);
-  glDeleteRenderbuffers(1, &DEPTH_TARGET_TEXTURE);
   glDeleteBuffers(1, &INSTANCE_MVP_BUFFER);
   glDeleteBuffers(1, &INSTANCE_MODEL_BUFFER);
+  glDeleteTextures(1, &INSTANCE_TRANSFORM_TEXTURE);
+  glDeleteBuffers(1, &INSTANCE_TRANSFORM_BUFFER);
+  INSTANCE_TRANSFORM_TEXTURE = 0;
+  INSTANCE_TRANSFORM_BUFFER = 0;
+
+
+  finish_texture_streaming();
+  glDeleteBuffers(1, &TEXTURE_UPLOAD_PBO);
+  TEXTURE_UPLOAD_PBO = 0;
+  PLACEHOLDER_TEXTURES.clear();
+  for (Texture_Array &array : TEXTURE_ARRAYS)
+    glDeleteTextures(1, &array.texture);
+  TEXTURE_ARRAYS.clear();
+
+  process_captures(true);
+  stop_encoder_threads();
+  for (Capture_Slot &slot : CAPTURE_RING)
+  {
+    glDeleteBuffers(1, &slot.pbo);
+    slot = Capture_Slot();
+  }
+  INIT = false;
 }
 
-void check_and_clear_expired_textures()
+static void encode_png(Encode_Job &job)
 {
-  auto it = TEXTURE_CACHE.begin();
-  while (it != TEXTURE_CACHE.end())
+  // gl rows are bottom up
+  const size_t pitch = 4 * job.size.x;
+  std::vector<uint8> row(pitch);
+  for (int32 y = 0; y < job.size.y / 2; ++y)
   {
-    auto texture_handle = *it;
-    const std::string *path = &texture_handle.first;
-    struct stat attr;
-    stat(path->c_str(), &attr);
-    time_t t = attr.st_mtime;
+    uint8 *top = &job.pixels[y * pitch];
+    uint8 *bottom = &job.pixels[(job.size.y - 1 - y) * pitch];
+    memcpy(&row[0], top, pitch);
+    memcpy(top, bottom, pitch);
+    memcpy(bottom, &row[0], pitch);
+  }
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+  const Uint32 masks[] = {0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff};
+#else
+  const Uint32 masks[] = {0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000};
+#endif
+  SDL_Surface *surface = SDL_CreateRGBSurfaceFrom(&job.pixels[0], job.size.x,
+      job.size.y, 32, pitch, masks[0], masks[1], masks[2], masks[3]);
+  if (!surface)
+  {
+    set_message("surface creation failed for capture: ", job.name);
+    return;
+  }
+  if (IMG_SavePNG(surface, job.name.c_str()) != 0)
+    set_message("IMG_SavePNG failed for capture: ", job.name);
+  SDL_FreeSurface(surface);
+}
 
-    auto ptr = texture_handle.second.lock();
-    if (ptr) // texture could exist but not yet be loaded
+static void encoder_loop()
+{
+  while (true)
+  {
+    Encode_Job job;
     {
-      time_t t1 = ptr.get()->file_mod_t;
-      if (t1 != t)
-      {
-        it = TEXTURE_CACHE.erase(it);
-        continue;
-      }
+      std::unique_lock<std::mutex> lock(ENCODE_MUTEX);
+      ENCODE_READY.wait(
+          lock, [] { return ENCODE_SHUTDOWN || !ENCODE_QUEUE.empty(); });
+      // drain the queue before honoring shutdown
+      if (ENCODE_QUEUE.empty())
+        return;
+      job = std::move(ENCODE_QUEUE.front());
+      ENCODE_QUEUE.pop_front();
     }
-    ++it;
+    ENCODE_SPACE.notify_one();
+    encode_png(job);
+  }
+}
+
+static void queue_encode_job(Encode_Job &&job)
+{
+  if (ENCODE_THREADS.empty())
+  {
+    ENCODE_SHUTDOWN = false;
+    uint32 count = std::thread::hardware_concurrency() / 2;
+    count = glm::clamp(count, 1u, 4u);
+    for (uint32 i = 0; i < count; ++i)
+      ENCODE_THREADS.emplace_back(encoder_loop);
+  }
+  {
+    std::unique_lock<std::mutex> lock(ENCODE_MUTEX);
+    // encoders fell behind, backpressure rather than unbounded memory
+    ENCODE_SPACE.wait(
+        lock, [] { return ENCODE_QUEUE.size() < ENCODE_QUEUE_LIMIT; });
+    ENCODE_QUEUE.push_back(std::move(job));
+  }
+  ENCODE_READY.notify_one();
+}
+
+static void stop_encoder_threads()
+{
+  {
+    std::lock_guard<std::mutex> lock(ENCODE_MUTEX);
+    ENCODE_SHUTDOWN = true;
+  }
+  ENCODE_READY.notify_all();
+  for (std::thread &thread : ENCODE_THREADS)
+    thread.join();
+  ENCODE_THREADS.clear();
+}
+
+// maps the oldest pending capture and hands it to the encoders
+// returns false if wait is false and the gpu isn't done with it yet
+static bool finish_oldest_capture(bool wait)
+{
+  ASSERT(CAPTURE_PENDING);
+  Capture_Slot &slot = CAPTURE_RING[CAPTURE_OLDEST];
+  GLenum result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+  while (wait && result == GL_TIMEOUT_EXPIRED)
+    result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                              1000000000);
+  if (result == GL_TIMEOUT_EXPIRED)
+    return false;
+  glDeleteSync(slot.fence);
+  slot.fence = nullptr;
+  CAPTURE_OLDEST = (CAPTURE_OLDEST + 1) % CAPTURE_RING_SIZE;
+  CAPTURE_PENDING -= 1;
+  if (result == GL_WAIT_FAILED)
+  {
+    set_message("glClientWaitSync failed for capture: ", slot.name);
+    return true;
+  }
+
+  CAPTURE_TIMER.start();
+  Encode_Job job;
+  job.size = slot.size;
+  job.name = std::move(slot.name);
+  const GLsizeiptr bytes = 4 * slot.size.x * slot.size.y;
+  job.pixels.resize(bytes);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  void *data =
+      glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, bytes, GL_MAP_READ_BIT);
+  if (data)
+  {
+    memcpy(&job.pixels[0], data, bytes);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  CAPTURE_TIMER.stop();
+  if (!data)
+  {
+    set_message("glMapBufferRange failed for capture: ", job.name);
+    return true;
+  }
+  queue_encode_job(std::move(job));
+  return true;
+}
+
+// hands every finished capture to the encoders, wait drains all of them
+static void process_captures(bool wait)
+{
+  while (CAPTURE_PENDING)
+  {
+    if (!finish_oldest_capture(wait))
+      return;
+  }
+}
+
+// binds a pixel pack buffer big enough for size, the caller issues the
+// read with a null offset and calls end_capture()
+static Capture_Slot *begin_capture(ivec2 size, std::string name)
+{
+  if (CAPTURE_PENDING == CAPTURE_RING_SIZE)
+    finish_oldest_capture(true);
+  CAPTURE_TIMER.start();
+  const uint32 index = (CAPTURE_OLDEST + CAPTURE_PENDING) % CAPTURE_RING_SIZE;
+  Capture_Slot &slot = CAPTURE_RING[index];
+  CAPTURE_PENDING += 1;
+  slot.size = size;
+  slot.name = std::move(name);
+  if (!slot.pbo)
+    glGenBuffers(1, &slot.pbo);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+  const GLsizeiptr bytes = 4 * size.x * size.y;
+  if (slot.pbo_size < bytes)
+  {
+    glBufferData(GL_PIXEL_PACK_BUFFER, bytes, nullptr, GL_STREAM_READ);
+    slot.pbo_size = bytes;
   }
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  return &slot;
+}
+
+static void end_capture(Capture_Slot *slot)
+{
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, GL_UNUSED_BIT);
+  CAPTURE_TIMER.stop();
 }
 
 void save_and_log_screen()
@@ -160,22 +545,12 @@ void save_and_log_screen()
   GLint width = viewport[2];
   GLint height = viewport[3];
 
-  SDL_Surface *surface = SDL_CreateRGBSurface(
-      0, width, height, 32, 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
-  if (surface)
-  {
-    std::string name = s("screen_", i, ".png");
-    set_message("Saving Screenshot: ", " With name: " + name);
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE,
-                 surface->pixels);
-    IMG_SavePNG(surface, name.c_str());
-    SDL_FreeSurface(surface);
-  }
-  else
-  {
-    set_message("surface creation failed in save_and_log_screen()");
-  }
+  std::string name = s("screen_", i, ".png");
+  set_message("Saving Screenshot: ", " With name: " + name);
+  Capture_Slot *slot = begin_capture(ivec2(width, height), name);
+  glReadPixels(viewport[0], viewport[1], width, height, GL_RGBA,
+               GL_UNSIGNED_BYTE, (void *)0);
+  end_capture(slot);
 }
 
 void save_and_log_texture(GLuint texture)
@@ -190,21 +565,11 @@ void save_and_log_texture(GLuint texture)
   glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
   glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
 
-  SDL_Surface *surface = SDL_CreateRGBSurface(
-      0, width, height, 32, 0xff000000, 0x00ff0000, 0x0000ff00, 0x000000ff);
-  if (surface)
-  {
-    std::string name = s("Texture object ", texture, " #", i, ".png");
-    set_message("Saving Texture: ", s(texture, " With name: ", name));
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, surface->pixels);
-    IMG_SavePNG(surface, name.c_str());
-    SDL_FreeSurface(surface);
-  }
-  else
-  {
-    set_message("surface creation failed in save_and_log_texture()");
-  }
+  std::string name = s("Texture object ", texture, " #", i, ".png");
+  set_message("Saving Texture: ", s(texture, " With name: ", name));
+  Capture_Slot *slot = begin_capture(ivec2(width, height), name);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, (void *)0);
+  end_capture(slot);
 }
 
 void dump_gl_float32_buffer(GLenum target, GLuint buffer, uint32 parse_stride)
@@ -252,18 +617,137 @@ enum Texture_Location
   specular,
   normal,
   emissive,
-  roughness
+  roughness,
+  texture_location_count
 };
 
+static uint32 full_mip_count(ivec2 size)
+{
+  uint32 levels = 1;
+  while (size.x > 1 || size.y > 1)
+  {
+    size = max(size / 2, ivec2(1));
+    levels += 1;
+  }
+  return levels;
+}
+
+// a free layer for an image of this format and size, in a new array when
+// the others are full
+// image gives the levels of compressed formats, rgba gets a full chain
+// nothing may be bound to GL_PIXEL_UNPACK_BUFFER
+static Texture_Layer allocate_texture_layer(GLenum format, ivec2 size,
+                                            const Compressed_Image *image)
+{
+  const uint32 levels = image ? image->level_count() : full_mip_count(size);
+  Texture_Layer result;
+  for (Texture_Array &array : TEXTURE_ARRAYS)
+  {
+    if (array.format != format || array.size != size ||
+        array.levels != levels || array.free_layers.empty())
+      continue;
+    result.array = array.texture;
+    result.layer = array.free_layers.back();
+    array.free_layers.pop_back();
+    return result;
+  }
+
+  // a full rgba8 chain is 4/3 of the first level
+  const size_t layer_bytes =
+      image ? image->data.size() : size_t(4) * size.x * size.y * 4 / 3;
+  size_t existing_layers = 0;
+  for (const Texture_Array &array : TEXTURE_ARRAYS)
+    if (array.format == format && array.size == size &&
+        array.levels == levels)
+      existing_layers += array.layer_count;
+  const size_t max_layers =
+      glm::clamp(TEXTURE_ARRAY_BYTES / layer_bytes, size_t(1),
+                 size_t(MAX_TEXTURE_ARRAY_LAYERS));
+  const size_t layers =
+      glm::max(existing_layers, TEXTURE_ARRAY_FIRST_BYTES / layer_bytes);
+  Texture_Array array;
+  array.format = format;
+  array.size = size;
+  array.levels = levels;
+  array.layer_count = (uint32)glm::clamp(layers, size_t(1), max_layers);
+  glGenTextures(1, &array.texture);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, array.texture);
+  for (uint32 level = 0; level < levels; ++level)
+  {
+    const ivec2 level_size =
+        max(ivec2(size.x >> level, size.y >> level), ivec2(1));
+    if (image)
+      glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, level_size.x,
+                             level_size.y, array.layer_count, 0,
+                             (image->level_offsets[level + 1] -
+                              image->level_offsets[level]) *
+                                 array.layer_count,
+                             nullptr);
+    else
+      glTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, level_size.x,
+                   level_size.y, array.layer_count, 0, GL_RGBA,
+                   GL_UNSIGNED_BYTE, nullptr);
+  }
+  glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, levels - 1);
+  if (levels > 1)
+  {
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+                    GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameterf(GL_TEXTURE_2D_ARRAY, gl::GL_TEXTURE_MAX_ANISOTROPY_EXT, 8);
+  }
+  else
+  {
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  set_message("New texture array: ",
+              s(array.texture, " ", size.x, "x", size.y, ", ",
+                array.layer_count, " layers"),
+              1.0);
+
+  // layer 0 is handed out first
+  for (uint32 i = array.layer_count; i-- > 1;)
+    array.free_layers.push_back(i);
+  result.array = array.texture;
+  result.layer = 0;
+  TEXTURE_ARRAYS.push_back(std::move(array));
+  return result;
+}
+
+// arrays are deleted with their last layer
+static void free_texture_layer(Texture_Layer layer)
+{
+  // CLEANUP_RENDERER already deleted them
+  if (!layer.array || !INIT)
+    return;
+  for (auto it = TEXTURE_ARRAYS.begin(); it != TEXTURE_ARRAYS.end(); ++it)
+  {
+    if (it->texture != layer.array)
+      continue;
+    it->free_layers.push_back(layer.layer);
+    if (it->free_layers.size() == it->layer_count)
+    {
+      set_message("Deleting texture array: ", s(it->texture));
+      glDeleteTextures(1, &it->texture);
+      TEXTURE_ARRAYS.erase(it);
+    }
+    return;
+  }
+}
+
 Texture::Texture() { file_path = ERROR_TEXTURE_PATH; }
 Texture_Handle::~Texture_Handle()
 {
-  set_message("Deleting texture: ", s(texture));
-  glDeleteTextures(1, &texture);
-  texture = 0;
+  free_texture_layer(texture);
+  texture = Texture_Layer();
 }
-Texture::Texture(std::string path)
+Texture::Texture(std::string path, Uint32 placeholder, bool normal_map,
+                 bool srgb)
+    : placeholder(placeholder), normal_map(normal_map)
 {
+  storage_type = srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8;
   path = fix_filename(path);
   if (path.size() == 0)
   {
@@ -292,6 +776,306 @@ Texture::Texture(std::string path)
   }
 }
 
+// writes a 1x1 layer
+static void upload_color(Texture_Layer layer, Uint32 color)
+{
+  glBindTexture(GL_TEXTURE_2D_ARRAY, layer.array);
+  glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer.layer, 1, 1, 1, GL_RGBA,
+                  GL_UNSIGNED_INT_8_8_8_8, &color);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+}
+
+// stored like the texture it stands in for, so it decodes the same
+static Texture_Layer get_placeholder_texture(Uint32 color, GLenum storage)
+{
+  const bool srgb = storage == GL_SRGB8_ALPHA8;
+  const uint64 key = uint64(color) | (uint64(srgb) << 32);
+  auto it = PLACEHOLDER_TEXTURES.find(key);
+  if (it != PLACEHOLDER_TEXTURES.end())
+    return it->second;
+  Texture_Layer layer = allocate_texture_layer(
+      srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, ivec2(1), nullptr);
+  upload_color(layer, color);
+  PLACEHOLDER_TEXTURES[key] = layer;
+  return layer;
+}
+
+// everything that changes what a file decodes to
+static uint32 texture_load_flags(GLenum storage_type, bool normal_map,
+                                 bool premultiply, bool override_alpha,
+                                 uint8 alpha_override)
+{
+  return uint32(storage_type == GL_SRGB8_ALPHA8) | (uint32(normal_map) << 1) |
+         (uint32(premultiply) << 2) | (uint32(override_alpha) << 3) |
+         (uint32(alpha_override) << 8);
+}
+
+// identifies the source file and how it was processed, 0 if it's missing
+static uint64 texture_cache_stamp(const std::string &path, bool premultiply,
+                                  bool override_alpha, uint8 alpha_override,
+                                  bool normal_map, bool srgb)
+{
+  struct stat attr;
+  if (stat(path.c_str(), &attr) != 0)
+    return 0;
+  // bump the version when the processing changes
+  const uint64 version = 2;
+  const uint64 values[] = {version, uint64(attr.st_mtime),
+                           uint64(attr.st_size), premultiply, override_alpha,
+                           alpha_override, normal_map, srgb};
+  return hash_bytes(values, sizeof(values));
+}
+
+static bool has_translucent_pixels(const uint8 *rgba, ivec2 size)
+{
+  for (int32 i = 0; i < size.x * size.y; ++i)
+    if (rgba[4 * i + 3] != 255)
+      return true;
+  return false;
+}
+
+// decodes path on the job system and queues it for upload into handle
+// color() textures are tiny and made right away
+static void start_texture_load(std::shared_ptr<Texture_Handle> handle,
+                               const std::string &path)
+{
+  if (path.substr(0, 6) == "color(")
+  {
+    const Texture_Layer previous = handle->texture;
+    handle->texture =
+        allocate_texture_layer(handle->storage_type, ivec2(1), nullptr);
+    free_texture_layer(previous);
+    upload_color(handle->texture, string_to_color(path));
+    return;
+  }
+
+#if COMPRESSED_TEXTURE_CACHE
+  static const bool s3tc = has_gl_extension("GL_EXT_texture_compression_s3tc");
+  static const bool srgb_s3tc = has_gl_extension("GL_EXT_texture_sRGB");
+  const bool use_cache =
+      s3tc && (srgb_s3tc || handle->storage_type != GL_SRGB8_ALPHA8);
+#else
+  const bool use_cache = false;
+#endif
+  TEXTURE_DECODES_IN_FLIGHT += 1;
+  std::weak_ptr<Texture_Handle> weak = handle;
+  const bool process_premultiply = handle->process_premultiply;
+  const bool process_override_alpha = handle->process_override_alpha;
+  const uint8 alpha_override = handle->alpha_override;
+  const bool normal_map = handle->normal_map;
+  const bool srgb = handle->storage_type == GL_SRGB8_ALPHA8;
+  const uint32 flags =
+      texture_load_flags(handle->storage_type, normal_map, process_premultiply,
+                         process_override_alpha, alpha_override);
+  get_job_system().submit([=] {
+    Decoded_Texture decoded;
+    decoded.handle = weak;
+    decoded.path = path;
+    uint64 stamp = 0;
+    std::string cache_path;
+    if (use_cache)
+    {
+      stamp = texture_cache_stamp(path, process_premultiply,
+                                  process_override_alpha, alpha_override,
+                                  normal_map, srgb);
+      // one file per variant, so they don't keep replacing each other
+      const uint64 name = hash_bytes(
+          &flags, sizeof(flags), hash_bytes(path.c_str(), path.size()));
+      cache_path = BASE_CACHE_PATH + "Textures/" + s(name) + ".dds";
+      decoded.compressed =
+          stamp && load_dds(cache_path, stamp, &decoded.image);
+    }
+    ivec2 size;
+    int32 n;
+    uint8 *pixels = decoded.compressed
+                        ? nullptr
+                        : stbi_load(path.c_str(), &size.x, &size.y, &n, 4);
+    if (pixels)
+    {
+      const size_t pixel_count = size_t(size.x) * size.y;
+      if (process_override_alpha)
+        override_alpha(pixels, pixel_count, alpha_override);
+      if (process_premultiply)
+        premultiply_alpha(pixels, pixel_count);
+      build_mip_chain(pixels, size, srgb, &decoded.mips);
+      stbi_image_free(pixels);
+    }
+    if (!decoded.mips.data.empty() && use_cache)
+    { // first load of this file, convert it for next time
+      Block_Format format = bc1;
+      if (normal_map)
+        format = bc5;
+      else if (has_translucent_pixels(decoded.mips.data.data(), size))
+        format = bc3;
+      compress_image(decoded.mips, format, &decoded.image);
+      create_directories(BASE_CACHE_PATH + "Textures/");
+      if (!save_dds(cache_path, decoded.image, stamp))
+        set_message("Warning: can't write texture cache:", cache_path);
+      decoded.mips = Mip_Chain();
+      decoded.compressed = true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(DECODED_TEXTURES_MUTEX);
+      DECODED_TEXTURES.push_back(std::move(decoded));
+    }
+    TEXTURE_DECODES_IN_FLIGHT -= 1;
+  });
+}
+
+// copies data into TEXTURE_UPLOAD_PBO and leaves it bound
+static bool fill_upload_buffer(const void *data, size_t bytes)
+{
+  if (!TEXTURE_UPLOAD_PBO)
+    glGenBuffers(1, &TEXTURE_UPLOAD_PBO);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, TEXTURE_UPLOAD_PBO);
+  // orphans the previous upload instead of waiting on it
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+  void *pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes,
+                                  GL_MAP_WRITE_BIT |
+                                      GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (!pixels)
+  {
+    set_message("Warning: can't map the texture upload buffer");
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return false;
+  }
+  memcpy(pixels, data, bytes);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  return true;
+}
+
+// returns the bytes uploaded
+static size_t upload_decoded_texture(Texture_Handle *handle,
+                                     const Decoded_Texture &decoded)
+{
+  size_t bytes = decoded.mips.data.size();
+  if (decoded.compressed)
+  {
+    const Compressed_Image &image = decoded.image;
+    bytes = image.data.size();
+    // a full rgba8 mip chain is 4/3 of the first level
+    set_message("Texture from cache: ",
+                s(decoded.path, " ", bytes / 1024, "KB, ",
+                  image.size.x * image.size.y * 16 / 3 / 1024,
+                  "KB as rgba8"),
+                1.0);
+    const bool srgb = handle->storage_type == GL_SRGB8_ALPHA8;
+    GLenum format = srgb ? gl::GL_COMPRESSED_SRGB_S3TC_DXT1_EXT
+                         : gl::GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    if (image.format == bc3)
+      format = srgb ? gl::GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT
+                    : gl::GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    else if (image.format == bc5)
+      format = gl::GL_COMPRESSED_RG_RGTC2;
+    // a reload keeps its old layer until the new one is filled
+    const Texture_Layer previous = handle->texture;
+    const Texture_Layer layer = allocate_texture_layer(format, image.size,
+                                                       &image);
+    if (!fill_upload_buffer(image.data.data(), bytes))
+    {
+      free_texture_layer(layer);
+      return 0;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, layer.array);
+    for (uint32 level = 0; level < image.level_count(); ++level)
+    {
+      const ivec2 size = image.level_size(level);
+      const size_t offset = image.level_offsets[level];
+      glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer.layer,
+                                size.x, size.y, 1, format,
+                                image.level_offsets[level + 1] - offset,
+                                (void *)offset);
+    }
+    handle->texture = layer;
+    free_texture_layer(previous);
+  }
+  else
+  {
+    set_message("Texture load cache miss. Texture from disk: ", decoded.path,
+                1.0);
+    const Mip_Chain &mips = decoded.mips;
+    const Texture_Layer previous = handle->texture;
+    const Texture_Layer layer =
+        allocate_texture_layer(handle->storage_type, mips.size, nullptr);
+    if (!fill_upload_buffer(mips.data.data(), bytes))
+    {
+      free_texture_layer(layer);
+      return 0;
+    }
+    glBindTexture(GL_TEXTURE_2D_ARRAY, layer.array);
+    for (uint32 level = 0; level < mips.level_count(); ++level)
+    {
+      const ivec2 size = mips.level_size(level);
+      glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer.layer, size.x,
+                      size.y, 1, GL_RGBA, GL_UNSIGNED_BYTE,
+                      (void *)mips.level_offsets[level]);
+    }
+    handle->texture = layer;
+    free_texture_layer(previous);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  return bytes;
+}
+
+// uploads decoded textures until TEXTURE_UPLOAD_BUDGET bytes are used, at
+// least one per call, or all of them when finish is set
+static void stream_textures(bool finish)
+{
+  TEXTURE_UPLOAD_TIMER.start();
+  size_t uploaded = 0;
+  while (true)
+  {
+    Decoded_Texture decoded;
+    {
+      std::lock_guard<std::mutex> lock(DECODED_TEXTURES_MUTEX);
+      if (DECODED_TEXTURES.empty() ||
+          (!finish && uploaded >= TEXTURE_UPLOAD_BUDGET))
+        break;
+      decoded = std::move(DECODED_TEXTURES.front());
+      DECODED_TEXTURES.pop_front();
+    }
+    std::shared_ptr<Texture_Handle> handle = decoded.handle.lock();
+    if (handle && (!decoded.mips.data.empty() || decoded.compressed))
+      uploaded += upload_decoded_texture(handle.get(), decoded);
+    else if (handle && !handle->texture.array)
+    { // error loading file...
+#if DYNAMIC_TEXTURE_RELOADING
+      // 0,0,0,0 until the file watcher sees it written
+      set_message("Warning: missing texture:" + decoded.path);
+      handle->placeholder = Texture_Layer();
+#else
+      set_message("STBI failed to find or load texture: " + decoded.path);
+      handle->placeholder = Texture_Layer();
+#if SHOW_ERROR_TEXTURE
+      if (decoded.path != ERROR_TEXTURE_PATH)
+        start_texture_load(handle, ERROR_TEXTURE_PATH);
+#endif
+#endif
+    }
+    else if (handle)
+      set_message("Warning: can't reload texture:", decoded.path);
+  }
+  TEXTURE_UPLOAD_TIMER.stop();
+}
+
+void finish_texture_streaming()
+{
+  while (true)
+  {
+    stream_textures(true);
+    if (TEXTURE_DECODES_IN_FLIGHT == 0)
+    {
+      // the last decode can land between the two checks
+      std::lock_guard<std::mutex> lock(DECODED_TEXTURES_MUTEX);
+      if (DECODED_TEXTURES.empty())
+        return;
+      continue;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
 void Texture::load()
 {
 #if !SHOW_ERROR_TEXTURE
@@ -303,104 +1087,74 @@ void Texture::load()
     return;
   }
 #endif
-  auto ptr = TEXTURE_CACHE[file_path].lock();
+  const Texture_Key key = {
+      file_path, texture_load_flags(storage_type, normal_map,
+                                    process_premultiply,
+                                    process_override_alpha, alpha_override)};
+  auto ptr = TEXTURE_CACHE[key].lock();
   if (ptr)
   {
     texture = ptr;
     return;
   }
   texture = std::make_shared<Texture_Handle>();
-  TEXTURE_CACHE[file_path] = texture;
-  int32 width, height, n;
-  if (file_path.substr(0, 6) == "color(")
-  {
-    width = height = 1;
-    Uint32 color = string_to_color(file_path);
-    glGenTextures(1, &texture->texture);
-    glBindTexture(GL_TEXTURE_2D, texture->texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, storage_type, width, height, 0, GL_RGBA,
-                 GL_UNSIGNED_INT_8_8_8_8, &color);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    return;
-  }
-  auto *data = stbi_load(file_path.c_str(), &width, &height, &n, 4);
-
-  if (!data)
-  { // error loading file...
+  texture->file_path = file_path;
+  texture->storage_type = storage_type;
+  texture->alpha_override = alpha_override;
+  texture->process_premultiply = process_premultiply;
+  texture->process_override_alpha = process_override_alpha;
+  texture->normal_map = normal_map;
+  texture->placeholder = get_placeholder_texture(placeholder, storage_type);
+  TEXTURE_CACHE[key] = texture;
 #if DYNAMIC_TEXTURE_RELOADING
-    // retry next frame
-    set_message("Warning: missing texture:" + file_path);
-    texture = nullptr;
-    return;
-#else
-    if (!data)
-    { // no dynamic texture reloading, so log fail and load the error texture
-      set_message("STBI failed to find or load texture: " + file_path);
-      if (file_path == ERROR_TEXTURE_PATH)
-      {
-        texture = nullptr;
-        return;
-      }
-      file_path = ERROR_TEXTURE_PATH;
-      load();
-      return;
-    }
+  if (file_path.substr(0, 6) != "color(")
+    get_file_watcher().watch(file_path);
 #endif
-  }
+  start_texture_load(texture, file_path);
+}
 
-  set_message("Texture load cache miss. Texture from disk: ", file_path, 1.0);
-  struct stat attr;
-  stat(file_path.c_str(), &attr);
-  texture.get()->file_mod_t = attr.st_mtime;
+Texture_Layer Texture::get_layer() const
+{
+  if (!texture)
+    return Texture_Layer();
+  return texture->texture.array ? texture->texture : texture->placeholder;
+}
 
-  if (process_premultiply)
+// reloads what the file watcher saw written since the last frame
+static void reload_changed_files()
+{
+  static std::vector<std::string> changed;
+  changed.clear();
+  get_file_watcher().take_changes(&changed);
+  for (const std::string &path : changed)
   {
-    for (uint32 i = 0; i < width * height; ++i)
+    // every variant of the file reloads
+    const Symbol symbol = path;
+    bool texture = false;
+    for (auto it = TEXTURE_CACHE.begin(); it != TEXTURE_CACHE.end();)
     {
-      uint32 pixel = data[i];
-      uint8 r = (uint8)(0x000000FF & pixel);
-      uint8 g = (uint8)(0x0000FF00 & pixel) >> 8;
-      uint8 b = (uint8)(0x00FF0000 & pixel) >> 16;
-      uint8 a = (uint8)(0xFF000000 & pixel) >> 24;
-
-      if (process_override_alpha)
-        a = alpha_override;
-
-      r = r * ((float)a / 255);
-      g = g * ((float)a / 255);
-      b = b * ((float)a / 255);
-
-      data[i] = (24 << a) | (16 << b) | (8 << g) | r;
+      if (it->first.path != symbol)
+      {
+        ++it;
+        continue;
+      }
+      texture = true;
+      std::shared_ptr<Texture_Handle> handle = it->second.lock();
+      if (!handle)
+      {
+        it = TEXTURE_CACHE.erase(it);
+        continue;
+      }
+      set_message("Reloading texture: ", path);
+      start_texture_load(handle, path);
+      ++it;
     }
-  }
-  glGenTextures(1, &texture->texture);
-  glBindTexture(GL_TEXTURE_2D, texture->texture);
-  glTexImage2D(GL_TEXTURE_2D, 0, storage_type, width, height, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, data);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-                  GL_LINEAR_MIPMAP_LINEAR);
-  glTexParameterf(GL_TEXTURE_2D, gl::GL_TEXTURE_MAX_ANISOTROPY_EXT, 8);
-  glGenerateMipmap(GL_TEXTURE_2D);
-  stbi_image_free(data);
-  glBindTexture(GL_TEXTURE_2D, 0);
-}
-
-void Texture::bind(const char *name, GLuint binding, Shader &shader)
-{
-#if DYNAMIC_TEXTURE_RELOADING
-  load();
+    if (texture)
+      continue;
+#if DYNAMIC_SHADER_RELOADING
+    reload_shaders(path);
 #endif
-  GLuint u = glGetUniformLocation(shader.program->program, name);
-  if (u == -1)
-    return;
-
-  glUniform1i(u, binding);
-  glActiveTexture(GL_TEXTURE0 + (GLuint)binding);
-  glBindTexture(GL_TEXTURE_2D, texture ? texture->texture : 0);
+  }
 }
 
 Mesh::Mesh() {}
@@ -414,15 +1168,16 @@ Mesh::Mesh(Mesh_Primitive p, std::string mesh_name) : name(mesh_name)
     mesh = ptr;
     return;
   }
-  set_message("caching mesh with uid: ", unique_identifier);
+  set_message("caching mesh with uid: ", unique_identifier.str());
   MESH_CACHE[unique_identifier] = mesh = upload_data(load_mesh(p));
 }
-Mesh::Mesh(Mesh_Data data, std::string mesh_name) : name(mesh_name)
+Mesh::Mesh(const Mesh_Data &data, std::string mesh_name, bool keep_geometry)
+    : name(mesh_name)
 {
   unique_identifier = data.unique_identifier;
   if (unique_identifier == "NULL")
   { // lets not cache custom meshes thx
-    mesh = upload_data(data);
+    mesh = upload_data(data, keep_geometry);
     return;
   }
   auto ptr = MESH_CACHE[unique_identifier].lock();
@@ -430,16 +1185,19 @@ Mesh::Mesh(Mesh_Data data, std::string mesh_name) : name(mesh_name)
   {
     // assert that the data is actually exactly the same
     mesh = ptr;
+    if (keep_geometry && !mesh->geometry)
+      mesh->geometry = std::make_unique<Mesh_Geometry>(
+          Mesh_Geometry{data.positions, data.indices});
     return;
   }
-  set_message("caching mesh with uid: ", unique_identifier);
-  MESH_CACHE[unique_identifier] = mesh = upload_data(data);
+  set_message("caching mesh with uid: ", unique_identifier.str());
+  MESH_CACHE[unique_identifier] = mesh = upload_data(data, keep_geometry);
 }
 Mesh::Mesh(const aiMesh *aimesh, std::string unique_identifier)
 {
   ASSERT(aimesh);
   this->unique_identifier = unique_identifier;
-  auto ptr = MESH_CACHE[unique_identifier].lock();
+  auto ptr = MESH_CACHE[this->unique_identifier].lock();
   if (ptr)
   {
     // assert that the data is actually exactly the same
@@ -447,10 +1205,25 @@ Mesh::Mesh(const aiMesh *aimesh, std::string unique_identifier)
     return;
   }
   set_message("caching mesh with uid: ", unique_identifier);
-  MESH_CACHE[unique_identifier] = mesh =
+  MESH_CACHE[this->unique_identifier] = mesh =
       upload_data(load_mesh(aimesh, unique_identifier));
 }
 
+Mesh::Mesh(const Baked_Model &model, uint32 index,
+           std::string unique_identifier)
+{
+  this->unique_identifier = unique_identifier;
+  name = model.string(model.meshes[index].name);
+  auto ptr = MESH_CACHE[this->unique_identifier].lock();
+  if (ptr)
+  {
+    mesh = ptr;
+    return;
+  }
+  set_message("caching mesh with uid: ", unique_identifier);
+  MESH_CACHE[this->unique_identifier] = mesh = upload_baked(model, index);
+}
+
 void Mesh::bind_to_shader(Shader &shader)
 {
   GLint current_vao;
@@ -497,19 +1270,60 @@ void Mesh::bind_to_shader(Shader &shader)
   glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, sizeof(float32) * 3, 0);
 }
 
-std::shared_ptr<Mesh_Handle> Mesh::upload_data(const Mesh_Data &mesh_data)
+// everything a mesh uploads, pointing into a Mesh_Data or straight into a
+// mapped baked model
+struct Mesh_Streams
 {
-  std::shared_ptr<Mesh_Handle> mesh = std::make_shared<Mesh_Handle>();
-  mesh->data = mesh_data;
+  uint32 vertex_count = 0;
+  const vec3 *positions = nullptr;
+  const vec3 *normals = nullptr;
+  const vec2 *texture_coordinates = nullptr;
+  const vec3 *tangents = nullptr;
+  const vec3 *bitangents = nullptr;
+  // 2 or 4, what lods points at and what's uploaded, narrowed on the way
+  uint32 source_index_size = sizeof(uint32);
+  uint32 index_size = sizeof(uint32);
+  // the full mesh then every lod, each pointer and index count
+  std::vector<std::pair<const void *, uint32>> lods;
+};
 
-  if (sizeof(decltype(mesh_data.indices)::value_type) != sizeof(uint32))
+static void upload_vertex_stream(GLuint buffer, const void *data, size_t size)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, buffer);
+  glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+}
+
+// writes count uint32 indices as uint16 straight into the bound index buffer
+static void upload_narrowed_indices(GLintptr offset, const uint32 *indices,
+                                    uint32 count)
+{
+  if (count == 0)
+    return;
+  uint16 *mapped = (uint16 *)glMapBufferRange(
+      GL_ELEMENT_ARRAY_BUFFER, offset, count * sizeof(uint16),
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+  if (!mapped)
   {
-    set_message(
-        "Mesh::upload_data error: render() assumes index type to be 32 bits");
-    ASSERT(0);
+    set_message("Warning: can't map an index buffer, narrowing a copy");
+    std::vector<uint16> narrow(indices, indices + count);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, count * sizeof(uint16),
+                    narrow.data());
+    return;
   }
+  for (uint32 i = 0; i < count; ++i)
+    mapped[i] = uint16(indices[i]);
+  glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+}
 
-  mesh->indices_buffer_size = mesh_data.indices.size();
+static void upload_streams(const Mesh_Streams &streams, Mesh_Handle *mesh)
+{
+  ASSERT(streams.source_index_size == streams.index_size ||
+         (streams.source_index_size == 4 && streams.index_size == 2));
+  mesh->vertex_count = streams.vertex_count;
+  mesh->indices_buffer_size = streams.lods[0].second;
+  mesh->index_size = streams.index_size;
+  mesh->index_type =
+      streams.index_size == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
   glGenVertexArrays(1, &mesh->vao);
   glBindVertexArray(mesh->vao);
   set_message("uploading mesh data...", s("created vao: ", mesh->vao), 1);
@@ -520,67 +1334,114 @@ std::shared_ptr<Mesh_Handle> Mesh::upload_data(const Mesh_Data &mesh_data)
   glGenBuffers(1, &mesh->tangents_buffer);
   glGenBuffers(1, &mesh->bitangents_buffer);
 
-  uint32 positions_buffer_size = mesh_data.positions.size();
-  uint32 normal_buffer_size = mesh_data.normals.size();
-  uint32 uv_buffer_size = mesh_data.texture_coordinates.size();
-  uint32 tangents_size = mesh_data.tangents.size();
-  uint32 bitangents_size = mesh_data.bitangents.size();
-  uint32 indices_buffer_size = mesh_data.indices.size();
-
-  ASSERT(all_equal(positions_buffer_size, normal_buffer_size, uv_buffer_size,
-                   tangents_size, bitangents_size));
-
-  // positions
-  uint32 buffer_size = mesh_data.positions.size() *
-                       sizeof(decltype(mesh_data.positions)::value_type);
-  glBindBuffer(GL_ARRAY_BUFFER, mesh->position_buffer);
-  glBufferData(GL_ARRAY_BUFFER, buffer_size, &mesh_data.positions[0],
-               GL_STATIC_DRAW);
-
-  // normals
-  buffer_size = mesh_data.normals.size() *
-                sizeof(decltype(mesh_data.normals)::value_type);
-  glBindBuffer(GL_ARRAY_BUFFER, mesh->normal_buffer);
-  glBufferData(GL_ARRAY_BUFFER, buffer_size, &mesh_data.normals[0],
-               GL_STATIC_DRAW);
-
-  // texture_coordinates
-  buffer_size = mesh_data.texture_coordinates.size() *
-                sizeof(decltype(mesh_data.texture_coordinates)::value_type);
-  glBindBuffer(GL_ARRAY_BUFFER, mesh->uv_buffer);
-  glBufferData(GL_ARRAY_BUFFER, buffer_size, &mesh_data.texture_coordinates[0],
-               GL_STATIC_DRAW);
-
-  // indices
-  buffer_size = mesh_data.indices.size() *
-                sizeof(decltype(mesh_data.indices)::value_type);
+  const size_t vec3_size = streams.vertex_count * sizeof(vec3);
+  upload_vertex_stream(mesh->position_buffer, streams.positions, vec3_size);
+  upload_vertex_stream(mesh->normal_buffer, streams.normals, vec3_size);
+  upload_vertex_stream(mesh->uv_buffer, streams.texture_coordinates,
+                       streams.vertex_count * sizeof(vec2));
+  upload_vertex_stream(mesh->tangents_buffer, streams.tangents, vec3_size);
+  upload_vertex_stream(mesh->bitangents_buffer, streams.bitangents,
+                       vec3_size);
+
+  // indices, every LOD level follows the full mesh in the same buffer
+  GLuint total_indices = 0;
+  for (auto &lod : streams.lods)
+  {
+    mesh->lods.push_back({total_indices, lod.second});
+    total_indices += lod.second;
+  }
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->indices_buffer);
-  glBufferData(GL_ELEMENT_ARRAY_BUFFER, buffer_size, &mesh_data.indices[0],
-               GL_STATIC_DRAW);
-
-  // tangents
-  buffer_size = mesh_data.tangents.size() *
-                sizeof(decltype(mesh_data.tangents)::value_type);
-  glBindBuffer(GL_ARRAY_BUFFER, mesh->tangents_buffer);
-  glBufferData(GL_ARRAY_BUFFER, buffer_size, &mesh_data.tangents[0],
-               GL_STATIC_DRAW);
-
-  // bitangents
-  buffer_size = mesh_data.bitangents.size() *
-                sizeof(decltype(mesh_data.bitangents)::value_type);
-  glBindBuffer(GL_ARRAY_BUFFER, mesh->bitangents_buffer);
-  glBufferData(GL_ARRAY_BUFFER, buffer_size, &mesh_data.bitangents[0],
-               GL_STATIC_DRAW);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, total_indices * streams.index_size,
+               nullptr, GL_STATIC_DRAW);
+  for (uint32 i = 0; i < streams.lods.size(); ++i)
+  {
+    const GLintptr offset = mesh->lods[i].first_index * streams.index_size;
+    if (streams.source_index_size != streams.index_size)
+      upload_narrowed_indices(offset, (const uint32 *)streams.lods[i].first,
+                              streams.lods[i].second);
+    else
+      glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset,
+                      streams.lods[i].second * streams.index_size,
+                      streams.lods[i].first);
+  }
 
   glBindBuffer(GL_ARRAY_BUFFER, 0);
   glBindVertexArray(0);
+}
+
+std::shared_ptr<Mesh_Handle> Mesh::upload_data(const Mesh_Data &mesh_data,
+                                               bool keep_geometry)
+{
+  std::shared_ptr<Mesh_Handle> mesh = std::make_shared<Mesh_Handle>();
+  if (keep_geometry)
+    mesh->geometry = std::make_unique<Mesh_Geometry>(
+        Mesh_Geometry{mesh_data.positions, mesh_data.indices});
+  if (!mesh_data.positions.empty())
+  {
+    mesh->bounds_min = mesh->bounds_max = mesh_data.positions[0];
+    for (const vec3 &p : mesh_data.positions)
+    {
+      mesh->bounds_min = min(mesh->bounds_min, p);
+      mesh->bounds_max = max(mesh->bounds_max, p);
+    }
+  }
+
+  ASSERT(all_equal(mesh_data.positions.size(), mesh_data.normals.size(),
+                   mesh_data.texture_coordinates.size(),
+                   mesh_data.tangents.size(), mesh_data.bitangents.size()));
+  Mesh_Streams streams;
+  streams.vertex_count = mesh_data.positions.size();
+  streams.positions = mesh_data.positions.data();
+  streams.normals = mesh_data.normals.data();
+  streams.texture_coordinates = mesh_data.texture_coordinates.data();
+  streams.tangents = mesh_data.tangents.data();
+  streams.bitangents = mesh_data.bitangents.data();
+  streams.index_size = index_size_for(streams.vertex_count);
+  streams.lods.push_back({mesh_data.indices.data(), mesh_data.indices.size()});
+  for (const std::vector<uint32> &lod : mesh_data.lod_indices)
+    streams.lods.push_back({lod.data(), lod.size()});
+  upload_streams(streams, mesh.get());
   return mesh;
 }
 
-Material::Material() {}
-Material::Material(Material_Descriptor m) { load(m); }
-Material::Material(aiMaterial *ai_material, std::string working_directory,
-                   Material_Descriptor *material_override)
+std::shared_ptr<Mesh_Handle> Mesh::upload_baked(const Baked_Model &model,
+                                                uint32 index)
+{
+  const Baked_Mesh &baked = model.meshes[index];
+  std::shared_ptr<Mesh_Handle> mesh = std::make_shared<Mesh_Handle>();
+  const float32 *lo = baked.bounds_min;
+  const float32 *hi = baked.bounds_max;
+  mesh->bounds_min = vec3(lo[0], lo[1], lo[2]);
+  mesh->bounds_max = vec3(hi[0], hi[1], hi[2]);
+
+  Mesh_Streams streams;
+  streams.vertex_count = baked.vertex_count;
+  streams.positions = model.blob<vec3>(baked.positions);
+  streams.normals = model.blob<vec3>(baked.normals);
+  streams.texture_coordinates = model.blob<vec2>(baked.texture_coordinates);
+  streams.tangents = model.blob<vec3>(baked.tangents);
+  streams.bitangents = model.blob<vec3>(baked.bitangents);
+  streams.source_index_size = baked.index_size;
+  streams.index_size = baked.index_size;
+  const uint8 *indices = model.blob<uint8>(baked.indices);
+  for (uint32 lod = 0; lod < baked.lod_count; ++lod)
+  {
+    streams.lods.push_back({indices, baked.lod_index_counts[lod]});
+    indices += baked.lod_index_counts[lod] * baked.index_size;
+  }
+  upload_streams(streams, mesh.get());
+  return mesh;
+}
+
+const Mesh_Geometry &Mesh::get_geometry()
+{
+  ASSERT(mesh);
+  ASSERT(mesh->geometry.get());
+  return *mesh->geometry;
+}
+
+Material_Descriptor import_material(aiMaterial *ai_material,
+                                    std::string working_directory)
 {
   ASSERT(ai_material);
   const int albedo_n = ai_material->GetTextureCount(aiTextureType_DIFFUSE);
@@ -628,6 +1489,19 @@ Material::Material(aiMaterial *ai_material, std::string working_directory,
   if (roughness_n)
     m.roughness = working_directory + m.roughness;
 
+  return m;
+}
+Material::Material() {}
+Material::Material(Material_Descriptor m) { load(m); }
+Material::Material(aiMaterial *ai_material, std::string working_directory,
+                   Material_Descriptor *material_override)
+    : Material(import_material(ai_material, working_directory),
+               material_override)
+{
+}
+Material::Material(Material_Descriptor m,
+                   Material_Descriptor *material_override)
+{
   if (material_override)
   {
     if (material_override->albedo != "")
@@ -650,44 +1524,232 @@ Material::Material(aiMaterial *ai_material, std::string working_directory,
     m.frag_shader = material_override->frag_shader;
     m.backface_culling = material_override->backface_culling;
     m.uv_scale = material_override->uv_scale;
+    m.albedo_srgb = material_override->albedo_srgb;
+    m.emissive_srgb = material_override->emissive_srgb;
+    m.roughness_srgb = material_override->roughness_srgb;
+    m.albedo_constant = material_override->albedo_constant;
+    m.emissive_constant = material_override->emissive_constant;
+    m.roughness_constant = material_override->roughness_constant;
+  }
+  load(m);
+}
+// "color(r,g,b,a)" to a linear constant, false for other paths
+static bool color_constant(const std::string &path, bool srgb, vec4 *result)
+{
+  if (path.substr(0, 6) != "color(")
+    return false;
+  const Uint32 color = string_to_color(path);
+  for (uint32 i = 0; i < 4; ++i)
+  {
+    const float32 c = ((color >> (24 - 8 * i)) & 0xff) / 255.0f;
+    // alpha is always linear
+    if (!srgb || i == 3)
+      (*result)[i] = c;
+    else if (c <= 0.04045f)
+      (*result)[i] = c / 12.92f;
+    else
+      (*result)[i] = pow((c + 0.055f) / 1.055f, 2.4f);
   }
-  load(m);
+  return true;
+}
+
+bool Material_Descriptor::operator==(const Material_Descriptor &rhs) const
+{
+  return albedo == rhs.albedo && roughness == rhs.roughness &&
+         specular == rhs.specular && metalness == rhs.metalness &&
+         tangent == rhs.tangent && normal == rhs.normal &&
+         ambient_occlusion == rhs.ambient_occlusion &&
+         emissive == rhs.emissive && vertex_shader == rhs.vertex_shader &&
+         frag_shader == rhs.frag_shader && uv_scale == rhs.uv_scale &&
+         albedo_alpha_override == rhs.albedo_alpha_override &&
+         albedo_srgb == rhs.albedo_srgb &&
+         emissive_srgb == rhs.emissive_srgb &&
+         roughness_srgb == rhs.roughness_srgb &&
+         albedo_constant == rhs.albedo_constant &&
+         emissive_constant == rhs.emissive_constant &&
+         roughness_constant == rhs.roughness_constant &&
+         backface_culling == rhs.backface_culling &&
+         uses_transparency == rhs.uses_transparency;
+}
+uint64 Material_Descriptor::hash() const
+{
+  uint64 result = hash_bytes(nullptr, 0);
+  // the terminators keep "ab","c" and "a","bc" apart
+  for (const std::string *str :
+       {&albedo, &roughness, &specular, &metalness, &tangent, &normal,
+        &ambient_occlusion, &emissive, &vertex_shader, &frag_shader})
+    result = hash_bytes(str->c_str(), str->size() + 1, result);
+  float32 floats[] = {uv_scale.x,          uv_scale.y,
+                      albedo_constant.r,   albedo_constant.g,
+                      albedo_constant.b,   albedo_constant.a,
+                      emissive_constant.r, emissive_constant.g,
+                      emissive_constant.b, roughness_constant};
+  // -0 == 0, so they have to hash the same
+  for (float32 &f : floats)
+    if (f == 0.0f)
+      f = 0.0f;
+  result = hash_bytes(floats, sizeof(floats), result);
+  const uint8 bytes[] = {albedo_alpha_override, albedo_srgb,
+                         emissive_srgb,         roughness_srgb,
+                         backface_culling,      uses_transparency};
+  return hash_bytes(bytes, sizeof(bytes), result);
 }
+
 void Material::load(Material_Descriptor m)
 {
-  this->m = m;
-  albedo = Texture(m.albedo);
-  // specular_color = Texture(m.specular);
-  normal = Texture(m.normal);
-  emissive = Texture(m.emissive);
-  roughness = Texture(m.roughness);
-  shader = Shader(m.vertex_shader, m.frag_shader);
+  vec4 constant;
+  if (color_constant(m.albedo, m.albedo_srgb, &constant))
+  {
+    m.albedo_constant = constant;
+    m.albedo = "";
+  }
+  if (color_constant(m.emissive, m.emissive_srgb, &constant))
+  {
+    m.emissive_constant = vec3(constant);
+    m.emissive = "";
+  }
+  if (color_constant(m.roughness, m.roughness_srgb, &constant))
+  {
+    m.roughness_constant = constant.r;
+    m.roughness = "";
+  }
+
+  const uint64 key = m.hash();
+  material = MATERIAL_CACHE[key].lock();
+  if (material && material->m == m)
+    return;
+  // a collision keeps the first one cached, this one is just not shared
+  const bool collision = material != nullptr;
+  material = std::make_shared<Material_Handle>();
+  if (!collision)
+    MATERIAL_CACHE[key] = material;
+  static uint32 next_ID = 1;
+  material->ID = next_ID++;
+  material->m = m;
+
+  // maps with no path are constants and get no texture at all
+  // placeholders: mid grey, flat normal, no emission, mid roughness
+  if (m.albedo != "")
+    material->albedo = Texture(m.albedo, 0x808080ff, false, m.albedo_srgb);
+  if (m.specular != "")
+    material->specular = Texture(m.specular, 0x000000ff, false, true);
+  if (m.normal != "")
+    material->normal = Texture(m.normal, 0x8080ffff, true);
+  if (m.emissive != "")
+    material->emissive =
+        Texture(m.emissive, 0x000000ff, false, m.emissive_srgb);
+  if (m.roughness != "")
+    material->roughness =
+        Texture(m.roughness, 0x808080ff, false, m.roughness_srgb);
+
+  // a path with no file behind it would only ever sample the placeholder,
+  // so it gets the permutation without the map, like an empty path
+  auto has_texture = [](const Texture &t) {
+    if (!t.texture)
+      return false;
+    const std::string &path = t.texture->file_path;
+    struct stat attr;
+    return t.texture->texture.array || path.substr(0, 6) == "color(" ||
+           stat(path.c_str(), &attr) == 0;
+  };
+  std::string &defines = material->defines;
+  if (has_texture(material->albedo))
+    defines += "#define ALBEDO_MAP\n";
+  if (has_texture(material->specular))
+    defines += "#define SPECULAR_MAP\n";
+  if (has_texture(material->normal))
+    defines += "#define NORMAL_MAP\n";
+  if (has_texture(material->emissive))
+    defines += "#define EMISSIVE_MAP\n";
+  if (has_texture(material->roughness))
+    defines += "#define ROUGHNESS_MAP\n";
+  if (m.uses_transparency)
+    defines += "#define ALPHA_BLEND\n";
+}
+Shader &Material::get_shader(uint32 light_types, bool async)
+{
+  ASSERT(light_types < material->shaders.size());
+  const Material_Descriptor &m = material->m;
+  const std::string &defines = material->defines;
+  Shader &shader = material->shaders[light_types];
+  const std::string permutation =
+      s(defines, "#define LIGHT_TYPES ", light_types, "\n");
+  if (!async && !shader.is_ready())
+    shader.load(m.vertex_shader, m.frag_shader, permutation);
+  else if (!shader.program)
+    shader.load_async(m.vertex_shader, m.frag_shader, permutation);
+  if (shader.is_ready())
+    return shader;
+  Shader &fallback = material->fallback;
+  if (!fallback.program)
+  {
+    std::string fallback_defines;
+    if (defines.find("#define ALBEDO_MAP\n") != std::string::npos)
+      fallback_defines += "#define ALBEDO_MAP\n";
+    if (m.uses_transparency)
+      fallback_defines += "#define ALPHA_BLEND\n";
+    fallback.load(m.vertex_shader, m.frag_shader, fallback_defines);
+  }
+  return fallback;
 }
-void Material::bind()
+void Material::bind(Shader &shader, GLuint *bound_arrays)
 {
+  const Material_Descriptor &m = material->m;
   if (m.backface_culling)
     glEnable(GL_CULL_FACE);
   else
     glDisable(GL_CULL_FACE);
 
-  albedo.bind("albedo", 0, shader);
-  // specular_color.bind("specular", 1, shader);
-  normal.bind("normal", 2, shader);
-  emissive.bind("emissive", 3, shader);
-  roughness.bind("roughness", 4, shader);
+  const GLint *locations = get_draw_uniform_locations(shader);
+  // sampler units are program state, they only need setting once
+  if (!shader.program->samplers_assigned)
+  {
+    shader.set_uniform("albedo", (int32)Texture_Location::albedo);
+    shader.set_uniform("specular", (int32)Texture_Location::specular);
+    shader.set_uniform("normal", (int32)Texture_Location::normal);
+    shader.set_uniform("emissive", (int32)Texture_Location::emissive);
+    shader.set_uniform("roughness", (int32)Texture_Location::roughness);
+    // its own unit even where nothing is instanced, a buffer sampler can't
+    // share unit 0 with albedo
+    glUniform1i(locations[instance_transforms_uniform],
+                (int32)texture_location_count);
+    shader.program->samplers_assigned = true;
+  }
+  // indexed by Texture_Location
+  const Texture *textures[] = {&material->albedo, &material->specular,
+                               &material->normal, &material->emissive,
+                               &material->roughness};
+  static_assert(sizeof(textures) / sizeof(textures[0]) ==
+                    texture_location_count, "");
+  int32 layers[texture_location_count] = {};
+  for (uint32 i = 0; i < texture_location_count; ++i)
+  {
+    // constants, the shader doesn't sample these units
+    if (!textures[i] || !textures[i]->texture)
+      continue;
+    const Texture_Layer layer = textures[i]->get_layer();
+    layers[i] = layer.layer;
+    if (bound_arrays && bound_arrays[i] == layer.array)
+      continue;
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, layer.array);
+    if (bound_arrays)
+      bound_arrays[i] = layer.array;
+  }
+  glUniform1iv(locations[texture_layers_uniform], texture_location_count,
+               layers);
+  glUniform4fv(locations[albedo_constant_uniform], 1, &m.albedo_constant[0]);
+  glUniform3fv(locations[emissive_constant_uniform], 1,
+               &m.emissive_constant[0]);
+  glUniform1f(locations[roughness_constant_uniform], m.roughness_constant);
 }
 void Material::unbind_textures()
 {
-  glActiveTexture(GL_TEXTURE0 + Texture_Location::albedo);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glActiveTexture(GL_TEXTURE0 + Texture_Location::specular);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glActiveTexture(GL_TEXTURE0 + Texture_Location::normal);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glActiveTexture(GL_TEXTURE0 + Texture_Location::emissive);
-  glBindTexture(GL_TEXTURE_2D, 0);
-  glActiveTexture(GL_TEXTURE0 + Texture_Location::roughness);
-  glBindTexture(GL_TEXTURE_2D, 0);
+  for (uint32 i = 0; i < texture_location_count; ++i)
+  {
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  }
 }
 
 bool Light::operator==(const Light &rhs) const
@@ -718,9 +1780,10 @@ bool Light_Array::operator==(const Light_Array &rhs)
 }
 
 Render_Entity::Render_Entity(Mesh *mesh, Material *material, Light_Array lights,
-                             mat4 world_to_model)
+                             mat4 world_to_model, uint32 ID)
     : mesh(mesh), material(material), lights(lights),
-      transformation(world_to_model)
+      transformation(world_to_model), previous_transformation(world_to_model),
+      ID(ID)
 {
   ASSERT(mesh);
   ASSERT(material);
@@ -732,13 +1795,41 @@ Render::Render(SDL_Window *window, ivec2 window_size)
   this->window = window;
   this->window_size = window_size;
   SDL_DisplayMode current;
-  SDL_GetCurrentDisplayMode(0, &current);
-  target_frame_time = 1.0f / (float32)current.refresh_rate;
+  if (window && SDL_GetCurrentDisplayMode(0, &current) == 0 &&
+      current.refresh_rate > 0)
+    target_frame_time = 1.0f / (float32)current.refresh_rate;
   set_vfov(vfov);
   init_render_targets();
+  for (uint32 i = 0; i < GPU_TIMER_FRAMES; ++i)
+    glGenQueries(gpu_timer_pass_count, &gpu_timer_queries[i][0]);
   FRAME_TIMER.start();
 }
 
+Render::~Render()
+{
+  // CLEANUP_RENDERER ran first, the context is going away with everything
+  if (!INIT)
+    return;
+  delete_render_targets();
+  for (GLsync &fence : frame_fences)
+  {
+    if (fence)
+      glDeleteSync(fence);
+    fence = nullptr;
+  }
+  for (uint32 i = 0; i < GPU_TIMER_FRAMES; ++i)
+    glDeleteQueries(gpu_timer_pass_count, &gpu_timer_queries[i][0]);
+}
+
+// selects the Material shader permutation
+static uint32 get_light_types(const Light_Array &lights)
+{
+  uint32 types = 0;
+  for (uint32 i = 0; i < lights.light_count; ++i)
+    types |= 1 << lights.lights[i].type;
+  return types;
+}
+
 void set_uniform_lights(Shader &shader, Light_Array &lights)
 {
   ASSERT(lights.lights.size() == MAX_LIGHTS);
@@ -767,6 +1858,171 @@ void set_uniform_lights(Shader &shader, Light_Array &lights)
   shader.set_uniform("additional_ambient", lights.additional_ambient);
 }
 
+static const GLint *get_draw_uniform_locations(const Shader &shader)
+{
+  std::vector<GLint> &locations = shader.program->draw_uniform_locations;
+  if (!locations.empty())
+    return &locations[0];
+
+  const char *names[] = {"MVP", "previous_MVP", "Model", "uv_scale", "time",
+      "txaa_jitter", "camera_position", "texture_layers", "albedo_constant",
+      "emissive_constant", "roughness_constant", "number_of_lights",
+      "additional_ambient", "instanced", "instance_offset",
+      "instance_transforms"};
+  const char *light_names[] = {"position", "direction", "color",
+      "attenuation", "ambient", "cone_angle", "type"};
+  static_assert(sizeof(names) / sizeof(names[0]) == light_uniforms, "");
+  static_assert(sizeof(light_names) / sizeof(light_names[0]) ==
+                    light_uniform_count, "");
+  const GLuint program = shader.program->program;
+  for (const char *name : names)
+    locations.push_back(glGetUniformLocation(program, name));
+  for (uint32 i = 0; i < MAX_LIGHTS; ++i)
+    for (const char *name : light_names)
+      locations.push_back(
+          glGetUniformLocation(program, s("lights[", i, "].", name).c_str()));
+  return &locations[0];
+}
+
+static void pack_lights(const Light_Array &lights, Packed_Lights *result)
+{
+  *result = Packed_Lights();
+  for (uint32 i = 0; i < MAX_LIGHTS; ++i)
+  {
+    const Light &light = lights.lights[i];
+    result->position[i] = light.position;
+    result->direction[i] = light.direction;
+    result->color[i] = light.color;
+    result->attenuation[i] = light.attenuation;
+    result->ambient[i] = light.ambient * light.color;
+    result->cone_angle[i] = light.cone_angle;
+    result->type[i] = (int32)light.type;
+  }
+  result->count = lights.light_count;
+  result->additional_ambient = lights.additional_ambient;
+}
+
+static void upload_lights(const GLint *locations, const Packed_Lights &lights)
+{
+  for (int32 i = 0; i < lights.count; ++i)
+  {
+    const GLint *l = locations + light_uniforms + i * light_uniform_count;
+    glUniform3fv(l[light_position], 1, &lights.position[i][0]);
+    glUniform3fv(l[light_direction], 1, &lights.direction[i][0]);
+    glUniform3fv(l[light_color], 1, &lights.color[i][0]);
+    glUniform3fv(l[light_attenuation], 1, &lights.attenuation[i][0]);
+    glUniform3fv(l[light_ambient], 1, &lights.ambient[i][0]);
+    glUniform1f(l[light_cone_angle], lights.cone_angle[i]);
+    glUniform1i(l[light_type], lights.type[i]);
+  }
+  glUniform1i(locations[number_of_lights_uniform], lights.count);
+  glUniform3fv(locations[additional_ambient_uniform], 1,
+               &lights.additional_ambient[0]);
+}
+
+// runs on the job system: no gl calls in here
+// records render_entities[first, first+count) into COMMAND_BUFFERS[job]
+void Render::record_draw_commands(uint32 first, uint32 count, uint32 job)
+{
+  Command_Buffer &buffer = COMMAND_BUFFERS[job];
+  buffer.commands.clear();
+  buffer.lights.clear();
+  Draw_Command_Key *keys = &COMMAND_KEYS[first];
+  const mat4 view_projection = projection * camera;
+  const mat4 previous_view_projection = previous_projection * previous_camera;
+  Packed_Lights lights;
+  for (uint32 i = 0; i < count; ++i)
+  {
+    const Render_Entity &entity = render_entities[first + i];
+    Draw_Command command;
+    command.MVP = view_projection * entity.transformation;
+    command.previous_MVP =
+        previous_view_projection * entity.previous_transformation;
+    command.Model = entity.transformation;
+    command.mesh = entity.mesh;
+    command.material = entity.material;
+    command.shader = ENTITY_SHADERS[first + i];
+    const Mesh_Lod &lod = entity.mesh->get_lod(entity.lod);
+    command.first_index = lod.first_index;
+    command.index_count = lod.index_count;
+
+    // neighbouring entities almost always share their lights
+    pack_lights(entity.lights, &lights);
+    if (buffer.lights.empty() ||
+        memcmp(&buffer.lights.back(), &lights, sizeof(Packed_Lights)) != 0)
+      buffer.lights.push_back(lights);
+    command.lights = buffer.lights.size() - 1;
+
+    const float32 view_depth = -(camera * entity.transformation[3]).z;
+    const float32 depth_01 = clamp(view_depth / 1000.0f, 0.0f, 1.0f);
+    const uint64 depth = uint64(depth_01 * 0x3fff);
+    static_assert(MAX_MESH_LODS <= 4, "the lod has 2 bits in the key");
+    const uint64 level = entity.lod;
+    const uint64 program = command.shader->program->program;
+    const uint64 material = entity.material->get_ID();
+    const uint64 vao = entity.mesh->get_vao();
+    keys[i].state = (program << 32) | material;
+    keys[i].order = (vao << 32) | (level << 14) | depth;
+    keys[i].buffer = job;
+    keys[i].index = buffer.commands.size();
+    buffer.commands.push_back(command);
+  }
+}
+
+static bool same_instance_draw(const Draw_Command_Key &a,
+                               const Draw_Command_Key &b)
+{
+  const Command_Buffer &a_buffer = COMMAND_BUFFERS[a.buffer];
+  const Command_Buffer &b_buffer = COMMAND_BUFFERS[b.buffer];
+  const Draw_Command &x = a_buffer.commands[a.index];
+  const Draw_Command &y = b_buffer.commands[b.index];
+  if (x.shader->program != y.shader->program ||
+      x.material->get_ID() != y.material->get_ID() ||
+      x.mesh->get_vao() != y.mesh->get_vao() ||
+      x.first_index != y.first_index || x.index_count != y.index_count)
+    return false;
+  const Packed_Lights &x_lights = a_buffer.lights[x.lights];
+  const Packed_Lights &y_lights = b_buffer.lights[y.lights];
+  return &x_lights == &y_lights ||
+         memcmp(&x_lights, &y_lights, sizeof(Packed_Lights)) == 0;
+}
+
+// splits the sorted COMMAND_KEYS into DRAW_BATCHES and gathers the
+// transforms of the instanced ones
+static void batch_draw_commands()
+{
+  DRAW_BATCHES.clear();
+  INSTANCE_TRANSFORMS.clear();
+  const uint32 count = COMMAND_KEYS.size();
+  uint32 instances = 0;
+  for (uint32 i = 0; i < count;)
+  {
+    uint32 n = 1;
+    while (i + n < count &&
+           same_instance_draw(COMMAND_KEYS[i], COMMAND_KEYS[i + n]))
+      n += 1;
+    // past the buffer texture limit the rest draw one by one
+    if (instances + n > MAX_BATCHED_INSTANCES)
+      n = 1;
+    Draw_Batch batch = {i, n, instances};
+    if (n > 1)
+    {
+      for (uint32 j = i; j < i + n; ++j)
+      {
+        const Draw_Command_Key &key = COMMAND_KEYS[j];
+        const Draw_Command &command =
+            COMMAND_BUFFERS[key.buffer].commands[key.index];
+        INSTANCE_TRANSFORMS.push_back(command.MVP);
+        INSTANCE_TRANSFORMS.push_back(command.previous_MVP);
+        INSTANCE_TRANSFORMS.push_back(command.Model);
+      }
+      instances += n;
+    }
+    DRAW_BATCHES.push_back(batch);
+    i += n;
+  }
+}
+
 void Render::opaque_pass(float32 time)
 {
   glEnable(GL_CULL_FACE);
@@ -775,27 +2031,134 @@ void Render::opaque_pass(float32 time)
   glEnable(GL_DEPTH_TEST);
   glDepthFunc(GL_LESS);
 
-  for (Render_Entity &entity : render_entities)
+  const uint32 count = render_entities.size();
+  // permutations are requested here, the recording jobs only read the
+  // resolved pointers
+  SHADER_TIMER.start();
+  update_async_shaders();
+  ENTITY_SHADERS.resize(count);
+  for (uint32 i = 0; i < count; ++i)
   {
+    Render_Entity &entity = render_entities[i];
     ASSERT(entity.mesh);
-    int vao = entity.mesh->get_vao();
-    glBindVertexArray(vao);
-    Shader &shader = entity.material->shader;
-    shader.use();
-    entity.material->bind();
-    entity.mesh->bind_to_shader(shader);
-    shader.set_uniform("time", time);
-    shader.set_uniform("txaa_jitter", txaa_jitter);
-    shader.set_uniform("camera_position", camera_position);
-    shader.set_uniform("uv_scale", entity.material->m.uv_scale);
-    shader.set_uniform("MVP", projection * camera * entity.transformation);
-    shader.set_uniform("Model", entity.transformation);
-    shader.set_uniform("discard_over_blend", true);
-    set_uniform_lights(shader, entity.lights);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, entity.mesh->get_indices_buffer());
-    glDrawElements(GL_TRIANGLES, entity.mesh->get_indices_buffer_size(),
-                   GL_UNSIGNED_INT, nullptr);
+    ASSERT(entity.material);
+    ENTITY_SHADERS[i] = &entity.material->get_shader(
+        get_light_types(entity.lights), use_async_shaders);
+  }
+  SHADER_TIMER.stop();
+
+  RECORD_TIMER.start();
+  const uint32 job_count = (count + COMMANDS_PER_JOB - 1) / COMMANDS_PER_JOB;
+  if (COMMAND_BUFFERS.size() < job_count)
+    COMMAND_BUFFERS.resize(job_count);
+  COMMAND_KEYS.resize(count);
+  get_job_system().parallel_for(job_count, [&](uint32 job) {
+    const uint32 first = job * COMMANDS_PER_JOB;
+    const uint32 n = glm::min(count - first, (uint32)COMMANDS_PER_JOB);
+    record_draw_commands(first, n, job);
+  });
+  std::sort(COMMAND_KEYS.begin(), COMMAND_KEYS.end(),
+            [](const Draw_Command_Key &a, const Draw_Command_Key &b) {
+              if (a.state != b.state)
+                return a.state < b.state;
+              return a.order < b.order;
+            });
+  batch_draw_commands();
+  RECORD_TIMER.stop();
+
+  REPLAY_TIMER.start();
+  if (!INSTANCE_TRANSFORMS.empty())
+  {
+    glBindBuffer(GL_TEXTURE_BUFFER, INSTANCE_TRANSFORM_BUFFER);
+    glBufferData(GL_TEXTURE_BUFFER, INSTANCE_TRANSFORMS.size() * sizeof(mat4),
+                 &INSTANCE_TRANSFORMS[0], GL_STREAM_DRAW);
+    glBindBuffer(GL_TEXTURE_BUFFER, 0);
+    glActiveTexture(GL_TEXTURE0 + texture_location_count);
+    glBindTexture(GL_TEXTURE_BUFFER, INSTANCE_TRANSFORM_TEXTURE);
+    glActiveTexture(GL_TEXTURE0);
+  }
+  GLuint program = 0;
+  // the current program's "instanced", every program is left with false
+  bool instanced = false;
+  const GLint *locations = nullptr;
+  uint32 material = 0; // ID, 0 is never handed out
+  GLuint vao = 0;
+  // unknown at the start of the pass, ~0 never matches
+  GLuint bound_arrays[texture_location_count];
+  for (GLuint &array : bound_arrays)
+    array = ~0u;
+  // uniforms are program state, so lights only need uploading again when
+  // they differ from what this program last got
+  std::unordered_map<GLuint, const Packed_Lights *> uploaded_lights;
+  for (const Draw_Batch &batch : DRAW_BATCHES)
+  {
+    const Draw_Command_Key &key = COMMAND_KEYS[batch.first_key];
+    const Command_Buffer &buffer = COMMAND_BUFFERS[key.buffer];
+    const Draw_Command &command = buffer.commands[key.index];
+    Shader &shader = *command.shader;
+    if (shader.program->program != program)
+    {
+      if (instanced)
+        glUniform1i(locations[instanced_uniform], 0);
+      instanced = false;
+      program = shader.program->program;
+      shader.use();
+      locations = get_draw_uniform_locations(shader);
+      glUniform1f(locations[time_uniform], time);
+      glUniformMatrix4fv(locations[txaa_jitter_uniform], 1, GL_FALSE,
+                         &txaa_jitter[0][0]);
+      glUniform3fv(locations[camera_position_uniform], 1, &camera_position[0]);
+      material = 0;
+    }
+    // entities loaded with equal descriptors share one material
+    if (command.material->get_ID() != material)
+    {
+      material = command.material->get_ID();
+      command.material->bind(shader, bound_arrays);
+      glUniform2fv(locations[uv_scale_uniform], 1,
+                   &command.material->material->m.uv_scale[0]);
+    }
+    if (command.mesh->get_vao() != vao)
+    {
+      vao = command.mesh->get_vao();
+      glBindVertexArray(vao);
+      command.mesh->bind_to_shader(shader);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, command.mesh->get_indices_buffer());
+    }
+    const Packed_Lights &lights = buffer.lights[command.lights];
+    const Packed_Lights *&uploaded = uploaded_lights[program];
+    if (!uploaded || memcmp(uploaded, &lights, sizeof(Packed_Lights)) != 0)
+    {
+      upload_lights(locations, lights);
+      uploaded = &lights;
+    }
+    const void *indices =
+        (void *)(size_t(command.first_index) * command.mesh->get_index_size());
+    if (batch.count > 1)
+    {
+      if (!instanced)
+        glUniform1i(locations[instanced_uniform], 1);
+      instanced = true;
+      glUniform1i(locations[instance_offset_uniform], batch.instance_offset);
+      glDrawElementsInstanced(GL_TRIANGLES, command.index_count,
+                              command.mesh->get_index_type(), indices,
+                              batch.count);
+      continue;
+    }
+    if (instanced)
+      glUniform1i(locations[instanced_uniform], 0);
+    instanced = false;
+    glUniformMatrix4fv(locations[mvp_uniform], 1, GL_FALSE, &command.MVP[0][0]);
+    glUniformMatrix4fv(locations[previous_mvp_uniform], 1, GL_FALSE,
+                       &command.previous_MVP[0][0]);
+    glUniformMatrix4fv(locations[model_uniform], 1, GL_FALSE,
+                       &command.Model[0][0]);
+    glDrawElements(GL_TRIANGLES, command.index_count,
+                   command.mesh->get_index_type(), indices);
   }
+  if (instanced)
+    glUniform1i(locations[instanced_uniform], 0);
+  REPLAY_TIMER.stop();
 }
 
 void Render::instance_pass(float32 time)
@@ -806,15 +2169,16 @@ void Render::instance_pass(float32 time)
     ASSERT(entity.mesh);
     int vao = entity.mesh->get_vao();
     glBindVertexArray(vao);
-    Shader &shader = entity.material->shader;
+    Shader &shader = entity.material->get_shader(
+        get_light_types(entity.lights), use_async_shaders);
     ASSERT(shader.vs == "instance.vert");
     shader.use();
-    entity.material->bind();
+    entity.material->bind(shader);
     entity.mesh->bind_to_shader(shader);
     shader.set_uniform("time", time);
     shader.set_uniform("txaa_jitter", txaa_jitter);
     shader.set_uniform("camera_position", camera_position);
-    shader.set_uniform("uv_scale", entity.material->m.uv_scale);
+    shader.set_uniform("uv_scale", entity.material->material->m.uv_scale);
     set_uniform_lights(shader, entity.lights);
     //// verify sizes of data, mat4 floats
     ASSERT(entity.Model_Matrices.size() > 0);
@@ -889,7 +2253,8 @@ void Render::instance_pass(float32 time)
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, entity.mesh->get_indices_buffer());
     glDrawElementsInstanced(GL_TRIANGLES,
                             entity.mesh->get_indices_buffer_size(),
-                            GL_UNSIGNED_INT, (void *)0, num_instances);
+                            entity.mesh->get_index_type(), (void *)0,
+                            num_instances);
 
     entity.material->unbind_textures();
     glDisableVertexAttribArray(loc1);
@@ -914,46 +2279,123 @@ void Render::translucent_pass(float32 time)
     ASSERT(entity.mesh);
     int vao = entity.mesh->get_vao();
     glBindVertexArray(vao);
-    Shader &shader = entity.material->shader;
+    Shader &shader = entity.material->get_shader(
+        get_light_types(entity.lights), use_async_shaders);
     shader.use();
-    entity.material->bind();
+    entity.material->bind(shader);
     entity.mesh->bind_to_shader(shader);
     shader.set_uniform("time", time);
     shader.set_uniform("txaa_jitter", txaa_jitter);
     shader.set_uniform("camera_position", camera_position);
-    shader.set_uniform("uv_scale", entity.material->m.uv_scale);
+    shader.set_uniform("uv_scale", entity.material->material->m.uv_scale);
     shader.set_uniform("MVP", projection * camera * entity.transformation);
+    shader.set_uniform("previous_MVP", previous_projection * previous_camera *
+                                           entity.previous_transformation);
     shader.set_uniform("Model", entity.transformation);
-    shader.set_uniform("discard_over_blend", false);
     set_uniform_lights(shader, entity.lights);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, entity.mesh->get_indices_buffer());
     glDrawElements(GL_TRIANGLES, entity.mesh->get_indices_buffer_size(),
-                   GL_UNSIGNED_INT, nullptr);
+                   entity.mesh->get_index_type(), nullptr);
   }
 }
+// passthrough.vert only has position and uv slots, so the mesh's
+// bind_to_shader() can't be used for the quad
+static void bind_fullscreen_quad()
+{
+  glEnableVertexAttribArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, QUAD.mesh->position_buffer);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float32) * 3, 0);
+
+  glEnableVertexAttribArray(1);
+  glBindBuffer(GL_ARRAY_BUFFER, QUAD.mesh->uv_buffer);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float32) * 2, 0);
+}
+
+void Render::temporalaa_pass(const mat4 &o)
+{
+  const uint32 write = history_index;
+  const uint32 read = 1 - history_index;
+
+  // accumulate at window size from the smaller jittered render target
+  glBindFramebuffer(GL_FRAMEBUFFER, history_framebuffer);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                       history_targets[write], 0);
+  glViewport(0, 0, window_size.x, window_size.y);
+  glBindVertexArray(QUAD.get_vao());
+  TEMPORALAA.use();
+  bind_fullscreen_quad();
+
+  GLuint u = glGetUniformLocation(TEMPORALAA.program->program, "current");
+  glUniform1i(u, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, color_target_texture);
+  GLuint u2 = glGetUniformLocation(TEMPORALAA.program->program, "velocity");
+  glUniform1i(u2, 1);
+  glActiveTexture(GL_TEXTURE0 + 1);
+  glBindTexture(GL_TEXTURE_2D, velocity_target_texture);
+  GLuint u3 = glGetUniformLocation(TEMPORALAA.program->program, "history");
+  glUniform1i(u3, 2);
+  glActiveTexture(GL_TEXTURE0 + 2);
+  glBindTexture(GL_TEXTURE_2D, history_targets[read]);
+
+  TEMPORALAA.set_uniform("transform", o);
+  TEMPORALAA.set_uniform("current_size", vec2(size));
+  TEMPORALAA.set_uniform("jitter_uv", txaa_jitter_offset / vec2(size));
+  TEMPORALAA.set_uniform("history_valid", (int32)!history_missing);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, QUAD.get_indices_buffer());
+  glDrawElements(GL_TRIANGLES, QUAD.get_indices_buffer_size(),
+                 QUAD.get_index_type(), (void *)0);
+
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0 + 1);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glActiveTexture(GL_TEXTURE0 + 2);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glBindVertexArray(0);
+  history_missing = false;
+}
+
 void Render::render(float64 state_time)
 {
+  read_gpu_timers();
+  process_captures(false);
 #if DYNAMIC_FRAMERATE_TARGET
-  dynamic_framerate_target();
+  if (!benchmark_mode)
+    dynamic_framerate_target();
 #endif
-#if DYNAMIC_TEXTURE_RELOADING
-  check_and_clear_expired_textures();
+#if DYNAMIC_TEXTURE_RELOADING || DYNAMIC_SHADER_RELOADING
+  reload_changed_files();
 #endif
+  stream_textures(false);
 
+  const uint32 timer_slot = frame_count % GPU_TIMER_FRAMES;
+  glBeginQuery(GL_TIME_ELAPSED,
+               gpu_timer_queries[timer_slot][Gpu_Timer_Pass::scene_timer]);
   float32 time = (float32)get_real_time();
+  if (benchmark_mode)
+    time = (float32)state_time;
   float64 t = (time - state_time) / dt;
   glViewport(0, 0, size.x, size.y);
-  glBindFramebuffer(GL_FRAMEBUFFER, TARGET_FRAMEBUFFER);
-  glFramebufferTexture(GL_FRAMEBUFFER, DIFFUSE_TARGET, COLOR_TARGET_TEXTURE, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, target_framebuffer);
+  glFramebufferTexture(GL_FRAMEBUFFER, DIFFUSE_TARGET, color_target_texture, 0);
 
   glClearColor(clear_color.r, clear_color.g, clear_color.b, 1.0);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  // glClear would fill the velocity target with the clear color
+  const GLfloat zero_velocity[] = {0, 0, 0, 0};
+  glClearBufferfv(GL_COLOR, 1, zero_velocity);
+  // after the clear, clear_color is already srgb
+  glEnable(GL_FRAMEBUFFER_SRGB);
 
   opaque_pass(time);
   instance_pass(time);
   translucent_pass(time);
+  glEndQuery(GL_TIME_ELAPSED);
+  glBeginQuery(GL_TIME_ELAPSED,
+               gpu_timer_queries[timer_slot][Gpu_Timer_Pass::post_timer]);
 
-  draw_calls_last_frame = render_entities.size();
+  draw_calls_last_frame = DRAW_BATCHES.size();
   mat4 o =
       ortho(0.0f, (float32)window_size.x, 0.0f, (float32)window_size.y, 0.1f,
             100.0f) *
@@ -961,97 +2403,76 @@ void Render::render(float64 state_time)
       scale(vec3(window_size, 1));
   if (use_txaa)
   {
-    // TODO: implement motion vector vertex attribute
-
-    // render to main framebuffer
+    temporalaa_pass(o);
+    glDisable(GL_FRAMEBUFFER_SRGB);
+
+    // the history target we just wrote is the final image, copied as is
+    // since the output holds srgb values without being marked as such
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, history_framebuffer);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, output_framebuffer);
+    glBlitFramebuffer(0, 0, window_size.x, window_size.y, 0, 0, window_size.x,
+                      window_size.y, GL_COLOR_BUFFER_BIT, GL_NEAREST);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    glViewport(0, 0, window_size.x, window_size.y);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    TEMPORALAA.use();
-    QUAD.bind_to_shader(TEMPORALAA);
-    GLuint u = glGetUniformLocation(TEMPORALAA.program->program, "current");
-    glUniform1i(u, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, COLOR_TARGET_TEXTURE);
-    GLuint u2 = glGetUniformLocation(TEMPORALAA.program->program, "previous");
-    glUniform1i(u2, 1);
-    glActiveTexture(GL_TEXTURE0 + 1);
-    glBindTexture(GL_TEXTURE_2D, PREV_COLOR_TARGET_MISSING
-                                     ? COLOR_TARGET_TEXTURE
-                                     : PREV_COLOR_TARGET);
-    TEMPORALAA.set_uniform("transform", o);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, QUAD.get_indices_buffer());
-    glDrawElements(GL_TRIANGLES, QUAD.get_indices_buffer_size(),
-                   GL_UNSIGNED_INT, (void *)0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glActiveTexture(GL_TEXTURE0 + 1);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    glFinish(); // intent is to time just the swap itself
-    FRAME_TIMER.stop();
-    SWAP_TIMER.start();
-    SDL_GL_SwapWindow(window);
-    glFinish();
-    SWAP_TIMER.stop();
-    FRAME_TIMER.start();
-
-    // copy this frame to previous framebuffer
-    // so it will be usable next frame, when its the old frame
-
-    // assign previous_color as the target to overwrite
-    glViewport(0, 0, size.x, size.y);
-    glBindFramebuffer(GL_FRAMEBUFFER, TARGET_FRAMEBUFFER);
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                         PREV_COLOR_TARGET, 0);
-    PASSTHROUGH.use();
-    QUAD.bind_to_shader(PASSTHROUGH);
-    // sample the current color_target as source
-    GLuint u3 = glGetUniformLocation(PASSTHROUGH.program->program, "albedo");
-    glUniform1i(u3, Texture_Location::albedo);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, COLOR_TARGET_TEXTURE);
-    PASSTHROUGH.set_uniform("transform", o);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, QUAD.get_indices_buffer());
-    glDrawElements(GL_TRIANGLES, QUAD.get_indices_buffer_size(),
-                   GL_UNSIGNED_INT, (void *)0);
-
-    PREV_COLOR_TARGET_MISSING = false;
-    // place color_target back in target_fbo
-    glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
-                         COLOR_TARGET_TEXTURE, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
-    txaa_jitter = get_next_TXAA_sample();
+    glEndQuery(GL_TIME_ELAPSED);
+    gpu_timer_pending[timer_slot] = true;
+    present();
+    history_index = 1 - history_index;
+
+    txaa_jitter_offset = get_next_TXAA_sample();
+    txaa_jitter =
+        glm::translate(vec3(2.0f * txaa_jitter_offset / vec2(size), 0));
   }
   else
   {
-    // render to main framebuffer
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    // render to main framebuffer, passthrough.frag encodes
+    glDisable(GL_FRAMEBUFFER_SRGB);
+    glBindFramebuffer(GL_FRAMEBUFFER, output_framebuffer);
     glViewport(0, 0, window_size.x, window_size.y);
     glClearColor(1, 0, 0, 1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glBindVertexArray(QUAD.get_vao());
     PASSTHROUGH.use();
-
-    glEnableVertexAttribArray(0);
-    glBindBuffer(GL_ARRAY_BUFFER, QUAD.mesh->position_buffer);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float32) * 3, 0);
-
-    glEnableVertexAttribArray(1);
-    glBindBuffer(GL_ARRAY_BUFFER, QUAD.mesh->uv_buffer);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(float32) * 2, 0);
+    bind_fullscreen_quad();
 
     GLuint loc = glGetUniformLocation(PASSTHROUGH.program->program, "albedo");
     ASSERT(loc != -1);
     glUniform1i(loc, Texture_Location::albedo);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, COLOR_TARGET_TEXTURE);
+    glBindTexture(GL_TEXTURE_2D, color_target_texture);
 
     PASSTHROUGH.set_uniform("transform", o);
+    PASSTHROUGH.set_uniform("uv_scale", vec2(size) / vec2(allocated_size));
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, QUAD.get_indices_buffer());
     glDrawElements(GL_TRIANGLES, QUAD.get_indices_buffer_size(),
-                   GL_UNSIGNED_INT, (void *)0);
+                   QUAD.get_index_type(), (void *)0);
 
     glBindTexture(GL_TEXTURE_2D, 0);
+    glEndQuery(GL_TIME_ELAPSED);
+    gpu_timer_pending[timer_slot] = true;
+    present();
+    glBindVertexArray(0);
+    // set_message("Swap complete... Saving default framebuffer");
+    // save_and_log_screen();
+  }
+  previous_camera = camera;
+  previous_projection = projection;
+  wait_for_frames_in_flight();
+  frame_count += 1;
+}
+
+void Render::present()
+{
+  if (capture_frames)
+    capture_frame();
+  if (!window)
+  {
+    // offscreen, nothing to swap
+    FRAME_TIMER.stop();
+    FRAME_TIMER.start();
+    return;
+  }
+  if (!use_fence_pacing)
+  {
     glFinish(); // intent is to time just the swap itself
     FRAME_TIMER.stop();
     SWAP_TIMER.start();
@@ -1059,11 +2480,145 @@ void Render::render(float64 state_time)
     glFinish();
     SWAP_TIMER.stop();
     FRAME_TIMER.start();
-    glBindVertexArray(0);
-    // set_message("Swap complete... Saving default framebuffer");
-    // save_and_log_screen();
+    return;
   }
-  frame_count += 1;
+  // no drain here: SWAP_TIMER is only the time the swap call blocked us
+  // (vsync/present queue), gpu backlog shows up in wait_for_frames_in_flight()
+  // which runs inside FRAME_TIMER
+  FRAME_TIMER.stop();
+  SWAP_TIMER.start();
+  SDL_GL_SwapWindow(window);
+  SWAP_TIMER.stop();
+  FRAME_TIMER.start();
+}
+
+// queues the finished frame for encoding as frame_<frame_count>.png
+void Render::capture_frame()
+{
+  char name[32];
+  snprintf(name, sizeof(name), "frame_%06llu.png",
+           (unsigned long long)frame_count);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, output_framebuffer);
+  Capture_Slot *slot = begin_capture(window_size, name);
+  glReadPixels(0, 0, window_size.x, window_size.y, GL_RGBA, GL_UNSIGNED_BYTE,
+               (void *)0);
+  end_capture(slot);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+}
+
+void Render::wait_for_frames_in_flight()
+{
+  if (!use_fence_pacing)
+    return;
+
+  const uint32 slot = frame_count % MAX_FRAMES_IN_FLIGHT;
+  if (frame_fences[slot])
+    glDeleteSync(frame_fences[slot]);
+  frame_fences[slot] =
+      glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, GL_UNUSED_BIT);
+
+  // before recording frame n+1, frame n+1-frames_in_flight must be finished
+  // frames_in_flight == 1 waits for the frame we just submitted
+  if (frame_count + 1 < frames_in_flight)
+    return;
+  const uint64 oldest_frame = frame_count + 1 - frames_in_flight;
+  const uint32 oldest_slot = oldest_frame % MAX_FRAMES_IN_FLIGHT;
+  GLsync fence = frame_fences[oldest_slot];
+  if (!fence)
+    return;
+
+  const GLuint64 timeout = 1000000000; // ns
+  FENCE_WAIT_TIMER.start();
+  GLenum result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+  while (result == GL_TIMEOUT_EXPIRED)
+  {
+    set_message("Frame fence wait timed out, waiting again. Frame: ",
+                s(oldest_frame), 1.0);
+    result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+  }
+  FENCE_WAIT_TIMER.stop();
+  if (result == GL_WAIT_FAILED)
+  {
+    set_message("glClientWaitSync failed in wait_for_frames_in_flight()");
+  }
+  glDeleteSync(fence);
+  frame_fences[oldest_slot] = nullptr;
+}
+
+// harvests every finished timer query without waiting on any of them
+void Render::read_gpu_timers()
+{
+  // exponential moving average weight of the newest sample
+  const float64 weight = 0.2;
+  for (uint32 i = 0; i < GPU_TIMER_FRAMES; ++i)
+  {
+    if (!gpu_timer_pending[i])
+      continue;
+    GLint available = 0;
+    glGetQueryObjectiv(gpu_timer_queries[i][Gpu_Timer_Pass::post_timer],
+                       GL_QUERY_RESULT_AVAILABLE, &available);
+    if (!available)
+      continue;
+    GLuint64 scene_ns = 0;
+    GLuint64 post_ns = 0;
+    glGetQueryObjectui64v(gpu_timer_queries[i][Gpu_Timer_Pass::scene_timer],
+                          GL_QUERY_RESULT, &scene_ns);
+    glGetQueryObjectui64v(gpu_timer_queries[i][Gpu_Timer_Pass::post_timer],
+                          GL_QUERY_RESULT, &post_ns);
+    gpu_timer_pending[i] = false;
+
+    const float64 scene = scene_ns * 1e-9;
+    const float64 post = post_ns * 1e-9;
+    last_gpu_frame_time = scene + post;
+    if (gpu_timer_samples == 0)
+    {
+      gpu_scene_time = scene;
+      gpu_post_time = post;
+    }
+    gpu_scene_time = (1.0 - weight) * gpu_scene_time + weight * scene;
+    gpu_post_time = (1.0 - weight) * gpu_post_time + weight * post;
+    gpu_timer_samples += 1;
+  }
+}
+
+void Render::set_frames_in_flight(uint32 count)
+{
+  if (count < 1)
+    count = 1;
+  if (count > MAX_FRAMES_IN_FLIGHT)
+    count = MAX_FRAMES_IN_FLIGHT;
+  frames_in_flight = count;
+}
+
+std::string Render::frame_timing_report()
+{
+  std::string result;
+  result += "\nFrame avg: " + s(FRAME_TIMER.moving_average());
+  result += "\nSwap avg: " + s(SWAP_TIMER.moving_average());
+  result += "\nGPU scene: " + s(gpu_scene_time);
+  result += "\nGPU post: " + s(gpu_post_time);
+  if (use_occlusion_culling)
+  {
+    result += "\nOcclusion avg: " + s(OCCLUSION_TIMER.moving_average());
+    result += "\nOcclusion culled: " + s(occlusion_culled_last_frame);
+  }
+  result += "\nRecord avg: " + s(RECORD_TIMER.moving_average());
+  result += "\nOpaque draws: " + s(draw_calls_last_frame) + " for " +
+            s(render_entities.size()) + " entities";
+  result += "\nShaders avg: " + s(SHADER_TIMER.moving_average()) +
+            " max: " + s(SHADER_TIMER.longest());
+  result += "\nReplay avg: " + s(REPLAY_TIMER.moving_average());
+  result += "\nTexture upload avg: " +
+            s(TEXTURE_UPLOAD_TIMER.moving_average()) +
+            " max: " + s(TEXTURE_UPLOAD_TIMER.longest());
+  if (capture_frames)
+    result += "\nCapture avg: " + s(CAPTURE_TIMER.moving_average());
+  if (use_fence_pacing)
+  {
+    result += "\nFence wait avg: " + s(FENCE_WAIT_TIMER.moving_average());
+    result += "\nFrames in flight: " + s(frames_in_flight);
+  }
+  return result;
 }
 
 void Render::resize_window(ivec2 window_size)
@@ -1073,17 +2628,30 @@ void Render::resize_window(ivec2 window_size)
   ASSERT(0); // not yet implemented
 }
 
+void Render::invalidate_history()
+{
+  history_missing = true;
+  // the jitter sequence starts over like in a new Render
+  jitter_index = 0;
+  txaa_jitter_offset = vec2(0);
+  txaa_jitter = mat4(1);
+  // they'd be matched as last frame's transforms next frame
+  previous_render_entities.clear();
+  render_entities.clear();
+  translucent_entities.clear();
+}
+
+// free to call every frame: the targets are already allocated at
+// MAX_RENDER_SCALE, this only changes the viewport and uv scale
 void Render::set_render_scale(float32 scale)
 {
-  if (scale < 0.1f)
-    scale = 0.1f;
-  if (scale > 2.0f)
-    scale = 2.0f;
-  if (render_scale == scale)
-    return;
+  if (scale < MIN_RENDER_SCALE)
+    scale = MIN_RENDER_SCALE;
+  if (scale > MAX_RENDER_SCALE)
+    scale = MAX_RENDER_SCALE;
   render_scale = scale;
-  init_render_targets();
-  time_of_last_scale_change = get_real_time();
+  size = ivec2(render_scale * window_size.x, render_scale * window_size.y);
+  size = max(min(size, allocated_size), ivec2(1));
 }
 
 void Render::set_camera(vec3 pos, vec3 camera_gaze_dir)
@@ -1109,7 +2677,30 @@ void Render::set_vfov(float32 vfov)
 void Render::set_render_entities(vector<Render_Entity> *new_entities)
 {
   previous_render_entities = move(render_entities);
+  previous_render_entities.insert(previous_render_entities.end(),
+                                  translucent_entities.begin(),
+                                  translucent_entities.end());
   render_entities.clear();
+  translucent_entities.clear();
+
+  // match this frame's entities to last frame's by ID for motion vectors
+  // and LOD hysteresis
+  std::unordered_map<uint32, const Render_Entity *> previous_entities;
+  previous_entities.reserve(previous_render_entities.size());
+  for (const Render_Entity &entity : previous_render_entities)
+  {
+    if (entity.ID != 0)
+      previous_entities[entity.ID] = &entity;
+  }
+  auto match_previous_frame = [&](Render_Entity &entity) {
+    auto it = previous_entities.find(entity.ID);
+    const Render_Entity *previous = nullptr;
+    if (entity.ID != 0 && it != previous_entities.end())
+      previous = it->second;
+    entity.previous_transformation =
+        previous ? previous->transformation : entity.transformation;
+    entity.lod = select_lod(entity, previous ? previous->lod : 0);
+  };
 
   std::vector<std::pair<uint32, float32>>
       index_distances; // for insert sorted, -1 means index-omit
@@ -1121,10 +2712,13 @@ void Render::set_render_entities(vector<Render_Entity> *new_entities)
     vec3 translation = vec3((*m)[3][0], (*m)[3][1], (*m)[3][2]);
 
     float32 dist = length(translation - camera_position);
-    bool is_transparent = entity->material->m.uses_transparency;
+    bool is_transparent = entity->material->material->m.uses_transparency;
     if (is_transparent)
     {
-      ASSERT(entity->material->albedo.storage_type == GL_RGBA);
+      // blending needs the alpha channel
+      const GLenum albedo = entity->material->material->albedo.storage_type;
+      ASSERT(albedo == GL_RGBA || albedo == GL_RGBA8 ||
+             albedo == GL_SRGB8_ALPHA8);
       index_distances.push_back({i, dist});
     }
     else
@@ -1143,13 +2737,95 @@ void Render::set_render_entities(vector<Render_Entity> *new_entities)
     if (i.second != -1.0f)
     {
       translucent_entities.push_back((*new_entities)[i.first]);
+      match_previous_frame(translucent_entities.back());
       ASSERT(0); // test this, the furthest objects should be first
     }
     else
     {
       render_entities.push_back((*new_entities)[i.first]);
+      match_previous_frame(render_entities.back());
     }
   }
+  occlusion_cull();
+}
+
+// picks the LOD for the entity's projected size, only moving away from the
+// level it had last frame once the size is well past the boundary
+uint32 Render::select_lod(const Render_Entity &entity, uint32 current)
+{
+  const uint32 lod_count = entity.mesh->get_lod_count();
+  if (!use_lods || lod_count < 2)
+    return 0;
+  const Mesh_Handle &mesh = *entity.mesh->mesh;
+  const mat4 &m = entity.transformation;
+  const float32 scale = glm::max(
+      length(vec3(m[0])), glm::max(length(vec3(m[1])), length(vec3(m[2]))));
+  const vec3 extent = mesh.bounds_max - mesh.bounds_min;
+  const float32 radius = 0.5f * scale * length(extent);
+  const vec3 center = vec3(m * vec4(mesh.bounds_min + 0.5f * extent, 1));
+  const float32 distance = length(center - camera_position);
+  if (distance <= radius)
+    return 0;
+  // projected diameter of the bounding sphere in window pixels
+  const float32 pixels = radius * projection[1][1] * window_size.y / distance;
+
+  // level i is for sizes in [LOD_PIXELS / 2^i, LOD_PIXELS / 2^(i-1))
+  const float32 coarser = 1.0f - LOD_HYSTERESIS;
+  const float32 finer = 1.0f + LOD_HYSTERESIS;
+  uint32 lod = glm::min(current, lod_count - 1);
+  while (lod + 1 < lod_count && pixels < coarser * LOD_PIXELS / (1 << lod))
+    lod += 1;
+  while (lod > 0 && pixels > finer * LOD_PIXELS / (1 << (lod - 1)))
+    lod -= 1;
+  return lod;
+}
+
+// draws the occluders into the cpu depth buffer and drops every other entity
+// whose bounding box is entirely behind them
+void Render::occlusion_cull()
+{
+  occlusion_culled_last_frame = 0;
+  if (!use_occlusion_culling)
+    return;
+  OCCLUSION_TIMER.start();
+  const mat4 view_projection = projection * camera;
+  const int32 height = OCCLUSION_BUFFER_WIDTH * window_size.y / window_size.x;
+  occlusion_buffer.clear(ivec2(OCCLUSION_BUFFER_WIDTH, glm::max(height, 1)));
+  bool any_occluders = false;
+  for (Render_Entity &entity : render_entities)
+  {
+    if (!entity.occluder)
+      continue;
+    const Mesh_Geometry &geometry = entity.mesh->get_geometry();
+    occlusion_buffer.rasterize(view_projection * entity.transformation,
+                               geometry.positions, geometry.indices);
+    any_occluders = true;
+  }
+  if (!any_occluders)
+  {
+    OCCLUSION_TIMER.stop();
+    return;
+  }
+  occlusion_buffer.build_hierarchy();
+
+  auto occluded = [&](const Render_Entity &entity) {
+    if (entity.occluder)
+      return false;
+    const Mesh_Handle &mesh = *entity.mesh->mesh;
+    return occlusion_buffer.is_occluded(view_projection * entity.transformation,
+                                        mesh.bounds_min, mesh.bounds_max);
+  };
+  const size_t count = render_entities.size() + translucent_entities.size();
+  render_entities.erase(
+      std::remove_if(render_entities.begin(), render_entities.end(), occluded),
+      render_entities.end());
+  translucent_entities.erase(std::remove_if(translucent_entities.begin(),
+                                            translucent_entities.end(),
+                                            occluded),
+                             translucent_entities.end());
+  occlusion_culled_last_frame =
+      count - render_entities.size() - translucent_entities.size();
+  OCCLUSION_TIMER.stop();
 }
 
 void check_FBO_status()
@@ -1194,157 +2870,165 @@ void check_FBO_status()
   }
 }
 
-void Render::init_render_targets()
+void Render::delete_render_targets()
 {
-  set_message("init_render_targets()");
-  set_message("Deleting FBO", std::to_string(TARGET_FRAMEBUFFER));
-  set_message("Deleting Textures", std::to_string(COLOR_TARGET_TEXTURE) + " " +
-                                       std::to_string(PREV_COLOR_TARGET) + " " +
-                                       std::to_string(DEPTH_TARGET_TEXTURE));
+  set_message("Deleting FBO", std::to_string(target_framebuffer));
+  set_message("Deleting Textures",
+              s(color_target_texture, " ", velocity_target_texture, " ",
+                history_targets[0], " ", history_targets[1], " ",
+                depth_target_texture));
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
-  glDeleteFramebuffers(1, &TARGET_FRAMEBUFFER);
-  glDeleteTextures(1, &COLOR_TARGET_TEXTURE);
-  glDeleteTextures(1, &PREV_COLOR_TARGET);
-  glDeleteRenderbuffers(1, &DEPTH_TARGET_TEXTURE);
+  glDeleteFramebuffers(1, &target_framebuffer);
+  glDeleteFramebuffers(1, &history_framebuffer);
+  glDeleteTextures(1, &color_target_texture);
+  glDeleteTextures(1, &velocity_target_texture);
+  glDeleteTextures(2, &history_targets[0]);
+  glDeleteRenderbuffers(1, &depth_target_texture);
+  target_framebuffer = 0;
+  history_framebuffer = 0;
+  color_target_texture = 0;
+  velocity_target_texture = 0;
+  history_targets[0] = history_targets[1] = 0;
+  depth_target_texture = 0;
+}
 
-  size = ivec2(render_scale * window_size.x, render_scale * window_size.y);
-  glGenFramebuffers(1, &TARGET_FRAMEBUFFER);
-  glBindFramebuffer(GL_FRAMEBUFFER, TARGET_FRAMEBUFFER);
+void Render::init_render_targets()
+{
+  set_message("init_render_targets()");
+  delete_render_targets();
+
+  allocated_size = ivec2(MAX_RENDER_SCALE * window_size.x,
+                         MAX_RENDER_SCALE * window_size.y);
+  set_render_scale(render_scale);
+  glGenFramebuffers(1, &target_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, target_framebuffer);
 
-  glGenTextures(1, &COLOR_TARGET_TEXTURE);
-  glBindTexture(GL_TEXTURE_2D, COLOR_TARGET_TEXTURE);
+  glGenTextures(1, &color_target_texture);
+  glBindTexture(GL_TEXTURE_2D, color_target_texture);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.x, size.y, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, 0);
-
-  glGenTextures(1, &PREV_COLOR_TARGET);
-  glBindTexture(GL_TEXTURE_2D, PREV_COLOR_TARGET);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  // shaders write linear color, the ROPs encode it
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, allocated_size.x,
+               allocated_size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+
+  glGenTextures(1, &velocity_target_texture);
+  glBindTexture(GL_TEXTURE_2D, velocity_target_texture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, size.x, size.y, 0, GL_RGBA,
-               GL_UNSIGNED_BYTE, 0);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, allocated_size.x, allocated_size.y,
+               0, GL_RG, GL_FLOAT, 0);
 
-  glFramebufferTexture(GL_FRAMEBUFFER, DIFFUSE_TARGET, COLOR_TARGET_TEXTURE, 0);
+  glFramebufferTexture(GL_FRAMEBUFFER, DIFFUSE_TARGET, color_target_texture, 0);
+  glFramebufferTexture(GL_FRAMEBUFFER, VELOCITY_TARGET,
+                       velocity_target_texture, 0);
   glDrawBuffers(TARGET_COUNT, RENDER_TARGETS);
-  glGenRenderbuffers(1, &DEPTH_TARGET_TEXTURE);
-  glBindRenderbuffer(GL_RENDERBUFFER, DEPTH_TARGET_TEXTURE);
-  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, size.x, size.y);
+  glGenRenderbuffers(1, &depth_target_texture);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth_target_texture);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, allocated_size.x,
+                        allocated_size.y);
   glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                            GL_RENDERBUFFER, DEPTH_TARGET_TEXTURE);
-
-  PREV_COLOR_TARGET_MISSING = true;
+                            GL_RENDERBUFFER, depth_target_texture);
 
-  set_message("Init FBO", s(TARGET_FRAMEBUFFER));
-  set_message("Init Textures",
-              s(COLOR_TARGET_TEXTURE) + " " + s(PREV_COLOR_TARGET));
-  set_message("Init renderbuffers", s(DEPTH_TARGET_TEXTURE));
+  check_FBO_status();
 
+  // TXAA history is always at window size, the render target is upsampled
+  // into it
+  glGenTextures(2, &history_targets[0]);
+  for (uint32 i = 0; i < 2; ++i)
+  {
+    glBindTexture(GL_TEXTURE_2D, history_targets[i]);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_SRGB8_ALPHA8, window_size.x,
+                 window_size.y, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  }
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glGenFramebuffers(1, &history_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, history_framebuffer);
+  glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+                       history_targets[history_index], 0);
   check_FBO_status();
+  history_missing = true;
+
+  set_message("Init FBOs", s(target_framebuffer, " ", history_framebuffer));
+  set_message("Init Textures",
+              s(color_target_texture, " ", velocity_target_texture, " ",
+                history_targets[0], " ", history_targets[1]));
+  set_message("Init renderbuffers", s(depth_target_texture));
 
   glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// PID controller on gpu time, which doesn't include vsync or the cpu waiting
+// for the gpu, so it's a direct measure of how much the current resolution
+// costs
+// gpu time scales roughly with pixel count, so the error is driven through
+// the square root to act on render_scale linearly
 void Render::dynamic_framerate_target()
 {
-  // early out if we don't have enough samples to go by
-  const uint32 min_samples = 5;
-  // percent of frame+swap samples must be > target_time to downscale
-  const float32 reduce_threshold = 0.35f;
-  // render scale multiplication factors when changing resolution
-  const float32 reduction_factor = 0.85f;
-  const float32 increase_factor = 1.08f;
-  // gives a little extra time before swap+frame > 1/hz counts as a missed vsync
-  // not entirely sure why this is necessary, but at 0 swap+frame is almost
-  // always > 1/hz
-  // driver overhead and/or timer overhead inaccuracies
-  const float64 epsilon = 0.005;
-  // if swap alone took longer than this, we should increase the resolution
-  // because we probably had a lot of extra gpu time because this blocked for so
-  // long
-  // not sure if there's a better way to find idle gpu use
-  const float64 longest_swap_allowable = target_frame_time * .35;
-
-  if (FRAME_TIMER.sample_count() < min_samples ||
-      SWAP_TIMER.sample_count() < min_samples)
-  { // don't adjust until we have good avg frame time data
+  // leave some of the frame for the driver, compositor and timer noise
+  const float64 target = 0.85 * target_frame_time;
+  const float64 kp = 0.5;
+  const float64 ki = 0.05;
+  const float64 kd = 0.1;
+  const float64 integral_limit = 2.0;
+  // drop resolution quickly, recover slowly
+  const float64 max_decrease = 0.15;
+  const float64 max_increase = 0.03;
+
+  if (gpu_timer_samples == last_controller_sample)
+    return; // no new gpu timing data
+  last_controller_sample = gpu_timer_samples;
+
+  const float64 gpu_time = gpu_scene_time + gpu_post_time;
+  if (gpu_time <= 0.0)
     return;
-  }
-  // ALL time other than swap time
-  const float64 moving_avg = FRAME_TIMER.moving_average();
-  const float64 last_frame = FRAME_TIMER.get_last();
 
-  // ONLY swap time
-  const float64 last_swap = SWAP_TIMER.get_last();
-  const float64 swap_avg = SWAP_TIMER.moving_average();
+  const float64 error = sqrt(target / gpu_time) - 1.0;
+  resolution_error_integral =
+      clamp(resolution_error_integral + error, -integral_limit, integral_limit);
+  const float64 derivative = error - last_resolution_error;
+  last_resolution_error = error;
 
-  auto frame_times = FRAME_TIMER.get_times();
-  auto swap_times = SWAP_TIMER.get_times();
-  ASSERT(frame_times.size() == swap_times.size());
-  uint32 num_high_frame_times = 0;
-  for (uint32 i = 0; i < frame_times.size(); ++i)
-  {
-    const float64 swap = swap_times[i];
-    const float64 frame = frame_times[i];
-    const bool high = swap + frame > target_frame_time + epsilon;
-    num_high_frame_times += int32(high);
-  }
-  float32 percent_high = float32(num_high_frame_times) / frame_times.size();
+  float64 adjustment =
+      kp * error + ki * resolution_error_integral + kd * derivative;
+  adjustment = clamp(adjustment, -max_decrease, max_increase);
+  set_render_scale(render_scale * float32(1.0 + adjustment));
 
-  if (percent_high > reduce_threshold)
-  {
-    set_message(
-        "Number of missed frames over threshold. Reducing resolution.: ",
-        std::to_string(percent_high) + " " + std::to_string(target_frame_time));
-    set_render_scale(render_scale * reduction_factor);
+  // a pinned scale would otherwise wind the integral up
+  if (render_scale == MIN_RENDER_SCALE || render_scale == MAX_RENDER_SCALE)
+    resolution_error_integral -= error;
+}
 
-    // we need to clear the timers because the render scale change
-    // means the old times arent really valid anymore - different res
-    // frame_timer is currently running so we
-    // must get the time it logged for the current
-    // frame start, and put it back when we restart
-    uint64 last_start = FRAME_TIMER.get_begin();
-    SWAP_TIMER.clear_all();
-    FRAME_TIMER.clear_all();
-    FRAME_TIMER.start(last_start);
-  }
-  else if (swap_avg > longest_swap_allowable)
+static float32 halton(uint32 i, uint32 base)
+{
+  float32 f = 1.0f;
+  float32 result = 0.0f;
+  while (i > 0)
   {
-    if (render_scale != 2.0) // max scale 2.0
-    {
-      float64 change_rate = .45;
-      if (get_real_time() < time_of_last_scale_change + change_rate)
-      { // increase resolution slowly
-        return;
-      }
-      set_message("High avg swap. Increasing resolution.",
-                  std::to_string(swap_avg) + " " +
-                      std::to_string(target_frame_time));
-      set_render_scale(render_scale * increase_factor);
-      uint64 last_start = FRAME_TIMER.get_begin();
-      SWAP_TIMER.clear_all();
-      FRAME_TIMER.clear_all();
-      FRAME_TIMER.start(last_start);
-    }
+    f = f / base;
+    result += f * (i % base);
+    i = i / base;
   }
+  return result;
 }
 
-mat4 Render::get_next_TXAA_sample()
+// subpixel offset in render target pixels, [-0.5,0.5]
+// halton(2,3) covers the pixel well enough for the history to resolve detail
+// finer than the render target when it's smaller than the window
+vec2 Render::get_next_TXAA_sample()
 {
-  vec2 translation;
-  if (jitter_switch)
-    translation = vec2(0.5, 0.5);
-  else
-    translation = vec2(-0.5, -0.5);
-
-  mat4 result = glm::translate(vec3(translation / vec2(size), 0));
-  jitter_switch = !jitter_switch;
-  return result;
+  const uint32 sample_count = 16;
+  jitter_index = (jitter_index + 1) % sample_count;
+  return vec2(halton(jitter_index + 1, 2), halton(jitter_index + 1, 3)) -
+         vec2(0.5f);
 }
 
 Mesh_Handle::~Mesh_Handle()
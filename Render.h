@@ -1,6 +1,7 @@
 #pragma once
 #include "Globals.h"
 #include "Mesh_Loader.h"
+#include "Occlusion_Buffer.h"
 #include "Shader.h"
 #include "stb_image.h"
 #include <SDL2/SDL.h>
@@ -21,34 +22,78 @@
 #include <unordered_map>
 #include <vector>
 
+struct Baked_Model;
+
 void INIT_RENDERER();
 void CLEANUP_RENDERER();
+// blocks until every texture that started loading has been uploaded
+void finish_texture_streaming();
 
 using namespace glm;
+// textures are layers of GL_TEXTURE_2D_ARRAYs shared by every texture of
+// the same size and format, so materials share bindings and differ only in
+// the layer indices
+struct Texture_Layer
+{
+  GLuint array = 0;
+  uint32 layer = 0;
+};
 struct Texture_Handle
 {
   ~Texture_Handle();
-  GLuint texture = 0;
-  time_t file_mod_t = 0;
+  Texture_Layer texture; // no array until the file has streamed in
+  // bound until then, owned by the renderer
+  Texture_Layer placeholder;
+  // what it was first loaded with, reloads use the same
+  std::string file_path;
+  GLenum storage_type = GL_RGBA;
+  uint8 alpha_override = 0;
+  bool process_premultiply = false;
+  bool process_override_alpha = false;
+  bool normal_map = false;
 };
 struct Texture
 {
   Texture();
-  Texture(std::string path);
+  // placeholder is sampled until the file has streamed in, packed like
+  // string_to_color()
+  // srgb textures are decoded to linear by the texture unit when sampled,
+  // for colors - data like normals stays linear
+  Texture(std::string path, Uint32 placeholder = 0, bool normal_map = false,
+          bool srgb = false);
 
 private:
   friend struct Render;
   friend struct Material;
   void load();
-  void bind(const char *name, GLuint location, Shader &shader);
+  // what to bind now, the placeholder while streaming
+  // null handles are constants in the shader and aren't bound
+  Texture_Layer get_layer() const;
   std::shared_ptr<Texture_Handle> texture;
   std::string file_path;
+  Uint32 placeholder = 0;
+  // compressed to two channels, the shader rebuilds z
+  bool normal_map = false;
 
   GLenum storage_type = GL_RGBA;
   uint8 alpha_override = 0;
   bool process_premultiply = false;
   bool process_override_alpha = false;
 };
+// a range of the index buffer
+struct Mesh_Lod
+{
+  GLuint first_index;
+  GLuint index_count;
+};
+// positions and the full mesh's indices, for cpu side work like occlusion
+struct Mesh_Geometry
+{
+  std::vector<vec3> positions;
+  std::vector<uint32> indices;
+};
+// only the gl objects, bounds and counts stay resident, the vertex data
+// lives in the buffers
 struct Mesh_Handle
 {
   ~Mesh_Handle();
@@ -60,23 +105,47 @@ struct Mesh_Handle
   GLuint bitangents_buffer = 0;
   GLuint indices_buffer = 0;
   GLuint indices_buffer_size = 0;
-  Mesh_Data data;
+  // GL_UNSIGNED_SHORT whenever the vertex count allows it
+  GLenum index_type = GL_UNSIGNED_INT;
+  uint32 index_size = sizeof(uint32);
+  // [0] is the full mesh, then Mesh_Data::lod_indices
+  std::vector<Mesh_Lod> lods;
+  uint32 vertex_count = 0;
+  // model space bounding box
+  vec3 bounds_min = vec3(0);
+  vec3 bounds_max = vec3(0);
+  // a cpu copy of positions and indices, only for meshes made with
+  // keep_geometry, see Mesh::get_geometry()
+  std::unique_ptr<Mesh_Geometry> geometry;
 };
 
 struct Mesh
 {
   Mesh();
   Mesh(Mesh_Primitive p, std::string mesh_name);
-  Mesh(Mesh_Data mesh_data, std::string mesh_name);
+  // keep_geometry keeps the positions and indices on the cpu too
+  Mesh(const Mesh_Data &mesh_data, std::string mesh_name,
+       bool keep_geometry = false);
   Mesh(const aiMesh *aimesh, std::string unique_identifier);
+  // uploads straight from the mapped file
+  Mesh(const Baked_Model &model, uint32 index, std::string unique_identifier);
   void bind_to_shader(Shader &shader);
   GLuint get_vao() { return mesh->vao; }
   GLuint get_indices_buffer() { return mesh->indices_buffer; }
   GLuint get_indices_buffer_size() { return mesh->indices_buffer_size; }
-  std::string name = "NULL";
+  GLenum get_index_type() { return mesh->index_type; }
+  uint32 get_index_size() { return mesh->index_size; }
+  uint32 get_lod_count() { return mesh->lods.size(); }
+  const Mesh_Lod &get_lod(uint32 lod) { return mesh->lods[lod]; }
+  // only for meshes made with keep_geometry
+  const Mesh_Geometry &get_geometry();
+  Symbol name = "NULL";
   // private:
-  std::string unique_identifier = "NULL";
-  std::shared_ptr<Mesh_Handle> upload_data(const Mesh_Data &data);
+  Symbol unique_identifier = "NULL";
+  std::shared_ptr<Mesh_Handle> upload_data(const Mesh_Data &data,
+                                           bool keep_geometry = false);
+  std::shared_ptr<Mesh_Handle> upload_baked(const Baked_Model &model,
+                                            uint32 index);
   std::shared_ptr<Mesh_Handle> mesh;
 };
 
@@ -84,7 +153,7 @@ struct Material_Descriptor
 {
   std::string albedo;
   std::string roughness;
-  std::string specular;  // specular color for conductors   - unused for now
+  std::string specular;  // specular color map
   std::string metalness; // boolean conductor or insulator - unused for now
   std::string tangent;   // anisotropic surface roughness    - unused for now
   std::string normal;
@@ -94,31 +163,75 @@ struct Material_Descriptor
   std::string frag_shader = "fragment_shader.frag";
   vec2 uv_scale = vec2(1);
   uint8 albedo_alpha_override = 0;
+  // which maps hold srgb encoded colors rather than linear data, normal
+  // maps are always linear
+  bool albedo_srgb = true;
+  bool emissive_srgb = true;
+  // roughness is data, set this only for a map that was saved as an srgb
+  // image and has to be decoded
+  bool roughness_srgb = false;
+  // linear values used where a map's path is empty or a "color(r,g,b,a)"
+  // string, as uniforms with no texture bound
+  vec4 albedo_constant = vec4(0);
+  vec3 emissive_constant = vec3(0);
+  float32 roughness_constant = 0.0f;
   bool backface_culling = true;
   bool uses_transparency = false;
   // when adding new things here, be sure to add them in the
-  // material constructor override section
+  // material constructor override section, operator== and hash()
+  bool operator==(const Material_Descriptor &rhs) const;
+  uint64 hash() const;
 };
 
+// the maps an imported material names, prefixed with working_directory
+Material_Descriptor import_material(aiMaterial *ai_material,
+                                    std::string working_directory);
+
+// shared by every Material loaded from an equal descriptor
+struct Material_Handle
+{
+  // unique for the life of the program, never reused
+  uint32 ID = 0;
+  Texture albedo;
+  Texture specular;
+  Texture normal;
+  Texture emissive;
+  Texture roughness;
+  // #defines for the textures whose files exist and transparency
+  std::string defines;
+  // indexed by light type mask, one bit per Light_Type
+  std::array<Shader, 8> shaders;
+  // albedo only, all light types, compiled synchronously
+  Shader fallback;
+  // resolved, color() maps are already constants
+  Material_Descriptor m;
+};
+
+// materials are cached by their resolved descriptor, so loading one that
+// already exists only takes a reference to it
 struct Material
 {
   Material();
   Material(Material_Descriptor m);
   Material(aiMaterial *ai_material, std::string working_directory,
            Material_Descriptor *material_override);
+  // m with the paths and settings of material_override applied
+  Material(Material_Descriptor m, Material_Descriptor *material_override);
+  uint32 get_ID() const { return material->ID; }
 
 private:
   friend struct Render;
   void load(Material_Descriptor m);
-  void bind();
+  // binds the arrays to the Texture_Location units and sets texture_layers
+  // bound_arrays holds what each unit has and skips those already right
+  void bind(Shader &shader, GLuint *bound_arrays = nullptr);
   void unbind_textures();
-  Texture albedo;
-  // Texture specular_color;
-  Texture normal;
-  Texture emissive;
-  Texture roughness;
-  Shader shader;
-  Material_Descriptor m;
+  // the permutation for this material and a mask of (1 << Light_Type)
+  // the first call starts compiling it, until it's ready this returns a
+  // generic fallback for the material
+  // async false compiles the permutation right here, blocking
+  Shader &get_shader(uint32 light_types, bool async = true);
+  std::shared_ptr<Material_Handle> material;
 };
 
 enum Light_Type
@@ -154,13 +267,20 @@ struct Light_Array
 struct Render_Entity
 {
   Render_Entity(Mesh *mesh, Material *material, Light_Array lights,
-                mat4 world_to_model);
+                mat4 world_to_model, uint32 ID = 0);
   Light_Array lights;
   mat4 transformation;
+  // transformation of the entity with the same ID last frame, used for
+  // motion vectors - equal to transformation if it wasn't drawn last frame
+  mat4 previous_transformation;
   Mesh *mesh;
   Material *material;
-  std::string name;
+  Symbol name; // of the node it came from
   uint32 ID;
+  // drawn into the cpu occlusion buffer, see Scene_Graph_Node::occluder
+  bool occluder = false;
+  // index into mesh->lods, chosen by Render from the projected size
+  uint32 lod = 0;
 };
 // Similar to Render_Entity, but rendered with instancing
 struct Render_Instance
@@ -172,16 +292,59 @@ struct Render_Instance
   std::vector<mat4> MVP_Matrices;
   std::vector<mat4> Model_Matrices;
 };
+// GL_TIME_ELAPSED queries, one set per frame, read back once they're
+// available so they never stall - one more slot than frames in flight
+// guarantees the slot being reused has already been fenced
+enum Gpu_Timer_Pass
+{
+  scene_timer, // opaque, instance, translucent
+  post_timer,  // TXAA/passthrough to the window
+  gpu_timer_pass_count
+};
+#define GPU_TIMER_FRAMES (MAX_FRAMES_IN_FLIGHT + 1)
+
 struct Render
 {
   Render(SDL_Window *window, ivec2 window_size);
+  ~Render();
+  Render(const Render &) = delete;
+  Render &operator=(const Render &) = delete;
   void render(float64 state_time);
 
   bool use_txaa = false;
+  // true: cpu may run ahead of the gpu by up to frames_in_flight frames,
+  // throttled with fences
+  // false: glFinish() before and after every swap
+  bool use_fence_pacing = true;
+  // false: material permutations compile on first use and block the frame,
+  // for comparing hitches against the async path
+  bool use_async_shaders = true;
+  void set_frames_in_flight(uint32 count); // clamped to [1,MAX_FRAMES_IN_FLIGHT]
+  uint32 get_frames_in_flight() const { return frames_in_flight; }
+  std::string frame_timing_report();
+  // scene+post gpu time of the newest finished frame, unsmoothed
+  float64 get_last_gpu_frame_time() const { return last_gpu_frame_time; }
+  // deterministic output for headless runs: shader time comes from the
+  // simulation clock and the render scale is left alone
+  bool benchmark_mode = false;
+  // where the final image goes, 0 is the window
+  GLuint output_framebuffer = 0;
+  // swap in simplified meshes for small objects
+  bool use_lods = true;
+  // hides entities behind the occluder entities, tested on the cpu
+  bool use_occlusion_culling = true;
+  uint32 occlusion_culled_last_frame = 0;
+  // saves every presented frame as a png sequence, the readback is
+  // asynchronous so this costs little frame time
+  bool capture_frames = false;
   void resize_window(ivec2 window_size);
   float32 get_render_scale() const { return render_scale; }
   float32 get_vfov() { return vfov; }
   void set_render_scale(float32 scale);
+  // the next frame starts a new TXAA history and jitter sequence and has no
+  // motion vectors, for when the frames before it weren't drawn, like a
+  // paused state
+  void invalidate_history();
   void set_camera(vec3 camera_pos, vec3 dir);
   void set_camera_gaze(vec3 camera_pos, vec3 p);
   void set_vfov(float32 vfov); // vertical field of view in degrees
@@ -201,20 +364,60 @@ private:
   // std::vector<Render_Instance> translucent_instances;
 
   void opaque_pass(float32 time);
+  void record_draw_commands(uint32 first, uint32 count, uint32 job);
   void instance_pass(float32 time);
   void translucent_pass(float32 time);
-  float64 time_of_last_scale_change = 0.;
+  void present();
+  void capture_frame();
+  void wait_for_frames_in_flight();
+  void read_gpu_timers();
+  uint32 frames_in_flight = FRAMES_IN_FLIGHT;
+  // one fence per frame, slot is frame_count % MAX_FRAMES_IN_FLIGHT
+  GLsync frame_fences[MAX_FRAMES_IN_FLIGHT] = {};
+  // slot is frame_count % GPU_TIMER_FRAMES
+  GLuint gpu_timer_queries[GPU_TIMER_FRAMES][gpu_timer_pass_count] = {};
+  bool gpu_timer_pending[GPU_TIMER_FRAMES] = {};
+  // smoothed GL_TIME_ELAPSED results in seconds
+  float64 gpu_scene_time = 0.;
+  float64 gpu_post_time = 0.;
+  float64 last_gpu_frame_time = 0.;
+  uint64 gpu_timer_samples = 0;
+  // dynamic_framerate_target controller state
+  uint64 last_controller_sample = 0;
+  float64 resolution_error_integral = 0.;
+  float64 last_resolution_error = 0.;
+  uint32 select_lod(const Render_Entity &entity, uint32 current);
+  void occlusion_cull();
+  Occlusion_Buffer occlusion_buffer;
   void init_render_targets();
+  void delete_render_targets();
+  GLuint target_framebuffer = 0; // fbo that gets rendered to
+  // bound to target_framebuffer
+  GLuint color_target_texture = 0;
+  GLuint depth_target_texture = 0;
+  // screen space motion vectors in uv units, current - previous
+  GLuint velocity_target_texture = 0;
+  // TXAA accumulation buffers at window size, ping-ponged every frame
+  GLuint history_framebuffer = 0;
+  GLuint history_targets[2] = {0, 0};
+  uint32 history_index = 0; // the one being written this frame
+  bool history_missing = true;
   void dynamic_framerate_target();
-  mat4 get_next_TXAA_sample();
+  void temporalaa_pass(const mat4 &o);
+  vec2 get_next_TXAA_sample();
   float32 render_scale = 0.75f; // supersampling
   ivec2 window_size;            // actual window size
   ivec2 size;                   // render target size
+  ivec2 allocated_size;         // render target size at the max render scale
   float32 vfov = 60;
   mat4 camera;
   mat4 projection;
+  // camera and projection that the last frame was drawn with
+  mat4 previous_camera;
+  mat4 previous_projection;
   vec3 camera_position = vec3(0);
   vec3 prev_camera_position = vec3(0);
-  bool jitter_switch = false;
+  uint32 jitter_index = 0;
+  vec2 txaa_jitter_offset = vec2(0); // in render target pixels
   mat4 txaa_jitter = mat4(1);
 };
@@ -54,13 +54,13 @@ Render_Test_State::Render_Test_State(std::string name, SDL_Window *window,
       mat4 t = translate(vec3(x, y, 0.0));
       mat4 s = scale(vec3(0.25));
       mat4 basis = t * s;
-      chests.push_back(scene.add_aiscene("Chest/Chest.obj", &basis));
+      chests.push_back(scene.add_aiscene_async("Chest/Chest.obj", &basis));
     }
   }
 
   Material_Descriptor tiger_mat;
   tiger_mat.backface_culling = false;
-  tiger = scene.add_aiscene("tiger/tiger.obj", &tiger_mat);
+  tiger = scene.add_aiscene_async("tiger/tiger.obj", nullptr, &tiger_mat);
 
   material.albedo = "color(255,255,255,255)";
   material.emissive = "color(255,255,255,255)";
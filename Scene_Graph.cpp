@@ -1,5 +1,7 @@
 #include "Scene_Graph.h"
+#include "Baked_Model.h"
 #include "Globals.h"
+#include "Job_System.h"
 #include "Render.h"
 #include <array>
 #include <assimp/Importer.hpp>
@@ -7,14 +9,28 @@
 #include <assimp/scene.h>
 #include <assimp/types.h>
 #include <atomic>
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <memory>
 #include <thread>
 
 using namespace std;
 
+// called from the async visitor threads too
 uint32 new_ID()
 {
-  static uint32 last = 0;
-  return last += 1;
+  static std::atomic<uint32> last(0);
+  return ++last;
+}
+
+// render entity IDs are handed out lazily, one per model entry, and stay the
+// same for the lifetime of the node so the renderer can match entities across
+// frames
+static void update_entity_IDs(uint32 num_meshes, std::vector<uint32> &ids)
+{
+  while (ids.size() < num_meshes)
+    ids.push_back(new_ID());
 }
 
 glm::mat4 copy(aiMatrix4x4 m)
@@ -32,83 +48,245 @@ glm::mat4 copy(aiMatrix4x4 m)
   return result;
 }
 
-Scene_Graph_Node::Scene_Graph_Node(string name, const mat4 *basis)
+Scene_Graph_Node::Scene_Graph_Node(Symbol name, const mat4 *basis)
 {
   this->name = name;
   if (basis)
     this->import_basis = *basis;
 }
 
-Scene_Graph_Node::Scene_Graph_Node(string name, const aiNode *node,
-                                   const mat4 *import_basis_,
-                                   const aiScene *scene, string scene_file_path,
-                                   Uint32 *mesh_num,
-                                   Material_Descriptor *material_override)
+// by path and import flags
+static map<pair<Symbol, int>, weak_ptr<const Model>> MODEL_CACHE;
+
+// baked file or mesh data bytes update_imports uploads per frame, at least
+// one import
+static const size_t MODEL_UPLOAD_BUDGET = 32 * 1024 * 1024;
+
+// a node waiting on an async import, and the override it was added with
+struct Import_Request
 {
-  ASSERT(node);
-  ASSERT(scene);
-  this->name = name;
-  basis = copy(node->mTransformation);
-  if (import_basis_)
-    import_basis = *import_basis_;
-  size_t slice = scene_file_path.find_last_of("/\\");
-  string dir = scene_file_path.substr(0, slice) + '/';
+  weak_ptr<Scene_Graph_Node> node;
+  bool overridden = false;
+  Material_Descriptor material_override;
+};
+
+// one add_aiscene_async load, filled in by its job and read on the gl thread
+// once done is set
+struct Async_Import
+{
+  vector<Import_Request> requests;
+  atomic<bool> done{false};
+  Baked_Model baked;
+  // only kept if baking failed, the scene is then converted from assimp's
+  // with meshes[i] loaded from scene->mMeshes[i] by the job
+  unique_ptr<Assimp::Importer> importer;
+  const aiScene *scene = nullptr;
+  vector<Mesh_Data> meshes;
+  // set by the first update_imports to upload it, on any scene graph
+  bool uploaded = false;
+  shared_ptr<const Model> model;
+};
+
+// add_aiscene_async imports in flight, by path and flags, so scene graphs
+// adding the same model wait on one import
+static map<pair<Symbol, int>, weak_ptr<Async_Import>> IMPORTS;
+
+// assimp's importer isn't thread safe, every job gets its own
+static void run_async_import(Async_Import *import, string scene_file_path,
+                             int flags)
+{
+  if (open_baked_model(scene_file_path, flags, &import->baked))
+  {
+    import->done = true;
+    return;
+  }
+  set_message("Importing model: ", scene_file_path);
+  import->importer = make_unique<Assimp::Importer>();
+  const string path = BASE_MODEL_PATH + scene_file_path;
+  const aiScene *scene = import->importer->ReadFile(path.c_str(), flags);
+  if (!scene || scene->mFlags == AI_SCENE_FLAGS_INCOMPLETE ||
+      !scene->mRootNode)
+  {
+    set_message("ERROR::ASSIMP::", import->importer->GetErrorString());
+    import->importer.reset();
+  }
+  else if (bake_model(scene, scene_file_path, flags) &&
+           open_baked_model(scene_file_path, flags, &import->baked))
+  {
+    import->importer.reset();
+  }
+  else
+  {
+    set_message("Baking failed for model: ", scene_file_path);
+    import->scene = scene;
+    // the same identifiers convert_scene gives them
+    const string mesh_prefix = path + s("#", flags, "#");
+    import->meshes.reserve(scene->mNumMeshes);
+    for (uint32 i = 0; i < scene->mNumMeshes; ++i)
+      import->meshes.push_back(
+          load_mesh(scene->mMeshes[i], mesh_prefix + to_string(i)));
+  }
+  import->done = true;
+}
+
+static size_t mesh_data_size(const Mesh_Data &data)
+{
+  size_t size = data.positions.size() * sizeof(vec3) +
+                data.normals.size() * sizeof(vec3) +
+                data.texture_coordinates.size() * sizeof(vec2) +
+                data.tangents.size() * sizeof(vec3) +
+                data.bitangents.size() * sizeof(vec3) +
+                data.indices.size() * sizeof(uint32);
+  for (const vector<uint32> &lod : data.lod_indices)
+    size += lod.size() * sizeof(uint32);
+  return size;
+}
 
+// depth first, returns the index of node in model->nodes
+// mesh_prefix + the aiScene mesh index is the mesh's unique identifier
+// meshes, if given, is loaded already, one per aiScene mesh
+static uint32 convert_node(const aiNode *node, const aiScene *scene,
+                           const string &directory, const string &mesh_prefix,
+                           const vector<Mesh_Data> *meshes, Model *model)
+{
+  const uint32 index = model->nodes.size();
+  model->nodes.emplace_back();
+  model->nodes[index].name = copy(&node->mName);
+  model->nodes[index].basis = copy(node->mTransformation);
   for (uint32 i = 0; i < node->mNumMeshes; ++i)
   {
-    auto ai_i = node->mMeshes[i];
+    const uint32 ai_i = node->mMeshes[i];
     const aiMesh *aimesh = scene->mMeshes[ai_i];
-    (*mesh_num) += 1;
-    string unique_id = scene_file_path + to_string(*mesh_num);
-    Mesh mesh(aimesh, unique_id);
+    Mesh mesh = meshes ? Mesh((*meshes)[ai_i], (*meshes)[ai_i].name)
+                       : Mesh(aimesh, mesh_prefix + to_string(ai_i));
     aiMaterial *ptr = scene->mMaterials[aimesh->mMaterialIndex];
-    Material material(ptr, dir, material_override);
-    model.push_back({mesh, material});
+    model->nodes[index].model.push_back(
+        {mesh, import_material(ptr, directory)});
+  }
+  for (uint32 i = 0; i < node->mNumChildren; ++i)
+  {
+    const uint32 child = convert_node(node->mChildren[i], scene, directory,
+                                      mesh_prefix, meshes, model);
+    model->nodes[index].children.push_back(child);
   }
-  owned_children.reserve(node->mNumChildren);
+  return index;
 }
 
-Scene_Graph::Scene_Graph()
+// scene_file_path is relative to BASE_MODEL_PATH
+// meshes, if given, is what run_async_import loaded, only uploaded here
+static shared_ptr<const Model>
+convert_scene(const aiScene *scene, string scene_file_path,
+              const string &mesh_prefix,
+              const vector<Mesh_Data> *meshes = nullptr)
 {
-  root = make_shared<Scene_Graph_Node>("SCENE_GRAPH_ROOT", nullptr);
+  ASSERT(scene);
+  ASSERT(scene->mRootNode);
+  const string root_name = string("ROOT FOR: ") + scene_file_path + " " +
+                           copy(&scene->mRootNode->mName);
+  scene_file_path = BASE_MODEL_PATH + scene_file_path;
+  size_t slice = scene_file_path.find_last_of("/\\");
+  string dir = scene_file_path.substr(0, slice) + '/';
+
+  shared_ptr<Model> model = make_shared<Model>();
+  convert_node(scene->mRootNode, scene, dir, scene_file_path + mesh_prefix,
+               meshes, model.get());
+  model->nodes[0].name = root_name;
+  return model;
 }
-void Scene_Graph::add_graph_node(const aiNode *node,
-                                 weak_ptr<Scene_Graph_Node> parent,
-                                 const mat4 *import_basis,
-                                 const aiScene *aiscene, string scene_file_path,
-                                 Uint32 *mesh_num,
-                                 Material_Descriptor *material_override)
+
+// the same model and mesh identifiers convert_scene gives the import
+static shared_ptr<const Model> convert_baked_model(const Baked_Model &baked,
+                                                   string scene_file_path,
+                                                   const string &mesh_prefix)
 {
-  ASSERT(node);
-  ASSERT(aiscene);
-  string name = copy(&node->mName);
-  // construct just this node in the main node array
-  auto thing = Scene_Graph_Node(name, node, import_basis, aiscene,
-                                scene_file_path, mesh_num, material_override);
+  const Baked_Model_Header &header = *baked.header;
+  const string root_name = string("ROOT FOR: ") + scene_file_path + " " +
+                           baked.string(baked.nodes[0].name);
+  scene_file_path = BASE_MODEL_PATH + scene_file_path;
 
-  shared_ptr<Scene_Graph_Node> new_node = make_shared<Scene_Graph_Node>(
-      name, node, import_basis, aiscene, scene_file_path, mesh_num,
-      material_override);
+  vector<Mesh> meshes;
+  meshes.reserve(header.mesh_count);
+  for (uint32 i = 0; i < header.mesh_count; ++i)
+    meshes.emplace_back(baked, i, scene_file_path + mesh_prefix + to_string(i));
+  vector<Material_Descriptor> materials(header.material_count);
+  for (uint32 i = 0; i < header.material_count; ++i)
+  {
+    const Baked_Material &material = baked.materials[i];
+    materials[i].albedo = baked.string(material.albedo);
+    materials[i].specular = baked.string(material.specular);
+    materials[i].emissive = baked.string(material.emissive);
+    materials[i].normal = baked.string(material.normal);
+    materials[i].ambient_occlusion =
+        baked.string(material.ambient_occlusion);
+    materials[i].roughness = baked.string(material.roughness);
+  }
 
-  set_parent(new_node, parent, true);
+  shared_ptr<Model> model = make_shared<Model>();
+  model->nodes.resize(header.node_count);
+  for (uint32 i = 0; i < header.node_count; ++i)
+  {
+    const Baked_Node &node = baked.nodes[i];
+    Model_Node &result = model->nodes[i];
+    result.name = baked.string(node.name);
+    memcpy(&result.basis[0][0], node.basis, sizeof(node.basis));
+    for (uint32 j = 0; j < node.mesh_count; ++j)
+    {
+      const uint32 mesh = baked.references[node.first_mesh + j];
+      result.model.push_back(
+          {meshes[mesh], materials[baked.meshes[mesh].material]});
+    }
+    result.children.assign(baked.references + node.first_child,
+                           baked.references + node.first_child +
+                               node.child_count);
+  }
+  model->nodes[0].name = root_name;
+  return model;
+}
 
-  // construct all the new node's children, because its constructor doesn't
-  for (uint32 i = 0; i < node->mNumChildren; ++i)
+Scene_Graph::Scene_Graph()
+{
+  root = make_shared<Scene_Graph_Node>("SCENE_GRAPH_ROOT", nullptr);
+}
+void Scene_Graph::fill_model_node(const Node_Ptr &node, const Model &model,
+                                  uint32 index,
+                                  Material_Descriptor *material_override)
+{
+  const Model_Node &source = model.nodes[index];
+  node->name = source.name;
+  node->basis = source.basis;
+  for (auto &entry : source.model)
+    node->model.push_back(
+        {entry.first, Material(entry.second, material_override)});
+  for (uint32 child : source.children)
   {
-    const aiNode *child = node->mChildren[i];
-    add_graph_node(child, new_node, import_basis, aiscene, scene_file_path,
-                   mesh_num, material_override);
+    Node_Ptr child_node =
+        make_shared<Scene_Graph_Node>(Symbol(), &node->import_basis);
+    fill_model_node(child_node, model, child, material_override);
+    set_parent(child_node, node, true);
   }
 }
 
-shared_ptr<Scene_Graph_Node> Scene_Graph::add_mesh(Mesh_Data m,
+Node_Ptr Scene_Graph::add_model(shared_ptr<const Model> model,
+                                const mat4 *import_basis,
+                                Material_Descriptor *material_override)
+{
+  Node_Ptr new_node = make_shared<Scene_Graph_Node>(Symbol(), import_basis);
+  fill_model_node(new_node, *model, 0, material_override);
+  new_node->source = model;
+  set_parent(new_node, this->root, false);
+  return new_node;
+}
+
+shared_ptr<Scene_Graph_Node> Scene_Graph::add_mesh(const Mesh_Data &m,
                                                    Material_Descriptor md,
                                                    string name,
-                                                   const mat4 *import_basis)
+                                                   const mat4 *import_basis,
+                                                   bool occluder)
 {
   shared_ptr<Scene_Graph_Node> node =
       make_shared<Scene_Graph_Node>(name, import_basis);
-  Mesh mesh(m, name);
+  node->occluder = occluder;
+  Mesh mesh(m, name, occluder);
   Material material(md);
   node->model.push_back({mesh, material});
   set_parent(node, root, false);
@@ -165,18 +343,40 @@ void Scene_Graph::set_parent(weak_ptr<Scene_Graph_Node> p,
 
 shared_ptr<Scene_Graph_Node>
 Scene_Graph::add_aiscene(string scene_file_path, const mat4 *import_basis,
-                         Material_Descriptor *material_override)
+                         Material_Descriptor *material_override,
+                         const int *assimp_flags)
 {
-  return add_aiscene(load_aiscene(scene_file_path), scene_file_path,
-                     import_basis, material_override);
+  const int flags = assimp_flags ? *assimp_flags : default_assimp_flags;
+  weak_ptr<const Model> &cached = MODEL_CACHE[{scene_file_path, flags}];
+  shared_ptr<const Model> model = cached.lock();
+  if (!model)
+  {
+    // baked on the first import, after that assimp isn't needed
+    const string mesh_prefix = s("#", flags, "#");
+    Baked_Model baked;
+    if (!open_baked_model(scene_file_path, flags, &baked))
+    {
+      set_message("Importing model: ", scene_file_path);
+      const aiScene *scene = load_aiscene(scene_file_path, &flags);
+      if (!bake_model(scene, scene_file_path, flags) ||
+          !open_baked_model(scene_file_path, flags, &baked))
+      {
+        set_message("Baking failed for model: ", scene_file_path);
+        model = convert_scene(scene, scene_file_path, mesh_prefix);
+      }
+    }
+    if (!model)
+      model = convert_baked_model(baked, scene_file_path, mesh_prefix);
+    cached = model;
+  }
+  return add_model(model, import_basis, material_override);
 }
 
 shared_ptr<Scene_Graph_Node>
 Scene_Graph::add_aiscene(string scene_file_path,
                          Material_Descriptor *material_override)
 {
-  return add_aiscene(load_aiscene(scene_file_path), scene_file_path, nullptr,
-                     material_override);
+  return add_aiscene(scene_file_path, nullptr, material_override);
 }
 
 shared_ptr<Scene_Graph_Node>
@@ -184,29 +384,114 @@ Scene_Graph::add_aiscene(const aiScene *scene, string scene_file_path,
                          const mat4 *import_basis,
                          Material_Descriptor *material_override)
 {
-  // accumulates as meshes are imported, used along with the scene file path
-  // to create a unique_id for the mesh
-  Uint32 mesh_num = 0;
-  const aiNode *root = scene->mRootNode;
-
-  // create the root node for this scene
-  string name =
-      string("ROOT FOR: ") + scene_file_path + " " + copy(&root->mName);
-  scene_file_path = BASE_MODEL_PATH + scene_file_path;
-  shared_ptr<Scene_Graph_Node> new_node = make_shared<Scene_Graph_Node>(
-      name, root, import_basis, scene, scene_file_path, &mesh_num,
-      material_override);
-  set_parent(new_node, this->root, false);
+  return add_model(convert_scene(scene, scene_file_path, "#"), import_basis,
+                   material_override);
+}
 
-  // add every aiscene child to the new node
-  const uint32 num_children = scene->mRootNode->mNumChildren;
-  for (uint32 i = 0; i < num_children; ++i)
+shared_ptr<Scene_Graph_Node>
+Scene_Graph::add_aiscene_async(string scene_file_path, const mat4 *import_basis,
+                               Material_Descriptor *material_override,
+                               const int *assimp_flags)
+{
+  const int flags = assimp_flags ? *assimp_flags : default_assimp_flags;
+  shared_ptr<const Model> model = MODEL_CACHE[{scene_file_path, flags}].lock();
+  if (model)
+    return add_model(model, import_basis, material_override);
+
+  Node_Ptr node = make_shared<Scene_Graph_Node>(
+      string("LOADING: ") + scene_file_path, import_basis);
+  set_parent(node, this->root, false);
+
+  Import_Request request;
+  request.node = node;
+  if (material_override)
   {
-    const aiNode *node = scene->mRootNode->mChildren[i];
-    add_graph_node(node, new_node, import_basis, scene, scene_file_path,
-                   &mesh_num, material_override);
+    request.overridden = true;
+    request.material_override = *material_override;
+  }
+  shared_ptr<Async_Import> &import = imports[{scene_file_path, flags}];
+  if (!import)
+  {
+    weak_ptr<Async_Import> &shared = IMPORTS[{scene_file_path, flags}];
+    import = shared.lock();
+    if (!import)
+    {
+      shared = import = make_shared<Async_Import>();
+      // the job keeps it alive if every scene graph goes first
+      shared_ptr<Async_Import> job_import = import;
+      get_job_system().submit([job_import, scene_file_path, flags]() {
+        run_async_import(job_import.get(), scene_file_path, flags);
+      });
+    }
+  }
+  import->requests.push_back(request);
+  return node;
+}
+
+void Scene_Graph::update_imports(bool finish)
+{
+  size_t uploaded = 0;
+  while (!imports.empty())
+  {
+    auto i = imports.begin();
+    for (; i != imports.end(); ++i)
+    {
+      if (i->second->done)
+        break;
+    }
+    if (i == imports.end())
+    {
+      if (!finish)
+        return;
+      this_thread::sleep_for(chrono::milliseconds(1));
+      continue;
+    }
+    shared_ptr<Async_Import> import = i->second;
+    if (!import->uploaded && !finish && uploaded >= MODEL_UPLOAD_BUDGET)
+      return;
+
+    const string scene_file_path = i->first.first.str();
+    const int flags = i->first.second;
+    imports.erase(i);
+
+    if (!import->uploaded)
+    {
+      const string mesh_prefix = s("#", flags, "#");
+      if (import->baked.header)
+      {
+        import->model =
+            convert_baked_model(import->baked, scene_file_path, mesh_prefix);
+        uploaded += import->baked.file->size;
+      }
+      else if (import->scene)
+      {
+        import->model = convert_scene(import->scene, scene_file_path,
+                                      mesh_prefix, &import->meshes);
+        for (const Mesh_Data &data : import->meshes)
+          uploaded += mesh_data_size(data);
+      }
+      import->importer.reset();
+      import->meshes.clear();
+      import->uploaded = true;
+      IMPORTS.erase({scene_file_path, flags});
+      if (import->model)
+        MODEL_CACHE[{scene_file_path, flags}] = import->model;
+    }
+
+    // every waiting node, whichever scene graph added it
+    const shared_ptr<const Model> &model = import->model;
+    for (Import_Request &request : import->requests)
+    {
+      Node_Ptr node = request.node.lock();
+      if (!node || !model)
+        continue;
+      Material_Descriptor *material_override =
+          request.overridden ? &request.material_override : nullptr;
+      fill_model_node(node, *model, 0, material_override);
+      node->source = model;
+    }
+    import->requests.clear();
   }
-  return new_node;
 }
 void Scene_Graph::visit_nodes(const weak_ptr<Scene_Graph_Node> node_ptr,
                               const mat4 &M, vector<Render_Entity> &accumulator)
@@ -229,13 +514,19 @@ void Scene_Graph::visit_nodes(const weak_ptr<Scene_Graph_Node> node_ptr,
   affected_lights.light_count = lights.light_count;
 
   const uint32 num_meshes = entity->model.size();
+  update_entity_IDs(num_meshes, entity->entity_IDs);
   for (uint32 i = 0; i < num_meshes; ++i)
   {
     Mesh *mesh_ptr = &entity->model[i].first;
     Material *material_ptr = &entity->model[i].second;
 
     if (entity->visible)
-      accumulator.emplace_back(mesh_ptr, material_ptr, affected_lights, FINAL);
+    {
+      accumulator.emplace_back(mesh_ptr, material_ptr, affected_lights, FINAL,
+                               entity->entity_IDs[i]);
+      accumulator.back().occluder = entity->occluder;
+      accumulator.back().name = entity->name;
+    }
   }
   for (auto i = entity->unowned_children.begin();
        i != entity->unowned_children.end();)
@@ -279,6 +570,7 @@ void Scene_Graph::visit_nodes_locked_accumulator(
   affected_lights.light_count = lights.light_count;
 
   const int num_meshes = entity->model.size();
+  update_entity_IDs(num_meshes, entity->entity_IDs);
   for (int i = 0; i < num_meshes; ++i)
   {
     Mesh *mesh_ptr = &entity->model[i].first;
@@ -287,7 +579,12 @@ void Scene_Graph::visit_nodes_locked_accumulator(
     { /*spin*/
     }
     if (entity->visible)
-      accumulator->emplace_back(mesh_ptr, material_ptr, affected_lights, FINAL);
+    {
+      accumulator->emplace_back(mesh_ptr, material_ptr, affected_lights, FINAL,
+                                entity->entity_IDs[i]);
+      accumulator->back().occluder = entity->occluder;
+      accumulator->back().name = entity->name;
+    }
 
     lock->clear();
   }
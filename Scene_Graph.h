@@ -7,7 +7,9 @@
 #include <assimp/types.h>
 #include <atomic>
 #include <glm/glm.hpp>
+#include <map>
 #include <unordered_map>
+struct Async_Import;
 struct Material;
 struct Material_Descriptor;
 struct Scene_Graph;
@@ -15,14 +17,29 @@ struct Scene_Graph_Node;
 
 typedef std::shared_ptr<Scene_Graph_Node> Node_Ptr;
 
+// a node of an imported scene, converted to what Scene_Graph needs
+struct Model_Node
+{
+  Symbol name;
+  // assimp's import mtransformation
+  mat4 basis = mat4(1);
+  // materials are kept as descriptors, every add_aiscene can override them
+  std::vector<std::pair<Mesh, Material_Descriptor>> model;
+  std::vector<uint32> children; // indices into Model::nodes
+};
 
-
-
+// an imported scene, so adding more copies of it touches neither the disk
+// nor assimp
+// cached by path and import flags for as long as a node made from it lives
+struct Model
+{
+  std::vector<Model_Node> nodes; // [0] is the root
+};
 
 struct Scene_Graph_Node
 {
   Scene_Graph_Node() {}
-  std::string name;
+  Symbol name;
   vec3 position = {0, 0, 0};
   quat orientation;
   vec3 scale = {1, 1, 1};
@@ -35,11 +52,12 @@ struct Scene_Graph_Node
   // tree, or just this specific node
   bool propagate_visibility = true;
 
-  Scene_Graph_Node(std::string name, const mat4 *import_basis = nullptr);
-  Scene_Graph_Node(std::string name, const aiNode *node,
-                   const mat4 *import_basis_, const aiScene *scene,
-                   std::string scene_path, Uint32 *mesh_num,
-                   Material_Descriptor *material_override);
+  // large opaque geometry that hides what's behind it, rasterized on the cpu
+  // for occlusion culling - keep these few and low poly
+  // set by add_mesh, which keeps the geometry this needs
+  bool occluder = false;
+
+  Scene_Graph_Node(Symbol name, const mat4 *import_basis = nullptr);
 
 protected:
   friend Scene_Graph;
@@ -54,8 +72,14 @@ protected:
 
   std::weak_ptr<Scene_Graph_Node> parent;
 
+  // set on the root node of an import, keeps its cache entry alive
+  std::shared_ptr<const Model> source;
+
   std::vector<std::shared_ptr<Scene_Graph_Node>> owned_children;
   std::vector<std::weak_ptr<Scene_Graph_Node>> unowned_children;
+
+  // Render_Entity::ID for each element of model, assigned on first visit
+  std::vector<uint32> entity_IDs;
 };
 
 struct Scene_Graph
@@ -70,29 +94,49 @@ struct Scene_Graph
                   std::weak_ptr<Scene_Graph_Node> desired_parent,
                   bool parent_owned = false);
 
+  // only the first add of a path and flags imports it, see Model
   std::shared_ptr<Scene_Graph_Node>
   add_aiscene(std::string scene_file_path,
               Material_Descriptor *material_override = nullptr);
 
+  // assimp_flags defaults to default_assimp_flags
   std::shared_ptr<Scene_Graph_Node>
   add_aiscene(std::string scene_file_path, const mat4 *import_basis,
-              Material_Descriptor *material_override = nullptr);
+              Material_Descriptor *material_override = nullptr,
+              const int *assimp_flags = nullptr);
+
+  // returns an empty node at once, the import runs on the job system and
+  // update_imports fills the node in once it's done - until then it has no
+  // meshes or children, so nothing of it is rendered
+  // adds of the same path and flags share one import, across scene graphs
+  std::shared_ptr<Scene_Graph_Node>
+  add_aiscene_async(std::string scene_file_path,
+                    const mat4 *import_basis = nullptr,
+                    Material_Descriptor *material_override = nullptr,
+                    const int *assimp_flags = nullptr);
+
+  // uploads finished async imports into their nodes, call once per frame
+  // from the gl thread, finish waits for every import in flight
+  void update_imports(bool finish = false);
 
+  // converts scene every time, it's the caller's and isn't cached
   std::shared_ptr<Scene_Graph_Node>
   add_aiscene(const aiScene *scene, std::string asset_path,
               const mat4 *import_basis = nullptr,
               Material_Descriptor *material_override = nullptr);
 
   // construct a node using the load_mesh function in Mesh_Loader
-  // does not yet check for nor cache duplicate meshes/materials
+  // meshes are shared by name, materials by their descriptor
   // Node_Ptr will stay valid for as long as the Scene_Graph is alive
   std::shared_ptr<Scene_Graph_Node>
   add_primitive_mesh(Mesh_Primitive p, std::string name, Material_Descriptor m,
                      const mat4 *import_basis = nullptr);
 
+  // occluder sets Scene_Graph_Node::occluder and keeps the mesh's geometry
+  // on the cpu for the occlusion buffer
   std::shared_ptr<Scene_Graph_Node>
-  add_mesh(Mesh_Data m, Material_Descriptor md, std::string name,
-           const mat4 *import_basis = nullptr);
+  add_mesh(const Mesh_Data &m, Material_Descriptor md, std::string name,
+           const mat4 *import_basis = nullptr, bool occluder = false);
 
   // traverse the entire graph, computing the final transformation matrices
   // for each entity, and return all entities flatted into a vector
@@ -110,13 +154,16 @@ struct Scene_Graph
   std::shared_ptr<Scene_Graph_Node> root;
 
 private:
-  // add a Scene_Graph_Node to the Scene_Graph using an aiNode, aiScene, and
-  // parent Node_Ptr
-  void add_graph_node(const aiNode *node,
-                      std::weak_ptr<Scene_Graph_Node> parent,
-                      const mat4 *import_basis, const aiScene *aiscene,
-                      std::string path, Uint32 *mesh_num,
-                      Material_Descriptor *material_override);
+  // makes node model.nodes[index], with new nodes for all of its children
+  void fill_model_node(const Node_Ptr &node, const Model &model,
+                       uint32 index, Material_Descriptor *material_override);
+  Node_Ptr add_model(std::shared_ptr<const Model> model,
+                     const mat4 *import_basis,
+                     Material_Descriptor *material_override);
+
+  // the add_aiscene_async imports this graph has nodes waiting on, by path
+  // and flags - shared with every other graph that adds the same ones
+  std::map<std::pair<Symbol, int>, std::shared_ptr<Async_Import>> imports;
 
   uint32 last_accumulator_size = 0;
 
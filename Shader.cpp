@@ -1,31 +1,264 @@
 #include "Shader.h"
+#include "File_Watcher.h"
 #include "Globals.h"
 #include <SDL2/SDL.h>
+#include <algorithm>
 #include <assimp/types.h>
+#include <cstdio>
 #include <iostream>
 #include <memory>
 #include <unordered_map>
 #include <vector>
 
-static GLuint load_shader(const std::string &vertex_path,
-                          const std::string &fragment_path)
+// #version has to stay the first line
+static std::string insert_defines(const std::string &source,
+                                  const std::string &defines)
+{
+  if (defines.empty())
+    return source;
+  size_t position = 0;
+  if (source.compare(0, 8, "#version") == 0)
+  {
+    position = source.find('\n');
+    if (position == std::string::npos)
+      return source + "\n" + defines;
+    position += 1;
+  }
+  std::string result = source;
+  result.insert(position, defines);
+  return result;
+}
+
+#define PROGRAM_BINARY_MAGIC 0x43425057 // "WPBC"
+
+struct Program_Binary_Header
+{
+  uint32 magic;
+  uint32 format;
+  uint32 size;
+  uint32 padding;
+  uint64 key; // the file name is only part of it
+  float64 compile_time;
+};
+
+// binary cache results for log_program_cache_stats()
+static uint32 PROGRAM_CACHE_HITS = 0;
+static uint32 PROGRAM_CACHE_MISSES = 0;
+static float64 PROGRAM_COMPILE_TIME = 0;
+static float64 PROGRAM_BINARY_LOAD_TIME = 0;
+// what the cache hits took to compile when they were stored
+static float64 PROGRAM_BINARY_SAVED_TIME = 0;
+
+static bool program_binaries_supported()
+{
+  static const bool supported = [] {
+    GLint major = 0;
+    GLint minor = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    glGetIntegerv(GL_MINOR_VERSION, &minor);
+    if (major * 10 + minor < 41 &&
+        !has_gl_extension("GL_ARB_get_program_binary"))
+      return false;
+    GLint formats = 0;
+    glGetIntegerv(gl::GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    return formats > 0;
+  }();
+  return supported;
+}
+
+// fnv-1a of the final sources and the driver that compiles them
+static uint64 program_binary_key(const std::string &vs, const std::string &fs)
+{
+  auto gl_string = [](GLenum name) {
+    const char *result = (const char *)glGetString(name);
+    return std::string(result ? result : "");
+  };
+  static const std::string driver = gl_string(GL_VENDOR) + "\n" +
+                                    gl_string(GL_RENDERER) + "\n" +
+                                    gl_string(GL_VERSION);
+  uint64 hash = hash_bytes(nullptr, 0);
+  for (const std::string *part : {&vs, &fs, &driver})
+  {
+    // the terminator separates the parts, so moving text between them
+    // changes the key
+    hash = hash_bytes(part->c_str(), part->size() + 1, hash);
+  }
+  return hash;
+}
+
+static std::string program_binary_path(uint64 key)
+{
+  char name[24];
+  snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)key);
+  return BASE_CACHE_PATH + "Shaders/" + name;
+}
+
+// returns 0 when there is no usable binary
+static GLuint read_program_binary(uint64 key)
+{
+  std::ifstream file(program_binary_path(key), std::ios::binary);
+  if (!file.is_open())
+    return 0;
+  Program_Binary_Header header;
+  file.read((char *)&header, sizeof(header));
+  if (!file || header.magic != PROGRAM_BINARY_MAGIC || header.key != key)
+    return 0;
+  std::vector<char> binary(header.size);
+  file.read(binary.data(), header.size);
+  if (!file)
+    return 0;
+
+  GLuint program = glCreateProgram();
+  gl::glProgramBinary(program, (GLenum)header.format, binary.data(),
+                      header.size);
+  GLint result = 0;
+  glGetProgramiv(program, GL_LINK_STATUS, &result);
+  if (!result)
+  { // the driver can refuse its own binaries, the file gets replaced
+    set_message("Program binary rejected: ", program_binary_path(key));
+    glDeleteProgram(program);
+    return 0;
+  }
+  PROGRAM_BINARY_SAVED_TIME += header.compile_time;
+  return program;
+}
+
+// every program lookup goes through here, sync or async, so the stats
+// count each one once
+static GLuint load_program_binary(uint64 key)
+{
+  const float64 begin_time = get_real_time();
+  GLuint program = read_program_binary(key);
+  if (!program)
+  {
+    PROGRAM_CACHE_MISSES += 1;
+    return 0;
+  }
+  PROGRAM_CACHE_HITS += 1;
+  PROGRAM_BINARY_LOAD_TIME += get_real_time() - begin_time;
+  return program;
+}
+
+static void save_program_binary(GLuint program, uint64 key,
+                                float64 compile_time)
+{
+  GLint length = 0;
+  glGetProgramiv(program, gl::GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+  std::vector<char> binary(length);
+  GLenum format;
+  gl::glGetProgramBinary(program, length, &length, &format, binary.data());
+
+  create_directories(BASE_CACHE_PATH + "Shaders/");
+  const std::string path = program_binary_path(key);
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+  {
+    set_message("Could not write program binary: ", path);
+    return;
+  }
+  Program_Binary_Header header;
+  header.magic = PROGRAM_BINARY_MAGIC;
+  header.format = (uint32)format;
+  header.size = length;
+  header.padding = 0;
+  header.key = key;
+  header.compile_time = compile_time;
+  file.write((const char *)&header, sizeof(header));
+  file.write(binary.data(), length);
+}
+
+void log_program_cache_stats()
+{
+  set_message("Program binary cache:",
+              s(PROGRAM_CACHE_HITS, " hits in ", PROGRAM_BINARY_LOAD_TIME,
+                "s, saved ",
+                PROGRAM_BINARY_SAVED_TIME - PROGRAM_BINARY_LOAD_TIME,
+                "s. ", PROGRAM_CACHE_MISSES, " compiled in ",
+                PROGRAM_COMPILE_TIME, "s"),
+              5.0);
+}
+
+static bool parallel_compile_supported()
+{
+  static const bool supported = [] {
+    if (!has_gl_extension("GL_KHR_parallel_shader_compile"))
+      return false;
+    // let the driver pick how many threads
+    gl::glMaxShaderCompilerThreadsKHR(0xffffffff);
+    return true;
+  }();
+  return supported;
+}
+
+// vertex + fragment + defines -> program, shared by every Shader using it
+struct Program_Key
+{
+  Symbol vertex;
+  Symbol fragment;
+  Symbol defines;
+  bool operator==(const Program_Key &rhs) const
+  {
+    return vertex == rhs.vertex && fragment == rhs.fragment &&
+           defines == rhs.defines;
+  }
+};
+struct Program_Key_Hash
+{
+  size_t operator()(const Program_Key &key) const
+  {
+    return hash_bytes(&key, sizeof(key));
+  }
+};
+static std::unordered_map<Program_Key, std::weak_ptr<Shader::Shader_Handle>,
+                          Program_Key_Hash>
+    SHADER_CACHE;
+
+// programs that were issued by load_async and haven't been checked yet
+static std::vector<std::weak_ptr<Shader::Shader_Handle>> PENDING_PROGRAMS;
+static uint64 ASYNC_SHADER_FRAME = 0;
+
+// issues the compiles and the link without asking for any results, so a
+// driver with its own compiler threads doesn't make us wait here
+static void begin_program(Shader::Shader_Handle *handle, const std::string &vs,
+                          const std::string &fs)
 {
-  std::string full_vertex_path = BASE_SHADER_PATH + vertex_path;
-  std::string full_fragment_path = BASE_SHADER_PATH + fragment_path;
-  GLuint vert_shader = glCreateShader(GL_VERTEX_SHADER);
-  GLuint frag_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  std::string vs = read_file(full_vertex_path.c_str());
-  std::string fs = read_file(full_fragment_path.c_str());
   const char *vert = vs.c_str();
   const char *frag = fs.c_str();
+  handle->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  handle->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+
+  set_message("Compiling vertex shader: ", handle->vertex_path);
+  set_message("Vertex Shader Source: \n", vs);
+  glShaderSource(handle->vertex_shader, 1, &vert, NULL);
+  glCompileShader(handle->vertex_shader);
+
+  set_message("Compiling fragment shader: ", handle->fragment_path);
+  set_message("Fragment Shader Source: \n", fs);
+  glShaderSource(handle->fragment_shader, 1, &frag, NULL);
+  glCompileShader(handle->fragment_shader);
+
+  set_message("Linking shaders", "");
+  handle->program = glCreateProgram();
+  glAttachShader(handle->program, handle->vertex_shader);
+  glAttachShader(handle->program, handle->fragment_shader);
+  if (program_binaries_supported())
+    gl::glProgramParameteri(handle->program,
+                            gl::GL_PROGRAM_BINARY_RETRIEVABLE_HINT, 1);
+  glLinkProgram(handle->program);
+}
+
+// blocks until the program issued by begin_program is linked, then logs the
+// results and stores the binary, returns false if it didn't compile or link
+static bool finish_program(Shader::Shader_Handle *handle)
+{
+  const float64 begin_time = get_real_time();
   GLint result = 0;
   int logLength;
   bool success = true;
 
-  set_message("Compiling vertex shader: ", vertex_path);
-  set_message("Vertex Shader Source: \n", vs);
-  glShaderSource(vert_shader, 1, &vert, NULL);
-  glCompileShader(vert_shader);
+  GLuint vert_shader = handle->vertex_shader;
   glGetShaderiv(vert_shader, GL_COMPILE_STATUS, &result);
   if (!result)
     success = false;
@@ -34,10 +267,7 @@ static GLuint load_shader(const std::string &vertex_path,
   glGetShaderInfoLog(vert_shader, logLength, NULL, &vertShaderError[0]);
   set_message("Vertex shader compilation result: ", &vertShaderError[0]);
 
-  set_message("Compiling fragment shader: ", fragment_path);
-  set_message("Fragment Shader Source: \n", fs);
-  glShaderSource(frag_shader, 1, &frag, NULL);
-  glCompileShader(frag_shader);
+  GLuint frag_shader = handle->fragment_shader;
   glGetShaderiv(frag_shader, GL_COMPILE_STATUS, &result);
   if (!result)
     success = false;
@@ -46,11 +276,7 @@ static GLuint load_shader(const std::string &vertex_path,
   glGetShaderInfoLog(frag_shader, logLength, NULL, &fragShaderError[0]);
   set_message("Fragment shader compilation result: ", &fragShaderError[0]);
 
-  set_message("Linking shaders", "");
-  GLuint program = glCreateProgram();
-  glAttachShader(program, vert_shader);
-  glAttachShader(program, frag_shader);
-  glLinkProgram(program);
+  GLuint program = handle->program;
   glGetProgramiv(program, GL_LINK_STATUS, &result);
   if (!result)
     success = false;
@@ -60,41 +286,190 @@ static GLuint load_shader(const std::string &vertex_path,
   set_message("GL Shader linker output: ", &err[0]);
   glDeleteShader(vert_shader);
   glDeleteShader(frag_shader);
+  handle->vertex_shader = 0;
+  handle->fragment_shader = 0;
 
   if (!success)
   {
-    set_message("GL Shader failed.", "");
-    ASSERT(0);
+    set_message("GL Shader failed: ",
+                handle->vertex_path + " " + handle->fragment_path);
+    handle->failed = true;
+    return false;
   }
   set_message("Shader linked successfully", "");
-  return program;
+  handle->ready = true;
+  handle->compile_time += get_real_time() - begin_time;
+  PROGRAM_COMPILE_TIME += handle->compile_time;
+  if (program_binaries_supported())
+    save_program_binary(program, handle->binary_key, handle->compile_time);
+  return true;
+}
+
+static std::shared_ptr<Shader::Shader_Handle>
+load_shader(const std::string &vertex_path, const std::string &fragment_path,
+            const std::string &defines, bool async)
+{
+  std::string full_vertex_path = BASE_SHADER_PATH + vertex_path;
+  std::string full_fragment_path = BASE_SHADER_PATH + fragment_path;
+  std::string vs =
+      insert_defines(read_file(full_vertex_path.c_str()), defines);
+  std::string fs =
+      insert_defines(read_file(full_fragment_path.c_str()), defines);
+
+#if DYNAMIC_SHADER_RELOADING
+  get_file_watcher().watch(full_vertex_path);
+  get_file_watcher().watch(full_fragment_path);
+#endif
+
+  auto handle = std::make_shared<Shader::Shader_Handle>(0);
+  handle->vertex_path = vertex_path;
+  handle->fragment_path = fragment_path;
+  handle->defines = defines;
+  const bool use_binary = program_binaries_supported();
+  const uint64 key = use_binary ? program_binary_key(vs, fs) : 0;
+  if (use_binary)
+  {
+    handle->program = load_program_binary(key);
+    if (handle->program)
+    {
+      set_message("Loaded program binary: ", vertex_path + " " + fragment_path);
+      return handle;
+    }
+  }
+
+  handle->binary_key = key;
+  handle->ready = false;
+  const float64 begin_time = get_real_time();
+  begin_program(handle.get(), vs, fs);
+  handle->compile_time = get_real_time() - begin_time;
+  if (async)
+  {
+    handle->issue_frame = ASYNC_SHADER_FRAME;
+    PENDING_PROGRAMS.push_back(handle);
+    return handle;
+  }
+  if (!finish_program(handle.get()))
+    ASSERT(0);
+  return handle;
+}
+
+void reload_shaders(const std::string &path)
+{
+  for (auto &entry : SHADER_CACHE)
+  {
+    std::shared_ptr<Shader::Shader_Handle> handle = entry.second.lock();
+    if (!handle || (BASE_SHADER_PATH + handle->vertex_path != path &&
+                    BASE_SHADER_PATH + handle->fragment_path != path))
+      continue;
+    set_message("Reloading shader: ",
+                handle->vertex_path + " " + handle->fragment_path);
+    const std::string vs = insert_defines(
+        read_file((BASE_SHADER_PATH + handle->vertex_path).c_str()),
+        handle->defines);
+    const std::string fs = insert_defines(
+        read_file((BASE_SHADER_PATH + handle->fragment_path).c_str()),
+        handle->defines);
+
+    // compiled on the side so a broken edit keeps the old program
+    Shader::Shader_Handle fresh(0);
+    fresh.vertex_path = handle->vertex_path;
+    fresh.fragment_path = handle->fragment_path;
+    fresh.binary_key =
+        program_binaries_supported() ? program_binary_key(vs, fs) : 0;
+    fresh.ready = false;
+    const float64 begin_time = get_real_time();
+    begin_program(&fresh, vs, fs);
+    fresh.compile_time = get_real_time() - begin_time;
+    if (!finish_program(&fresh))
+      continue;
+    // everything cached against the old program is stale
+    std::swap(handle->program, fresh.program);
+    handle->ready = true;
+    handle->failed = false;
+    handle->samplers_assigned = false;
+    handle->draw_uniform_locations.clear();
+  }
+}
+
+void update_async_shaders()
+{
+  ASYNC_SHADER_FRAME += 1;
+  if (PENDING_PROGRAMS.empty())
+    return;
+  const bool parallel = parallel_compile_supported();
+  auto finished = [&](std::weak_ptr<Shader::Shader_Handle> &weak) {
+    std::shared_ptr<Shader::Shader_Handle> handle = weak.lock();
+    if (!handle || handle->ready || handle->failed)
+      return true;
+    if (parallel)
+    {
+      GLint complete = 0;
+      glGetProgramiv(handle->program, gl::GL_COMPLETION_STATUS_KHR, &complete);
+      if (!complete)
+        return false;
+    }
+    // without the extension the driver may still block here, but it had
+    // a whole frame to work on it first
+    else if (handle->issue_frame == ASYNC_SHADER_FRAME - 1)
+      return false;
+    finish_program(handle.get());
+    return true;
+  };
+  PENDING_PROGRAMS.erase(std::remove_if(PENDING_PROGRAMS.begin(),
+                                        PENDING_PROGRAMS.end(), finished),
+                         PENDING_PROGRAMS.end());
 }
 
 Shader::Shader_Handle::Shader_Handle(GLuint i) { program = i; }
-Shader::Shader_Handle::~Shader_Handle() { glDeleteProgram(program); }
+Shader::Shader_Handle::~Shader_Handle()
+{
+  glDeleteShader(vertex_shader);
+  glDeleteShader(fragment_shader);
+  glDeleteProgram(program);
+}
 Shader::Shader() {}
-Shader::Shader(const std::string &vertex, const std::string &fragment)
+Shader::Shader(const std::string &vertex, const std::string &fragment,
+               const std::string &defines)
 {
-  load(vertex.c_str(), fragment.c_str());
+  load(vertex, fragment, defines);
 }
 
-void Shader::load(const std::string &vertex, const std::string &fragment)
+void Shader::load(const std::string &vertex, const std::string &fragment,
+                  const std::string &defines)
 {
-  std::string key = vertex;
-  key.append(fragment);
-  static std::unordered_map<std::string, std::weak_ptr<Shader_Handle>> cache;
+  load(vertex, fragment, defines, false);
+  if (!program->ready)
+  { // an earlier load_async of the same program is still going
+    if (!program->failed && !finish_program(program.get()))
+      ASSERT(0);
+    ASSERT(!program->failed);
+  }
+}
+
+void Shader::load_async(const std::string &vertex, const std::string &fragment,
+                        const std::string &defines)
+{
+  load(vertex, fragment, defines, true);
+}
 
-  auto ptr = cache[key].lock();
+void Shader::load(const std::string &vertex, const std::string &fragment,
+                  const std::string &defines, bool async)
+{
+  const Program_Key key = {vertex, fragment, defines};
+  auto ptr = SHADER_CACHE[key].lock();
   if (!ptr)
   {
-    ptr = std::make_shared<Shader_Handle>(load_shader(vertex, fragment));
-    cache[key] = ptr;
+    ptr = load_shader(vertex, fragment, defines, async);
+    SHADER_CACHE[key] = ptr;
   }
   program = ptr;
   vs = std::string(vertex);
   fs = std::string(fragment);
+  this->defines = defines;
 }
 
+bool Shader::is_ready() const { return program && program->ready; }
+
 void Shader::set_uniform(const char *name, float32 f)
 {
   GLint location = glGetUniformLocation(program->program, name);
@@ -3,12 +3,24 @@
 #include <glm/glm.hpp>
 #include <memory>
 #include <string>
+#include <vector>
 using namespace glm;
 struct Shader
 {
   Shader();
-  Shader(const std::string &vertex, const std::string &fragment);
-  void load(const std::string &vertex, const std::string &fragment);
+  // defines are "#define NAME value" lines inserted after #version in both
+  // stages, each distinct set is compiled and cached as its own program
+  Shader(const std::string &vertex, const std::string &fragment,
+         const std::string &defines = "");
+  void load(const std::string &vertex, const std::string &fragment,
+            const std::string &defines = "");
+
+  // returns right away, the program compiles in the background where the
+  // driver supports it and is_ready() turns true in update_async_shaders()
+  // a failed compile is logged and never becomes ready
+  void load_async(const std::string &vertex, const std::string &fragment,
+                  const std::string &defines = "");
+  bool is_ready() const;
 
   void set_uniform(const char *name, uint32 i);
   void set_uniform(const char *name, int32 i);
@@ -25,14 +37,45 @@ struct Shader
     Shader_Handle(GLuint i);
     ~Shader_Handle();
     GLuint program = 0;
+    // false while an async load is compiling
+    bool ready = true;
+    bool failed = false;
+    // only kept until the compile is checked
+    GLuint vertex_shader = 0;
+    GLuint fragment_shader = 0;
+    // relative to BASE_SHADER_PATH
+    std::string vertex_path;
+    std::string fragment_path;
+    std::string defines;
+    // set by Material::bind
+    bool samplers_assigned = false;
+    uint64 binary_key = 0;
+    uint64 issue_frame = 0;
+    float64 compile_time = 0;
+    // resolved by the renderer on first draw, indexed by Draw_Uniform
+    std::vector<GLint> draw_uniform_locations;
   };
   std::shared_ptr<Shader_Handle> program;
   std::string vs;
   std::string fs;
+  std::string defines;
 
 private:
+  void load(const std::string &vertex, const std::string &fragment,
+            const std::string &defines, bool async);
   void check_err(GLint loc, const char *name);
 
   // todo: create create every uniform as an int =-1 and assign their binding
   // locations to avoid get_uniform_location spam
 };
+
+// logs the compile time the program binary cache saved so far
+void log_program_cache_stats();
+
+// checks the programs started with Shader::load_async, once per frame
+void update_async_shaders();
+
+// recompiles every cached program that uses the shader file at path, in
+// place, so every Shader sharing it picks it up
+// programs that fail to compile keep their previous version
+void reload_shaders(const std::string &path);
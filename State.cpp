@@ -40,6 +40,8 @@ void State::prepare_renderer(double t)
   // camera must be set before entities, or they get a 1 frame lag
   renderer.set_camera(cam.pos, cam.dir);
 
+  scene.update_imports();
+
   // Traverse graph nodes and submit to renderer for packing:
   auto render_entities = scene.visit_nodes_st_start();
   renderer.set_render_entities(&render_entities);
@@ -52,6 +54,12 @@ void State::reset_mouse_delta()
   SDL_GetRelativeMouseState(&mouse_delta.x, &mouse_delta.y);
 }
 
+void State::set_camera(vec3 pos, vec3 dir)
+{
+  cam.pos = pos;
+  cam.dir = dir;
+}
+
 void State::render(float64 t)
 {
   prepare_renderer(t);
@@ -80,6 +88,7 @@ void State::performance_output()
     s << "\nTotal FPS:" << (float64)frame_count / current_time;
     s << "\nRender Scale: " << renderer.get_render_scale();
     s << "\nDraw calls: " << renderer.draw_calls_last_frame;
+    s << renderer.frame_timing_report();
     set_message("Performance output: ", s.str(), report_delay / 2);
     std::cout << get_messages() << std::endl;
   }
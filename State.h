@@ -32,6 +32,8 @@ struct State
   void reset_mouse_delta();
   bool running = true;
   void performance_output();
+  // overrides the input driven camera until the next handle_input()
+  void set_camera(vec3 pos, vec3 dir);
   std::string state_name;
   Render renderer;
   Scene_Graph scene;
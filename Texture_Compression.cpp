@@ -0,0 +1,287 @@
+#include "Texture_Compression.h"
+#include "Globals.h"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+// 'WARG' in dds reserved1[2] marks files written by save_dds
+#define DDS_CACHE_TAG 0x47524157
+#define FOURCC(a, b, c, d)                                                     \
+  ((uint32)(a) | ((uint32)(b) << 8) | ((uint32)(c) << 16) | ((uint32)(d) << 24))
+
+static uint32 block_bytes(Block_Format format)
+{
+  return format == bc1 ? 8 : 16;
+}
+
+size_t compressed_level_size(Block_Format format, ivec2 size)
+{
+  const ivec2 blocks = (size + 3) / 4;
+  return size_t(blocks.x) * blocks.y * block_bytes(format);
+}
+
+static uint16 to_565(ivec3 c)
+{
+  return uint16(((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3));
+}
+
+static ivec3 from_565(uint16 c)
+{
+  const int32 r = (c >> 11) & 31;
+  const int32 g = (c >> 5) & 63;
+  const int32 b = c & 31;
+  return ivec3((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2));
+}
+
+// 16 rgba pixels -> 8 bytes, endpoints from the inset bounding box
+static void encode_color_block(const uint8 *pixels, uint8 *out)
+{
+  ivec3 lo = ivec3(255);
+  ivec3 hi = ivec3(0);
+  for (uint32 i = 0; i < 16; ++i)
+  {
+    const ivec3 c = ivec3(pixels[4 * i], pixels[4 * i + 1], pixels[4 * i + 2]);
+    lo = min(lo, c);
+    hi = max(hi, c);
+  }
+  // the extremes are usually outliers
+  const ivec3 inset = (hi - lo) / 16;
+  lo = min(lo + inset, ivec3(255));
+  hi = max(hi - inset, ivec3(0));
+
+  uint16 c0 = to_565(hi);
+  uint16 c1 = to_565(lo);
+  // c0 > c1 selects the four colour mode
+  if (c0 < c1)
+    std::swap(c0, c1);
+  uint32 indices = 0;
+  if (c0 != c1)
+  {
+    ivec3 palette[4];
+    palette[0] = from_565(c0);
+    palette[1] = from_565(c1);
+    palette[2] = (2 * palette[0] + palette[1]) / 3;
+    palette[3] = (palette[0] + 2 * palette[1]) / 3;
+    for (uint32 i = 0; i < 16; ++i)
+    {
+      const ivec3 c =
+          ivec3(pixels[4 * i], pixels[4 * i + 1], pixels[4 * i + 2]);
+      uint32 best = 0;
+      int32 best_distance = INT32_MAX;
+      for (uint32 j = 0; j < 4; ++j)
+      {
+        const ivec3 d = c - palette[j];
+        const int32 distance = d.x * d.x + d.y * d.y + d.z * d.z;
+        if (distance < best_distance)
+        {
+          best = j;
+          best_distance = distance;
+        }
+      }
+      indices |= best << (2 * i);
+    }
+  }
+  out[0] = c0 & 0xff;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 0xff;
+  out[3] = c1 >> 8;
+  memcpy(out + 4, &indices, 4);
+}
+
+// one channel of 16 pixels, stride apart -> 8 bytes
+static void encode_channel_block(const uint8 *pixels, uint32 stride,
+                                 uint8 *out)
+{
+  int32 lo = 255;
+  int32 hi = 0;
+  for (uint32 i = 0; i < 16; ++i)
+  {
+    lo = glm::min(lo, (int32)pixels[i * stride]);
+    hi = glm::max(hi, (int32)pixels[i * stride]);
+  }
+  // a0 > a1 selects the eight value mode, equal means every index is 0
+  int32 palette[8] = {hi, lo};
+  for (int32 i = 1; i < 7; ++i)
+    palette[i + 1] = ((7 - i) * hi + i * lo) / 7;
+  uint64 indices = 0;
+  if (hi != lo)
+  {
+    for (uint32 i = 0; i < 16; ++i)
+    {
+      const int32 value = pixels[i * stride];
+      uint64 best = 0;
+      int32 best_distance = INT32_MAX;
+      for (uint32 j = 0; j < 8; ++j)
+      {
+        const int32 distance = glm::abs(value - palette[j]);
+        if (distance < best_distance)
+        {
+          best = j;
+          best_distance = distance;
+        }
+      }
+      indices |= best << (3 * i);
+    }
+  }
+  out[0] = uint8(hi);
+  out[1] = uint8(lo);
+  for (uint32 i = 0; i < 6; ++i)
+    out[2 + i] = uint8(indices >> (8 * i));
+}
+
+static void compress_level(const uint8 *rgba, ivec2 size, Block_Format format,
+                           uint8 *out)
+{
+  uint8 block[64];
+  for (int32 by = 0; by < size.y; by += 4)
+  {
+    for (int32 bx = 0; bx < size.x; bx += 4)
+    {
+      // partial blocks at the edges repeat the last row/column
+      for (int32 y = 0; y < 4; ++y)
+      {
+        for (int32 x = 0; x < 4; ++x)
+        {
+          const int32 sx = glm::min(bx + x, size.x - 1);
+          const int32 sy = glm::min(by + y, size.y - 1);
+          memcpy(&block[4 * (4 * y + x)], &rgba[4 * (sy * size.x + sx)], 4);
+        }
+      }
+      if (format == bc1)
+      {
+        encode_color_block(block, out);
+      }
+      else if (format == bc3)
+      {
+        encode_channel_block(block + 3, 4, out);
+        encode_color_block(block, out + 8);
+      }
+      else
+      {
+        encode_channel_block(block, 4, out);
+        encode_channel_block(block + 1, 4, out + 8);
+      }
+      out += block_bytes(format);
+    }
+  }
+}
+
+void compress_image(const Mip_Chain &mips, Block_Format format,
+                    Compressed_Image *result)
+{
+  result->format = format;
+  result->size = mips.size;
+  result->data.clear();
+  result->level_offsets.assign(1, 0);
+  for (uint32 level = 0; level < mips.level_count(); ++level)
+  {
+    const ivec2 size = mips.level_size(level);
+    const size_t offset = result->data.size();
+    result->data.resize(offset + compressed_level_size(format, size));
+    compress_level(mips.level(level), size, format, &result->data[offset]);
+    result->level_offsets.push_back(result->data.size());
+  }
+}
+
+// the 124 byte header that follows "DDS "
+struct Dds_Header
+{
+  uint32 size;
+  uint32 flags;
+  uint32 height;
+  uint32 width;
+  uint32 linear_size;
+  uint32 depth;
+  uint32 mip_count;
+  uint32 reserved1[11];
+  uint32 format_size;
+  uint32 format_flags;
+  uint32 four_cc;
+  uint32 format_unused[5];
+  uint32 caps[4];
+  uint32 reserved2;
+};
+static_assert(sizeof(Dds_Header) == 124, "");
+
+static uint32 four_cc(Block_Format format)
+{
+  if (format == bc1)
+    return FOURCC('D', 'X', 'T', '1');
+  if (format == bc3)
+    return FOURCC('D', 'X', 'T', '5');
+  return FOURCC('A', 'T', 'I', '2');
+}
+
+bool save_dds(const std::string &path, const Compressed_Image &image,
+              uint64 stamp)
+{
+  Dds_Header header;
+  memset(&header, 0, sizeof(header));
+  header.size = sizeof(Dds_Header);
+  // caps, height, width, pixelformat, mipmapcount, linearsize
+  header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000;
+  header.height = image.size.y;
+  header.width = image.size.x;
+  header.linear_size = image.level_offsets[1];
+  header.mip_count = image.level_count();
+  header.reserved1[0] = uint32(stamp);
+  header.reserved1[1] = uint32(stamp >> 32);
+  header.reserved1[2] = DDS_CACHE_TAG;
+  header.format_size = 32;
+  header.format_flags = 0x4; // fourcc
+  header.four_cc = four_cc(image.format);
+  // texture, mipmap, complex
+  header.caps[0] = 0x1000 | 0x400000 | 0x8;
+
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  if (!file.is_open())
+    return false;
+  file.write("DDS ", 4);
+  file.write((const char *)&header, sizeof(header));
+  file.write((const char *)image.data.data(), image.data.size());
+  return file.good();
+}
+
+bool load_dds(const std::string &path, uint64 stamp, Compressed_Image *result)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+  char magic[4];
+  Dds_Header header;
+  file.read(magic, 4);
+  file.read((char *)&header, sizeof(header));
+  if (!file || memcmp(magic, "DDS ", 4) != 0 ||
+      header.reserved1[2] != DDS_CACHE_TAG ||
+      header.reserved1[0] != uint32(stamp) ||
+      header.reserved1[1] != uint32(stamp >> 32))
+    return false;
+
+  if (header.four_cc == four_cc(bc1))
+    result->format = bc1;
+  else if (header.four_cc == four_cc(bc3))
+    result->format = bc3;
+  else if (header.four_cc == four_cc(bc5))
+    result->format = bc5;
+  else
+    return false;
+  result->size = ivec2(header.width, header.height);
+  if (result->size.x <= 0 || result->size.y <= 0 || header.mip_count == 0 ||
+      header.mip_count > 32)
+    return false;
+
+  result->level_offsets.assign(1, 0);
+  for (uint32 level = 0; level < header.mip_count; ++level)
+  {
+    const ivec2 level_size = result->level_size(level);
+    result->level_offsets.push_back(
+        result->level_offsets.back() +
+        compressed_level_size(result->format, level_size));
+  }
+  // only full chains are written
+  if (result->level_size(header.mip_count - 1) != ivec2(1))
+    return false;
+  result->data.resize(result->level_offsets.back());
+  file.read((char *)result->data.data(), result->data.size());
+  return bool(file);
+}
@@ -0,0 +1,44 @@
+#pragma once
+#include "Globals.h"
+#include "Image_Processing.h"
+#include <glm/glm.hpp>
+#include <string>
+#include <vector>
+using namespace glm;
+
+// block compression and the dds cache files for it
+// cpu only, so all of it can run on the job system
+enum Block_Format
+{
+  bc1, // rgb, 4 bits per pixel
+  bc3, // rgba, 8 bits per pixel
+  bc5  // two channels for normal maps, 8 bits per pixel
+};
+
+struct Compressed_Image
+{
+  Block_Format format = bc1;
+  ivec2 size = ivec2(0); // of the first level
+  // every level down to 1x1, largest first
+  std::vector<uint8> data;
+  // start of each level in data, plus the end
+  std::vector<size_t> level_offsets;
+
+  uint32 level_count() const { return level_offsets.size() - 1; }
+  ivec2 level_size(uint32 level) const
+  {
+    return max(ivec2(size.x >> level, size.y >> level), ivec2(1));
+  }
+};
+
+size_t compressed_level_size(Block_Format format, ivec2 size);
+
+// compresses every level
+void compress_image(const Mip_Chain &mips, Block_Format format,
+                    Compressed_Image *result);
+
+// stamp identifies the source and how it was processed, a file with a
+// different stamp is stale
+bool save_dds(const std::string &path, const Compressed_Image &image,
+              uint64 stamp);
+bool load_dds(const std::string &path, uint64 stamp, Compressed_Image *result);
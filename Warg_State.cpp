@@ -798,7 +798,7 @@ void Warg_State::update()
       }
       if (d.duration <= 0)
       {
-        set_message("", d.def.name + " falls off " + c->name, 3.0f);
+        set_message("", s(d.def.name, " falls off ", c->name), 3.0f);
         if (d.dynamic)
         {
           for (auto &te : d.def.tick_effects)
@@ -868,7 +868,7 @@ void Warg_State::update()
     if (d < 0.5)
     {
       set_message(
-          "", o.caster->name + "'s " + o.def.name + " hit " + o.target->name,
+          "", s(o.caster->name, "'s ", o.def.name, " hit ", o.target->name),
           3.0f);
       for (auto &e : o.def.effects)
       {
@@ -913,7 +913,7 @@ void Warg_State::add_wall(vec3 p1, vec2 p2, float32 h)
   d = vec3(p1.x, p1.y, h);
 
   add_quad(a, b, c, d, data);
-  auto mesh = scene.add_mesh(data, material, "some wall");
+  auto mesh = scene.add_mesh(data, material, "some wall", nullptr, true);
 
   walls.push_back(Wall{p1, p2, h});
   wall_meshes.push_back(mesh);
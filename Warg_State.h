@@ -6,7 +6,7 @@ struct Character;
 
 struct SpellObjectDef
 {
-  std::string name;
+  Symbol name;
   float32 speed;
   std::vector<SpellEffect *> effects;
 };
@@ -29,7 +29,7 @@ enum SpellTargets
 
 struct SpellDef
 {
-  std::string name;
+  Symbol name;
   int mana_cost;
   float32 range;
   SpellTargets targets;
@@ -101,7 +101,7 @@ enum SpellEffectType
 
 struct SpellEffect
 {
-  std::string name;
+  Symbol name;
   SpellEffectType type;
   union {
     HealEffect heal;
@@ -162,7 +162,7 @@ struct CharMod
 
 struct BuffDef
 {
-  std::string name;
+  Symbol name;
   float32 duration;
   float32 tick_freq;
   std::vector<SpellEffect *> tick_effects;
@@ -204,7 +204,7 @@ struct Character
 
   CharStats b_stats, e_stats;
 
-  std::map<std::string, Spell> spellbook;
+  std::unordered_map<Symbol, Spell> spellbook;
 
   std::vector<Buff> buffs, debuffs;
 
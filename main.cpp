@@ -1,4 +1,7 @@
+#include "Baked_Model.h"
 #include "Globals.h"
+#include "Headless.h"
+#include "Image_Processing.h"
 #include "Render.h"
 #include "State.h"
 #include "Warg_State.h"
@@ -10,10 +13,70 @@
 #include <sstream>
 #include <stdlib.h>
 
+// no window or vsync, see Headless.h
+static int headless_main(Headless_Options options)
+{
+  if (options.usage_error)
+  {
+    push_log_to_disk();
+    return 2;
+  }
+  // no video subsystem, there may not be a display to talk to
+  SDL_Init(SDL_INIT_TIMER | SDL_INIT_EVENTS);
+  if (!create_headless_context())
+  {
+    set_message("Failed to create a headless OpenGL context.");
+    push_log_to_disk();
+    SDL_Quit();
+    return 1;
+  }
+  // glbinding resolves through the glx/wgl loader, which with glvnd hands
+  // back dispatch stubs that work for the EGL context too
+  glbinding::Binding::initialize();
+  INIT_RENDERER();
+
+  std::vector<State *> states;
+  Warg_State game_state("Game State", nullptr, options.size);
+  states.push_back((State *)&game_state);
+  Render_Test_State render_test_state(
+      "Render Test State", nullptr, options.size);
+  states.push_back((State *)&render_test_state);
+  log_program_cache_stats();
+  int result = run_headless_benchmark(states, options);
+
+  push_log_to_disk();
+  CLEANUP_RENDERER();
+  destroy_headless_context();
+  SDL_Quit();
+  return result;
+}
+
 int main(int argc, char *argv[])
 {
   SDL_ClearError();
   generator.seed(1234);
+  uint32 frames_in_flight = FRAMES_IN_FLIGHT;
+  for (int32 i = 1; i < argc; ++i)
+  {
+    // how far the cpu may run ahead of the gpu, --frames-in-flight=N
+    const std::string flight_prefix = "--frames-in-flight=";
+    const std::string arg = argv[i];
+    if (arg.compare(0, flight_prefix.size(), flight_prefix) == 0 &&
+        !parse_number(arg.substr(flight_prefix.size()), &frames_in_flight))
+    {
+      set_message("Usage error, bad value in: ", arg);
+      std::cerr << "Usage error, bad value in: " << arg << "\n";
+      return 2;
+    }
+    if (std::string(argv[i]) == "--image-benchmark")
+      return benchmark_image_processing();
+    // bakes everything under Assets/Models ahead of time, see Baked_Model.h
+    if (std::string(argv[i]) == "--cook-models")
+      return cook_models();
+  }
+  Headless_Options headless_options;
+  if (parse_headless_options(argc, argv, &headless_options))
+    return headless_main(headless_options);
   SDL_Init(SDL_INIT_EVERYTHING);
   uint32 display_count = uint32(SDL_GetNumVideoDisplays());
   std::stringstream s;
@@ -84,6 +147,9 @@ int main(int argc, char *argv[])
   states.push_back((State *)&game_state);
   Render_Test_State render_test_state("Render Test State", window, window_size);
   states.push_back((State *)&render_test_state);
+  for (State *state : states)
+    state->renderer.set_frames_in_flight(frames_in_flight);
+  log_program_cache_stats();
   State *current_state = &*states[0];
   while (current_state->running)
   {
@@ -101,7 +167,8 @@ int main(int argc, char *argv[])
     }
     const float64 time = real_time - current_state->paused_time_accumulator;
     elapsed_time = time - current_state->current_time;
-    set_message("time", std::to_string(time), 1);
+    static const Symbol time_message = "time";
+    set_message(time_message, std::to_string(time), 1);
     if (elapsed_time > 0.3)
       elapsed_time = 0.3;
     last_time = current_state->current_time;
@@ -115,8 +182,7 @@ int main(int argc, char *argv[])
       if (s != current_state)
       {
         s->paused = true;
-        current_state->renderer.set_render_scale(
-            current_state->renderer.get_render_scale());
+        current_state->renderer.invalidate_history();
         break;
       }
     }